@@ -0,0 +1,791 @@
+// Benchmark suite of wav2png, run by `make bench`.
+//
+// Microbenchmarks time the reduction kernels of every instruction set the CPU
+// supports, the mapping of reduced columns to pixel spans and the
+// rasterization and encoding of images, on synthetic samples. End-to-end runs
+// time the wav2png binary on generated WAV files across formats, lengths and
+// render settings. All inputs are generated deterministically, so runs on the
+// same machine are comparable.
+//
+// Results are written as JSON lines, one per benchmark, and can be compared
+// against the results of an earlier run: a benchmark that got slower, or an
+// end-to-end run that needs more memory, by more than the tolerance fails the
+// comparison.
+
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "png_writer.hpp"
+#include "rasterizer.hpp"
+#include "reduce_kernels.hpp"
+#include "wav2png.hpp"
+
+namespace fs = std::filesystem;
+namespace po = boost::program_options;
+
+namespace {
+
+constexpr unsigned sample_rate = 44100;
+
+// Samples per microbenchmark buffer, about a column of a one hour input in a
+// 1800 pixel wide image
+constexpr std::size_t micro_samples = 1 << 18;
+
+enum class signal_kind { sine, noise, silence, clipped };
+
+const signal_kind all_signals[] = { signal_kind::sine, signal_kind::noise, signal_kind::silence, signal_kind::clipped };
+
+const char* signal_name(signal_kind signal) {
+    switch (signal) {
+    case signal_kind::sine: return "sine";
+    case signal_kind::noise: return "noise";
+    case signal_kind::silence: return "silence";
+    case signal_kind::clipped: return "clipped";
+    }
+    return "";
+}
+
+// Sample formats of generated WAV files
+enum class file_format { s16, s24, f32 };
+
+const file_format all_formats[] = { file_format::s16, file_format::s24, file_format::f32 };
+
+const char* format_name(file_format format) {
+    switch (format) {
+    case file_format::s16: return "s16";
+    case file_format::s24: return "s24";
+    case file_format::f32: return "f32";
+    }
+    return "";
+}
+
+unsigned bytes_per_sample(file_format format) {
+    return format == file_format::s16 ? 2 : format == file_format::s24 ? 3 : 4;
+}
+
+// Sample values in [-1, 1] of one channel. The noise is drawn from a fixed
+// seed, so the values are the same on every machine and run.
+class signal_generator {
+public:
+    signal_generator(signal_kind signal, unsigned channel)
+        : signal_(signal), phase_(channel * 0.5), random_(0x5eed + channel) {}
+
+    double next() {
+        const double t = static_cast<double>(frame_++) / sample_rate;
+        constexpr double two_pi = 6.283185307179586;
+
+        switch (signal_) {
+        case signal_kind::sine:
+            return 0.8 * std::sin(two_pi * 440.0 * t + phase_);
+        case signal_kind::noise:
+            return 1.8 * (static_cast<double>(random_()) / std::mt19937::max()) - 0.9;
+        case signal_kind::silence:
+            return 0.0;
+        case signal_kind::clipped:
+            return std::clamp(2.0 * std::sin(two_pi * 110.0 * t + phase_), -1.0, 1.0);
+        }
+        return 0.0;
+    }
+
+private:
+    signal_kind signal_;
+    double phase_;
+    std::mt19937 random_;
+    std::uint64_t frame_ = 0;
+};
+
+// Sample types of the renderer: 16 bit, left-justified 32 bit and float
+template <typename T>
+T to_sample(double value);
+
+template <>
+short to_sample<short>(double value) {
+    return static_cast<short>(std::lround(value * 32767.0));
+}
+
+template <>
+int to_sample<int>(double value) {
+    return static_cast<int>(std::lround(value * 8388607.0)) * 256;
+}
+
+template <>
+float to_sample<float>(double value) {
+    return static_cast<float>(value);
+}
+
+// Interleaved samples of frames frames
+template <typename T>
+std::vector<T> make_samples(signal_kind signal, std::size_t frames, unsigned channels) {
+    std::vector<signal_generator> generators;
+    for (unsigned c = 0; c < channels; ++c) {
+        generators.emplace_back(signal, c);
+    }
+
+    std::vector<T> samples;
+    samples.reserve(frames * channels);
+    for (std::size_t i = 0; i < frames; ++i) {
+        for (auto& generator : generators) {
+            samples.push_back(to_sample<T>(generator.next()));
+        }
+    }
+    return samples;
+}
+
+void put_le(std::ostream& out, std::uint32_t value, unsigned bytes) {
+    for (unsigned i = 0; i < bytes; ++i, value >>= 8) {
+        out.put(static_cast<char>(value & 0xff));
+    }
+}
+
+// Write a WAV file of a generated signal
+void write_wav(const fs::path& path, signal_kind signal, file_format format, unsigned channels, unsigned seconds) {
+    const std::uint32_t frames = sample_rate * seconds;
+    const unsigned sample_bytes = bytes_per_sample(format);
+    const std::uint32_t data_bytes = frames * channels * sample_bytes;
+    const bool is_float = format == file_format::f32;
+
+    const fs::path temp = path.string() + ".tmp";
+    std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+
+    // Float files need the extended fmt chunk and a fact chunk
+    const std::uint32_t fmt_bytes = is_float ? 18 : 16;
+    const std::uint32_t fact_bytes = is_float ? 12 : 0;
+    out << "RIFF";
+    put_le(out, 4 + 8 + fmt_bytes + fact_bytes + 8 + data_bytes, 4);
+    out << "WAVEfmt ";
+    put_le(out, fmt_bytes, 4);
+    put_le(out, is_float ? 3 : 1, 2);
+    put_le(out, channels, 2);
+    put_le(out, sample_rate, 4);
+    put_le(out, sample_rate * channels * sample_bytes, 4);
+    put_le(out, channels * sample_bytes, 2);
+    put_le(out, sample_bytes * 8, 2);
+    if (is_float) {
+        put_le(out, 0, 2);
+        out << "fact";
+        put_le(out, 4, 4);
+        put_le(out, frames, 4);
+    }
+    out << "data";
+    put_le(out, data_bytes, 4);
+
+    std::vector<signal_generator> generators;
+    for (unsigned c = 0; c < channels; ++c) {
+        generators.emplace_back(signal, c);
+    }
+
+    for (std::uint32_t i = 0; i < frames; ++i) {
+        for (auto& generator : generators) {
+            const double value = generator.next();
+            if (format == file_format::f32) {
+                const float f = static_cast<float>(value);
+                std::uint32_t bits;
+                std::memcpy(&bits, &f, 4);
+                put_le(out, bits, 4);
+            } else if (format == file_format::s24) {
+                put_le(out, static_cast<std::uint32_t>(std::lround(value * 8388607.0)), 3);
+            } else {
+                put_le(out, static_cast<std::uint32_t>(to_sample<short>(value)), 2);
+            }
+        }
+    }
+
+    out.close();
+    if (!out) {
+        throw std::runtime_error("failed to write '" + temp.string() + "'");
+    }
+    fs::rename(temp, path);
+}
+
+// Keep the compiler from discarding a result that is not otherwise used
+template <typename T>
+void keep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct bench_settings {
+    int repeat = 5;
+    double min_seconds = 0.05;
+    std::string filter;
+};
+
+// Result of one benchmark. Times are those of the fastest repetition, which is
+// the least disturbed by the rest of the system.
+struct bench_result {
+    std::string name;
+    std::string unit;           // what a run processes: sample, column or pixel
+    double seconds = 0.0;       // per run
+    double units = 0.0;         // per run
+    double bytes = 0.0;         // per run
+    long peak_rss_kb = -1;      // of end-to-end runs
+
+    double ns_per_unit() const {
+        return units > 0.0 ? seconds * 1e9 / units : 0.0;
+    }
+
+    double mb_per_s() const {
+        return seconds > 0.0 ? bytes / seconds / 1e6 : 0.0;
+    }
+};
+
+std::string to_json(const bench_result& result) {
+    std::ostringstream json;
+    json << std::setprecision(6) << "{\"name\":\"" << result.name << "\",\"unit\":\"" << result.unit
+         << "\",\"seconds\":" << result.seconds << ",\"ns_per_unit\":" << result.ns_per_unit()
+         << ",\"mb_per_s\":" << result.mb_per_s() << ",\"peak_rss_kb\":" << result.peak_rss_kb << "}";
+    return json.str();
+}
+
+// Value of a field of a JSON line written by to_json, NaN if missing
+double json_number(const std::string& line, const std::string& field) {
+    const std::string key = "\"" + field + "\":";
+    const std::size_t at = line.find(key);
+    return at == std::string::npos ? std::nan("") : std::strtod(line.c_str() + at + key.size(), nullptr);
+}
+
+std::string json_string(const std::string& line, const std::string& field) {
+    const std::string key = "\"" + field + "\":\"";
+    const std::size_t at = line.find(key);
+    if (at == std::string::npos) {
+        return {};
+    }
+    const std::size_t begin = at + key.size();
+    return line.substr(begin, line.find('"', begin) - begin);
+}
+
+class bench_runner {
+public:
+    bench_runner(const bench_settings& settings, std::ostream* json)
+        : settings_(settings), json_(json) {}
+
+    const bench_settings& settings() const noexcept {
+        return settings_;
+    }
+
+    bool selected(const std::string& name) const {
+        return settings_.filter.empty() || name.find(settings_.filter) != std::string::npos;
+    }
+
+    // Call f repeatedly for at least min_seconds per repetition and return the
+    // time of a single call in the fastest repetition
+    template <typename function_type>
+    double time_best(function_type&& f) const {
+        using clock = std::chrono::steady_clock;
+        double best = std::numeric_limits<double>::infinity();
+
+        for (int r = 0; r < settings_.repeat; ++r) {
+            std::size_t calls = 0;
+            double elapsed = 0.0;
+            const auto start = clock::now();
+            do {
+                f();
+                ++calls;
+                elapsed = std::chrono::duration<double>(clock::now() - start).count();
+            } while (elapsed < settings_.min_seconds);
+            best = std::min(best, elapsed / static_cast<double>(calls));
+        }
+        return best;
+    }
+
+    void report(const bench_result& result) {
+        std::cout << std::left << std::setw(48) << result.name << std::right << std::fixed
+                  << std::setprecision(3) << std::setw(12) << result.ns_per_unit() << " ns/" << std::setw(6)
+                  << std::left << result.unit << std::right << std::setprecision(1) << std::setw(10)
+                  << result.mb_per_s() << " MB/s";
+        if (result.peak_rss_kb >= 0) {
+            std::cout << std::setw(10) << result.peak_rss_kb / 1024 << " MB RSS";
+        }
+        std::cout << std::endl;
+
+        if (json_) {
+            *json_ << to_json(result) << std::endl;
+        }
+        results_.push_back(result);
+    }
+
+    const std::vector<bench_result>& results() const noexcept {
+        return results_;
+    }
+
+private:
+    bench_settings settings_;
+    std::ostream* json_;
+    std::vector<bench_result> results_;
+};
+
+// Reduction kernels
+
+template <typename T>
+void bench_reduce(
+    bench_runner& runner,
+    const reduce_kernels& kernels,
+    const char* type_name,
+    void (*minmax_fn)(const T*, std::size_t, T&, T&),
+    void (*moments_fn)(const T*, std::size_t, sample_moments<T>&),
+    void (*split_fn)(const T*, std::size_t, T*, T*, T*, T*)
+) {
+    for (const signal_kind signal : all_signals) {
+        const std::string suffix = std::string("/") + kernels.name + "/" + type_name + "/" + signal_name(signal);
+        const std::string minmax_name = "reduce/minmax" + suffix;
+        const std::string moments_name = "reduce/moments" + suffix;
+        const std::string split_name = "reduce/split" + suffix;
+        if (!runner.selected(minmax_name) && !runner.selected(moments_name) && !runner.selected(split_name)) {
+            continue;
+        }
+
+        const std::vector<T> samples = make_samples<T>(signal, micro_samples / 2, 2);
+        const double bytes = static_cast<double>(samples.size() * sizeof(T));
+
+        if (runner.selected(minmax_name)) {
+            const double seconds = runner.time_best([&] {
+                T min_val = 0;
+                T max_val = 0;
+                minmax_fn(samples.data(), samples.size(), min_val, max_val);
+                keep(min_val);
+                keep(max_val);
+            });
+            runner.report({ minmax_name, "sample", seconds, static_cast<double>(samples.size()), bytes });
+        }
+
+        if (runner.selected(moments_name)) {
+            const double seconds = runner.time_best([&] {
+                sample_moments<T> moments;
+                moments_fn(samples.data(), samples.size(), moments);
+                keep(moments);
+            });
+            runner.report({ moments_name, "sample", seconds, static_cast<double>(samples.size()), bytes });
+        }
+
+        // Stereo frames into both channels, mid and side
+        if (runner.selected(split_name)) {
+            const std::size_t frames = samples.size() / 2;
+            std::vector<T> left(frames), right(frames), mid(frames), side(frames);
+            const double seconds = runner.time_best([&] {
+                split_fn(samples.data(), frames, left.data(), right.data(), mid.data(), side.data());
+                keep(side.back());
+            });
+            runner.report({ split_name, "sample", seconds, static_cast<double>(samples.size()), bytes });
+        }
+    }
+}
+
+void bench_reduce_kernels(bench_runner& runner) {
+    for (const char* name : { "scalar", "sse2", "avx2", "avx512" }) {
+        const reduce_kernels* kernels = find_reduce_kernels(name);
+        if (!kernels) {
+            continue;
+        }
+        bench_reduce<short>(
+            runner, *kernels, "s16", kernels->minmax_s16, kernels->moments_s16, kernels->split_stereo_s16);
+        bench_reduce<int>(
+            runner, *kernels, "s32", kernels->minmax_s32, kernels->moments_s32, kernels->split_stereo_s32);
+        bench_reduce<float>(
+            runner, *kernels, "f32", kernels->minmax_f32, kernels->moments_f32, kernels->split_stereo_f32);
+    }
+}
+
+// Extents of columns of noise of height h
+std::vector<column_extent> make_extents(std::size_t columns, std::uint32_t h) {
+    std::mt19937 random(0x5eed);
+    std::vector<column_extent> extents(columns);
+    for (auto& extent : extents) {
+        const std::uint32_t half = random() % (h / 2);
+        extent.y1 = h / 2 - half;
+        extent.y2 = h / 2 + half + 1;
+        extent.y_median = extent.y1 + random() % (extent.y2 - extent.y1);
+    }
+    return extents;
+}
+
+// Mapping of reduced columns to pixels: the spans of the extents, and the
+// whole reduction of pushed samples, which maps every column in linear or dB
+// scale
+
+void bench_mapping(bench_runner& runner) {
+    for (const std::size_t width : { 1800, 16384 }) {
+        for (const bool line_only : { false, true }) {
+            const std::string name = "map/spans/" + std::string(line_only ? "line" : "fill") + "/w" + std::to_string(width);
+            if (!runner.selected(name)) {
+                continue;
+            }
+
+            const std::vector<column_extent> extents = make_extents(width, 280);
+            const double seconds = runner.time_best([&] {
+                const std::vector<column_span> spans = build_spans(extents, width, 280, line_only);
+                keep(spans.front());
+            });
+            runner.report({ name, "column", seconds, static_cast<double>(width),
+                static_cast<double>(width * sizeof(column_extent)) });
+        }
+    }
+
+    // A minute of audio, so that setting up and finishing the stream is not
+    // what is measured
+    const std::size_t frames = sample_rate * 60;
+    for (const unsigned width : { 1800u, 16384u }) {
+        for (const bool db_scale : { false, true }) {
+            for (const pcm_format format : { pcm_format::s16, pcm_format::f32 }) {
+                const bool is_float = format == pcm_format::f32;
+                const std::string name = std::string("map/stream/") + (is_float ? "f32" : "s16") + "/"
+                    + (db_scale ? "db" : "linear") + "/w" + std::to_string(width);
+                if (!runner.selected(name)) {
+                    continue;
+                }
+
+                waveform_params params;
+                params.width = width;
+                params.use_db_scale = db_scale;
+
+                const std::vector<short> s16 = is_float ? std::vector<short>() : make_samples<short>(signal_kind::noise, frames, 2);
+                const std::vector<float> f32 = is_float ? make_samples<float>(signal_kind::noise, frames, 2) : std::vector<float>();
+                waveform_data data;
+
+                const double seconds = runner.time_best([&] {
+                    WaveformStream stream(2, format, params);
+                    if (is_float) {
+                        stream.push(f32.data(), frames);
+                    } else {
+                        stream.push(s16.data(), frames);
+                    }
+                    stream.finish(data);
+                    keep(data.spans.front());
+                });
+                runner.report({ name, "sample", seconds, static_cast<double>(frames * 2),
+                    static_cast<double>(frames * 2 * (is_float ? sizeof(float) : sizeof(short))) });
+            }
+        }
+    }
+}
+
+// Rasterization of spans into RGBA rows, and encoding into PNG
+
+void bench_rasterizer(bench_runner& runner) {
+    const png::rgba_pixel bg(0xef, 0xef, 0xef, 0xff);
+    const png::rgba_pixel fg(0, 0, 0, 0xff);
+    const png::rgba_pixel rms(0x80, 0x80, 0x80, 0xff);
+
+    const std::pair<std::size_t, std::uint32_t> sizes[] = { { 1800, 280 }, { 8000, 1024 } };
+    for (const auto& [width, height] : sizes) {
+        const std::string size = "/" + std::to_string(width) + "x" + std::to_string(height);
+        const std::vector<column_span> spans = build_spans(make_extents(width, height), width, height, false);
+        const std::vector<column_span> rms_spans = build_spans(make_extents(width, height / 2), width, height, false);
+        const double pixels = static_cast<double>(width) * height;
+
+        std::vector<png::rgba_pixel> image(width * height);
+
+        if (runner.selected("raster/fill" + size)) {
+            const double seconds = runner.time_best([&] {
+                for (std::uint32_t y = 0; y < height; ++y) {
+                    rasterize_row(spans, y, bg, fg, &image[y * width]);
+                }
+                keep(image.front());
+            });
+            runner.report({ "raster/fill" + size, "pixel", seconds, pixels, pixels * sizeof(png::rgba_pixel) });
+        }
+
+        if (runner.selected("raster/layers" + size)) {
+            const double seconds = runner.time_best([&] {
+                for (std::uint32_t y = 0; y < height; ++y) {
+                    rasterize_row(spans, y, bg, fg, &image[y * width]);
+                    paint_row(rms_spans, y, rms, &image[y * width]);
+                }
+                keep(image.front());
+            });
+            runner.report({ "raster/layers" + size, "pixel", seconds, pixels, pixels * sizeof(png::rgba_pixel) });
+        }
+
+        for (const bool compact : { true, false }) {
+            const std::string name = std::string("encode/") + (compact ? "compact" : "rgba") + size;
+            if (!runner.selected(name)) {
+                continue;
+            }
+
+            png_settings settings;
+            settings.compact = compact;
+            std::vector<unsigned char> png;
+            const double seconds = runner.time_best([&] {
+                encode_waveform_png(png, { { &spans, fg } }, height, bg, settings);
+                keep(png.front());
+            });
+            runner.report({ name, "pixel", seconds, pixels, pixels * sizeof(png::rgba_pixel) });
+        }
+    }
+}
+
+// End-to-end runs of the wav2png binary
+
+struct input_file {
+    fs::path path;
+    double samples;
+    double bytes;
+};
+
+// Generate the input unless a file of the expected size exists already
+input_file generate_input(const fs::path& directory, signal_kind signal, file_format format, unsigned channels, unsigned seconds) {
+    const fs::path path = directory / (std::string(signal_name(signal)) + "_" + format_name(format) + "_"
+        + std::to_string(channels) + "ch_" + std::to_string(seconds) + "s.wav");
+    const double samples = static_cast<double>(sample_rate) * seconds * channels;
+    const double bytes = samples * bytes_per_sample(format);
+
+    std::error_code error;
+    if (fs::file_size(path, error) < static_cast<std::uintmax_t>(bytes) || error) {
+        std::cerr << "generating " << path.string() << std::endl;
+        write_wav(path, signal, format, channels, seconds);
+    }
+    return { path, samples, bytes };
+}
+
+// Run wav2png on input with args in directory, which keeps it from reading a
+// config file elsewhere. Returns the wall time and adds the peak RSS.
+double run_wav2png(const std::string& wav2png, const fs::path& directory, const input_file& input,
+    const std::vector<std::string>& args, long& peak_rss_kb) {
+    std::vector<std::string> argv_strings{ wav2png };
+    argv_strings.insert(argv_strings.end(), args.begin(), args.end());
+    argv_strings.insert(argv_strings.end(), { "-o", (directory / "bench_output.png").string(), input.path.string() });
+
+    std::vector<char*> argv;
+    for (auto& arg : argv_strings) {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+
+    const auto start = std::chrono::steady_clock::now();
+    const pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error("failed to start wav2png");
+    }
+    if (pid == 0) {
+        const int null = open("/dev/null", O_WRONLY);
+        if (null < 0 || dup2(null, STDOUT_FILENO) < 0 || dup2(null, STDERR_FILENO) < 0
+            || chdir(directory.c_str()) != 0) {
+            _exit(127);
+        }
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) {
+        throw std::runtime_error("failed to wait for wav2png");
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::string command;
+        for (const auto& arg : argv_strings) {
+            command += (command.empty() ? "" : " ") + arg;
+        }
+        throw std::runtime_error("failed to run " + command);
+    }
+
+    peak_rss_kb = std::max(peak_rss_kb, static_cast<long>(usage.ru_maxrss));
+    return seconds;
+}
+
+void bench_end_to_end(bench_runner& runner, const std::string& wav2png, const fs::path& directory) {
+    fs::create_directories(directory);
+
+    // Inputs are generated on first use, so a filter only generates the ones
+    // it needs
+    const auto input = [&](signal_kind signal, file_format format, unsigned channels, unsigned seconds) {
+        return [=, &directory] { return generate_input(directory, signal, format, channels, seconds); };
+    };
+
+    const auto run = [&](const std::string& name, const auto& make_input, const std::vector<std::string>& args) {
+        if (!runner.selected(name)) {
+            return;
+        }
+        const input_file file = make_input();
+        long peak_rss_kb = 0;
+        double best = std::numeric_limits<double>::infinity();
+        for (int r = 0; r < runner.settings().repeat; ++r) {
+            best = std::min(best, run_wav2png(wav2png, directory, file, args, peak_rss_kb));
+        }
+        runner.report({ name, "sample", best, file.samples, file.bytes, peak_rss_kb });
+    };
+
+    // Every signal, format and channel count at the default settings
+    for (const signal_kind signal : all_signals) {
+        for (const file_format format : all_formats) {
+            for (const unsigned channels : { 1u, 2u }) {
+                run(std::string("e2e/") + signal_name(signal) + "/" + format_name(format) + "/"
+                        + std::to_string(channels) + "ch/10s",
+                    input(signal, format, channels, 10), {});
+            }
+        }
+    }
+
+    // Long inputs, single and multi-threaded
+    for (const file_format format : { file_format::s16, file_format::f32 }) {
+        const std::string name = std::string("e2e/noise/") + format_name(format) + "/2ch/300s";
+        run(name, input(signal_kind::noise, format, 2, 300), {});
+        run(name + "/threads", input(signal_kind::noise, format, 2, 300), { "--threads", "0" });
+    }
+
+    // Lanes of a long stereo input, against e2e/noise/<format>/2ch/300s
+    for (const file_format format : { file_format::s16, file_format::f32 }) {
+        for (const char* channels : { "split", "mid,side", "left,right,mid,side" }) {
+            std::string lanes = channels;
+            std::replace(lanes.begin(), lanes.end(), ',', '+');
+            run(std::string("e2e/channels/") + lanes + "/" + format_name(format) + "/2ch/300s",
+                input(signal_kind::noise, format, 2, 300), { "--channels", channels });
+        }
+    }
+
+    // Image sizes and styles over a long input
+    for (const unsigned width : { 800, 4000 }) {
+        for (const unsigned height : { 120, 600 }) {
+            for (const bool db_scale : { false, true }) {
+                for (const bool line_only : { false, true }) {
+                    std::vector<std::string> args{ "-w", std::to_string(width), "-h", std::to_string(height) };
+                    if (db_scale) {
+                        args.push_back("-d");
+                    }
+                    if (line_only) {
+                        args.push_back("-l");
+                    }
+                    run("e2e/sweep/w" + std::to_string(width) + "/h" + std::to_string(height) + "/"
+                            + (db_scale ? "db" : "linear") + "/" + (line_only ? "line" : "fill"),
+                        input(signal_kind::noise, file_format::s16, 2, 300), args);
+                }
+            }
+        }
+    }
+
+    fs::remove(directory / "bench_output.png");
+}
+
+// Compare results against a baseline written by an earlier run. Returns the
+// number of regressions.
+int compare_with_baseline(const std::vector<bench_result>& results, const std::string& baseline_file, double tolerance) {
+    std::ifstream in(baseline_file);
+    if (!in) {
+        throw std::runtime_error("failed to read baseline '" + baseline_file + "'");
+    }
+
+    std::map<std::string, std::pair<double, double>> baseline;
+    for (std::string line; std::getline(in, line);) {
+        const std::string name = json_string(line, "name");
+        if (!name.empty()) {
+            baseline[name] = { json_number(line, "ns_per_unit"), json_number(line, "peak_rss_kb") };
+        }
+    }
+
+    std::cout << std::endl << "Compared with " << baseline_file << " (tolerance " << tolerance * 100.0 << "%):" << std::endl;
+
+    int regressions = 0;
+    for (const auto& result : results) {
+        const auto it = baseline.find(result.name);
+        if (it == baseline.end()) {
+            continue;
+        }
+
+        const auto [base_ns, base_rss] = it->second;
+        const double time_change = base_ns > 0.0 ? result.ns_per_unit() / base_ns - 1.0 : 0.0;
+        const double rss_change = base_rss > 0.0 && result.peak_rss_kb > 0
+            ? static_cast<double>(result.peak_rss_kb) / base_rss - 1.0 : 0.0;
+        const bool regressed = time_change > tolerance || rss_change > tolerance;
+        if (!regressed && std::abs(time_change) <= tolerance) {
+            continue;
+        }
+
+        std::cout << (regressed ? "  REGRESSION " : "  improved   ") << std::left << std::setw(48) << result.name
+                  << std::right << std::showpos << std::setprecision(1) << std::setw(8) << time_change * 100.0 << "% time";
+        if (rss_change != 0.0) {
+            std::cout << std::setw(8) << rss_change * 100.0 << "% RSS";
+        }
+        std::cout << std::noshowpos << std::endl;
+        regressions += regressed;
+    }
+
+    std::cout << (regressions ? std::to_string(regressions) + " regression(s)" : std::string("no regressions")) << std::endl;
+    return regressions;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    bench_settings settings;
+    std::string wav2png;
+    std::string inputs;
+    std::string output;
+    std::string baseline;
+    double tolerance = 0.1;
+    bool micro_only = false;
+
+    po::options_description options("Options");
+    options.add_options()
+        ("help", "show this help")
+        ("wav2png", po::value<std::string>(&wav2png)->default_value("bin/wav2png"), "binary of the end-to-end runs")
+        ("inputs", po::value<std::string>(&inputs)->default_value("bin/bench"), "directory of the generated inputs")
+        ("output,o", po::value<std::string>(&output), "write the results as JSON lines to this file")
+        ("baseline,b", po::value<std::string>(&baseline), "compare the results with an earlier output")
+        ("tolerance", po::value<double>(&tolerance)->default_value(10.0), "slowdown in percent that counts as a regression")
+        ("filter", po::value<std::string>(&settings.filter), "only run benchmarks whose name contains this")
+        ("repeat", po::value<int>(&settings.repeat)->default_value(settings.repeat), "repetitions of each benchmark")
+        ("micro", "only run the microbenchmarks");
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, options), vm);
+        po::notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << "Usage: wav2png_bench [options]" << std::endl << options << std::endl;
+            return 0;
+        }
+        if (settings.repeat < 1) {
+            throw std::invalid_argument("repeat must be at least 1");
+        }
+        micro_only = vm.count("micro") > 0;
+        tolerance /= 100.0;
+
+        std::ofstream json;
+        if (!output.empty()) {
+            json.open(output, std::ios::trunc);
+            if (!json) {
+                throw std::runtime_error("failed to write '" + output + "'");
+            }
+        }
+
+        bench_runner runner(settings, output.empty() ? nullptr : &json);
+        std::cout << "reduction kernels of this CPU: " << get_reduce_kernels().name << std::endl;
+
+        bench_reduce_kernels(runner);
+        bench_mapping(runner);
+        bench_rasterizer(runner);
+        if (!micro_only) {
+            bench_end_to_end(runner, fs::absolute(wav2png).string(), fs::absolute(inputs));
+        }
+
+        if (!baseline.empty() && compare_with_baseline(runner.results(), baseline, tolerance) > 0) {
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 2;
+    }
+
+    return 0;
+}
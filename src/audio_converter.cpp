@@ -2,32 +2,37 @@
 
 #include <algorithm>
 #include <cctype>
+#include <cerrno>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <vector>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 
-// Static variable to cache ffmpeg availability check
-static int ffmpeg_available = -1;  // -1 = not checked, 0 = not available, 1 = available
+#include "render_stats.hpp"
 
 bool AudioConverter::is_ffmpeg_available() {
-    if (ffmpeg_available == -1) {
+    // Checked once per process; the static initialization is thread-safe, so
+    // batch workers can call this concurrently
+    static const bool ffmpeg_available = []() {
         // Check if ffmpeg command exists
-        int result = system("command -v ffmpeg > /dev/null 2>&1");
-        ffmpeg_available = (result == 0) ? 1 : 0;
+        const int result = system("command -v ffmpeg > /dev/null 2>&1");
 
-        if (ffmpeg_available == 0) {
+        if (result != 0) {
             std::cerr << "Note: ffmpeg not found. Extended format support disabled." << std::endl;
         }
-    }
-    return ffmpeg_available == 1;
+        return result == 0;
+    }();
+
+    return ffmpeg_available;
 }
 
 std::string AudioConverter::get_extension(const std::string& filename) {
@@ -67,7 +72,75 @@ bool AudioConverter::is_libsndfile_format(const std::string& filename) {
     return false;
 }
 
-FFmpegConverter::FFmpegConverter(const std::string& input_filename) {
+namespace {
+
+// Run a command without a shell and return what it printed on stdout. Returns
+// false if it could not be run or did not exit with status 0.
+bool run_and_capture(const std::vector<std::string>& args, std::string& output) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        return false;
+    }
+
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    const pid_t pid = fork();
+    if (pid == -1) {
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        ::close(fds[0]);
+        ::close(fds[1]);
+
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull != -1) {
+            dup2(devnull, STDERR_FILENO);
+            ::close(devnull);
+        }
+
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    ::close(fds[1]);
+
+    char buffer[512];
+    ssize_t count = 0;
+    while ((count = read(fds[0], buffer, sizeof(buffer))) > 0 || (count == -1 && errno == EINTR)) {
+        if (count > 0) {
+            output.append(buffer, count);
+        }
+    }
+    ::close(fds[0]);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Format seconds for ffmpeg's time options, with sub-sample precision
+std::string format_seconds(double seconds) {
+    char buffer[64];
+    std::snprintf(buffer, sizeof(buffer), "%.9f", seconds);
+    return buffer;
+}
+
+} // anonymous namespace
+
+FFmpegConverter::FFmpegConverter(
+    const std::string& input_filename,
+    double start_seconds,
+    double duration_seconds
+) {
     // Create unique FIFO name
     char fifo_template[] = "/tmp/wav2png_XXXXXX";
     int fd = mkstemp(fifo_template);
@@ -84,6 +157,36 @@ FFmpegConverter::FFmpegConverter(const std::string& input_filename) {
 
     fifo_path_ = fifo_template;
 
+    // Build the command line before forking. The sample rate of the input is
+    // kept, the waveform does not need resampling.
+    std::vector<std::string> args = { "ffmpeg" };
+    const bool segment = start_seconds > 0.0 || duration_seconds > 0.0;
+    if (segment) {
+        // Seeking on the input is fast and, as ffmpeg discards the decoded
+        // audio before the start position, exact
+        args.insert(args.end(), { "-ss", format_seconds(start_seconds) });
+    }
+    if (duration_seconds > 0.0) {
+        args.insert(args.end(), { "-t", format_seconds(duration_seconds) });
+    }
+    args.insert(args.end(), { "-i", input_filename });
+    if (segment) {
+        // Segments must decode the stream that was probed
+        args.insert(args.end(), { "-map", "0:a:0" });
+    }
+    args.insert(args.end(), {
+        "-f", "wav",              // Output format: WAV
+        "-acodec", "pcm_s16le",   // 16-bit PCM
+        "-y",                     // Overwrite output
+        fifo_path_                // Output to FIFO
+    });
+
+    std::vector<char*> argv;
+    for (auto& arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+
     // Fork process to run ffmpeg
     pid_t pid = fork();
 
@@ -104,17 +207,9 @@ FFmpegConverter::FFmpegConverter(const std::string& input_filename) {
         }
 
         // Execute ffmpeg to convert to WAV and write to FIFO
-        execlp("ffmpeg",
-               "ffmpeg",
-               "-i", input_filename.c_str(),
-               "-f", "wav",              // Output format: WAV
-               "-acodec", "pcm_s16le",   // 16-bit PCM
-               "-ar", "44100",           // Sample rate (can be adjusted)
-               "-y",                     // Overwrite output
-               fifo_path_.c_str(),       // Output to FIFO
-               nullptr);
-
-        // If execlp returns, it failed
+        execvp(argv[0], argv.data());
+
+        // If execvp returns, it failed
         std::cerr << "Failed to execute ffmpeg" << std::endl;
         _exit(1);
     }
@@ -124,17 +219,23 @@ FFmpegConverter::FFmpegConverter(const std::string& input_filename) {
 }
 
 FFmpegConverter::~FFmpegConverter() {
-    // Note: We don't wait for ffmpeg to finish here because:
-    // 1. It might still be writing to the FIFO while we're reading from it
-    // 2. Waiting would cause a deadlock
-    // 3. The process will finish on its own and be reaped on program exit
-
     // Clean up FIFO (safe to unlink while still open due to Unix semantics)
     if (!fifo_path_.empty()) {
         unlink(fifo_path_.c_str());
     }
-}
 
+    // By now the reading side is closed. ffmpeg has either finished or, if
+    // reading stopped early, is blocked on the FIFO or about to fail writing to
+    // it, so terminate it rather than waiting for it.
+    if (ffmpeg_pid_ > 0 && !waited_) {
+        int status;
+        if (waitpid(ffmpeg_pid_, &status, WNOHANG) == 0) {
+            kill(ffmpeg_pid_, SIGTERM);
+            while (waitpid(ffmpeg_pid_, &status, 0) == -1 && errno == EINTR) {
+            }
+        }
+    }
+}
 void FFmpegConverter::wait() {
     if (waited_) {
         return;
@@ -155,14 +256,20 @@ void FFmpegConverter::wait() {
     waited_ = true;
 }
 
-SndfileHandle AudioConverter::open_with_ffmpeg(const std::string& filename) {
-    // Create ffmpeg converter with FIFO
-    // Note: This creates a new object on the heap that won't be automatically cleaned up
-    // The FIFO cleanup happens in the destructor, which is safe due to Unix semantics
-    FFmpegConverter* converter = new FFmpegConverter(filename);
+SndfileHandle AudioConverter::open_with_ffmpeg(
+    const std::string& filename,
+    std::unique_ptr<FFmpegConverter>& converter,
+    double start_seconds,
+    double duration_seconds
+) {
+    phase_timer timer(render_phase::ffmpeg_start);
+
+    // Create ffmpeg converter with FIFO. The caller keeps it until reading is
+    // complete, its destructor then reaps the process and removes the FIFO.
+    converter.reset(new FFmpegConverter(filename, start_seconds, duration_seconds));
 
     if (!converter->is_valid()) {
-        delete converter;
+        converter.reset();
         throw std::runtime_error("Failed to start ffmpeg conversion for file: " + filename);
     }
 
@@ -173,27 +280,36 @@ SndfileHandle AudioConverter::open_with_ffmpeg(const std::string& filename) {
     SndfileHandle handle(fifo_path.c_str());
 
     if (handle.error()) {
-        delete converter;
-        throw std::runtime_error(
-            "Failed to open converted audio: " + std::string(handle.strError())
-        );
+        const std::string message = handle.strError();
+        handle = SndfileHandle();
+        converter.reset();
+        throw std::runtime_error("Failed to open converted audio: " + message);
     }
 
-    // Note: We intentionally don't delete the converter here because:
-    // 1. The FIFO must remain until reading is complete
-    // 2. The FIFO is unlinked in the destructor (safe due to Unix semantics)
-    // 3. The ffmpeg process will finish on its own
-    // This is a small memory leak, but acceptable for a short-lived CLI tool
-
     return handle;
 }
 
-SndfileHandle AudioConverter::open_audio_file(const std::string& filename) {
+SndfileHandle AudioConverter::open_audio_file(
+    const std::string& filename,
+    std::unique_ptr<MappedPcmFile>& mapped,
+    std::unique_ptr<FFmpegConverter>& converter
+) {
+    mapped.reset();
+    converter.reset();
+
+    // Standard input is read as it comes, it can neither be mapped nor
+    // handed to ffmpeg
+    if (filename == "-") {
+        return SndfileHandle(STDIN_FILENO, false);
+    }
+
     // First, try to open directly with libsndfile
     SndfileHandle handle(filename.c_str());
 
-    // If successful, return it
+    // If successful, return it. Only files libsndfile opened directly can be
+    // mapped, not ffmpeg output.
     if (!handle.error()) {
+        mapped = MappedPcmFile::open(filename, handle);
         return handle;
     }
 
@@ -205,5 +321,71 @@ SndfileHandle AudioConverter::open_audio_file(const std::string& filename) {
     // Try using ffmpeg
     std::cerr << "Attempting to convert " << filename << " using ffmpeg..." << std::endl;
 
-    return open_with_ffmpeg(filename);
+    return open_with_ffmpeg(filename, converter);
+}
+
+bool AudioConverter::needs_ffmpeg(const std::string& filename) {
+    // Files libsndfile can read never go through ffmpeg
+    return filename != "-"
+        && SndfileHandle(filename.c_str()).error()
+        && !is_libsndfile_format(filename)
+        && is_ffmpeg_available();
+}
+
+bool AudioConverter::probe_ffmpeg_input(const std::string& filename, ffmpeg_probe& probe) {
+    phase_timer timer(render_phase::open);
+
+    if (!needs_ffmpeg(filename)) {
+        return false;
+    }
+
+    std::string output;
+    if (!run_and_capture({
+            "ffprobe", "-v", "error",
+            "-select_streams", "a:0",
+            "-show_entries", "stream=sample_rate,channels:format=duration",
+            "-of", "default=noprint_wrappers=1",
+            filename
+        }, output)) {
+        return false;
+    }
+
+    // Lines of key=value
+    double duration = 0.0;
+    std::istringstream lines(output);
+    std::string line;
+    while (std::getline(lines, line)) {
+        const auto pos = line.find('=');
+        if (pos == std::string::npos) {
+            continue;
+        }
+        const std::string key = line.substr(0, pos);
+        const std::string value = line.substr(pos + 1);
+
+        if (key == "sample_rate") {
+            probe.samplerate = std::atoi(value.c_str());
+        } else if (key == "channels") {
+            probe.channels = std::atoi(value.c_str());
+        } else if (key == "duration") {
+            duration = std::atof(value.c_str());
+        }
+    }
+
+    probe.frames = static_cast<sf_count_t>(duration * probe.samplerate);
+    return probe.samplerate > 0 && probe.channels > 0 && probe.frames > 0;
+}
+
+SndfileHandle AudioConverter::open_segment(
+    const std::string& filename,
+    const ffmpeg_probe& probe,
+    sf_count_t first_frame,
+    sf_count_t frame_count,
+    std::unique_ptr<FFmpegConverter>& converter
+) {
+    return open_with_ffmpeg(
+        filename,
+        converter,
+        static_cast<double>(first_frame) / probe.samplerate,
+        frame_count < 0 ? 0.0 : static_cast<double>(frame_count) / probe.samplerate
+    );
 }
@@ -1,16 +1,58 @@
 #pragma once
 
 #include <sndfile.hh>
+#include <sys/types.h>
 #include <memory>
 #include <string>
 
+#include "mapped_pcm.hpp"
+
+class FFmpegConverter;
+
+// Audio stream properties of an input as reported by ffprobe
+struct ffmpeg_probe {
+    int samplerate = 0;
+    int channels = 0;
+    sf_count_t frames = 0;
+};
+
 // Class to handle audio file conversion using ffmpeg
 // Provides transparent format support beyond libsndfile's native formats
 class AudioConverter {
 public:
-    // Opens an audio file, using ffmpeg conversion if needed
-    // Returns a SndfileHandle on success, throws on failure
-    static SndfileHandle open_audio_file(const std::string& filename);
+    // Opens an audio file, using ffmpeg conversion if needed, or standard
+    // input for "-". Returns a SndfileHandle on success, throws on failure
+    //
+    // The sample data of plain PCM files is mapped (see MappedPcmFile), mapped
+    // is left empty for all other inputs. If the file is decoded through
+    // ffmpeg, converter receives the process, which must outlive the returned
+    // handle and all copies of it.
+    static SndfileHandle open_audio_file(
+        const std::string& filename,
+        std::unique_ptr<MappedPcmFile>& mapped,
+        std::unique_ptr<FFmpegConverter>& converter
+    );
+
+    // True if filename is decoded through ffmpeg rather than libsndfile
+    static bool needs_ffmpeg(const std::string& filename);
+
+    // Check whether filename needs to be decoded through ffmpeg and, if so,
+    // probe its duration and format. Returns false for files libsndfile reads
+    // itself and if probing failed.
+    static bool probe_ffmpeg_input(const std::string& filename, ffmpeg_probe& probe);
+
+    // Decode frames [first_frame, first_frame + frame_count) of a probed input
+    // through a separate ffmpeg process, so that several parts of the file can
+    // be decoded in parallel. A negative frame_count decodes up to the end of
+    // the input, whose probed length is only an estimate. converter receives
+    // the process, see open_audio_file.
+    static SndfileHandle open_segment(
+        const std::string& filename,
+        const ffmpeg_probe& probe,
+        sf_count_t first_frame,
+        sf_count_t frame_count,
+        std::unique_ptr<FFmpegConverter>& converter
+    );
 
 private:
     // Check if ffmpeg is available on the system
@@ -21,7 +63,12 @@ private:
 
     // Open audio file using ffmpeg FIFO
     // Creates a FIFO, spawns ffmpeg, and returns a SndfileHandle reading from FIFO
-    static SndfileHandle open_with_ffmpeg(const std::string& filename);
+    static SndfileHandle open_with_ffmpeg(
+        const std::string& filename,
+        std::unique_ptr<FFmpegConverter>& converter,
+        double start_seconds = 0.0,
+        double duration_seconds = 0.0
+    );
 
     // Get file extension from filename
     static std::string get_extension(const std::string& filename);
@@ -30,9 +77,20 @@ private:
 // RAII wrapper to manage ffmpeg process and FIFO cleanup
 class FFmpegConverter {
 public:
-    FFmpegConverter(const std::string& input_filename);
+    // Decode input_filename at its native sample rate, from start_seconds on.
+    // With a duration_seconds greater than 0, only that much audio is decoded.
+    FFmpegConverter(
+        const std::string& input_filename,
+        double start_seconds = 0.0,
+        double duration_seconds = 0.0
+    );
+
+    // Terminates ffmpeg if it is still running and reaps it
     ~FFmpegConverter();
 
+    FFmpegConverter(const FFmpegConverter&) = delete;
+    FFmpegConverter& operator=(const FFmpegConverter&) = delete;
+
     // Get the FIFO path for reading
     std::string get_fifo_path() const { return fifo_path_; }
 
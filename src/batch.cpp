@@ -0,0 +1,152 @@
+#include "batch.hpp"
+
+#include <boost/program_options/parsers.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "render.hpp"
+
+namespace {
+
+// Bounded queue of manifest lines, so that a huge manifest is not read into
+// memory at once
+class job_queue {
+public:
+    explicit job_queue(std::size_t capacity) : capacity_(capacity) {}
+
+    void push(std::string line) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return jobs_.size() < capacity_; });
+        jobs_.push_back(std::move(line));
+        not_empty_.notify_one();
+    }
+
+    // Wait for the next line. Returns false once the queue is closed and empty.
+    bool pop(std::string& line) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return !jobs_.empty() || closed_; });
+        if (jobs_.empty()) {
+            return false;
+        }
+        line = std::move(jobs_.front());
+        jobs_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+private:
+    const std::size_t capacity_;
+    std::deque<std::string> jobs_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+};
+
+// Tab separated status lines on stdout, one per file
+class status_reporter {
+public:
+    void ok(const std::string& input, const std::string& output) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::cout << "ok\t" << input << '\t' << output << std::endl;
+        ++succeeded_;
+    }
+
+    void error(const std::string& input, const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::cout << "error\t" << input << '\t' << message << std::endl;
+        ++failed_;
+    }
+
+    std::size_t succeeded() const { return succeeded_; }
+    std::size_t failed() const { return failed_; }
+
+private:
+    std::mutex mutex_;
+    std::size_t succeeded_ = 0;
+    std::size_t failed_ = 0;
+};
+
+bool is_blank_or_comment(const std::string& line) {
+    const auto first = line.find_first_not_of(" \t\r");
+    return first == std::string::npos || line[first] == '#';
+}
+
+// Render manifest lines until the queue is closed, reusing the waveform
+// storage for all files of this worker
+void batch_worker(const Options& options, job_queue& queue, status_reporter& status) {
+    std::vector<waveform_data> data;
+    std::string line;
+
+    while (queue.pop(line)) {
+        const auto args = boost::program_options::split_unix(line);
+        const std::string& input = args.empty() ? line : args.front();
+
+        try {
+            const Options file_options(options, args);
+            render_file(file_options, data, nullptr);
+            status.ok(file_options.input_file_name, file_options.output_file_name);
+        } catch (const std::exception& e) {
+            status.error(input, e.what());
+        }
+    }
+}
+
+} // anonymous namespace
+
+int run_batch(const Options& options) {
+    std::ifstream manifest_file;
+    if (options.batch_file_name != "-") {
+        manifest_file.open(options.batch_file_name);
+        if (!manifest_file.good()) {
+            std::cerr << "Error: failed to read batch manifest '"
+                      << options.batch_file_name << "'" << std::endl;
+            return 1;
+        }
+    }
+    std::istream& manifest = (options.batch_file_name == "-") ? std::cin : manifest_file;
+
+    const unsigned jobs = options.jobs > 0
+        ? options.jobs
+        : std::max(1u, std::thread::hardware_concurrency());
+
+    job_queue queue(2 * jobs);
+    status_reporter status;
+
+    std::vector<std::thread> workers;
+    workers.reserve(jobs);
+    for (unsigned i = 0; i < jobs; ++i) {
+        workers.emplace_back(batch_worker, std::cref(options), std::ref(queue), std::ref(status));
+    }
+
+    std::string line;
+    while (std::getline(manifest, line)) {
+        if (!is_blank_or_comment(line)) {
+            queue.push(line);
+        }
+    }
+    queue.close();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    std::cerr << status.succeeded() << " files rendered, "
+              << status.failed() << " failed" << std::endl;
+
+    return status.failed() == 0 ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "options.hpp"
+
+// Render all files listed in the batch manifest of options on a pool of
+// options.jobs workers. Every line of the manifest holds an input file name,
+// optionally followed by options overriding the ones in options. Blank lines
+// and lines starting with # are ignored.
+//
+// One status line is written to stdout per file:
+//   ok<TAB>input<TAB>output
+//   error<TAB>input<TAB>message
+// A failing file does not stop the run. Returns 0 if all files were
+// rendered, 1 otherwise.
+int run_batch(const Options& options);
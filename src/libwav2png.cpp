@@ -0,0 +1,154 @@
+#include "libwav2png.h"
+
+#include <exception>
+#include <stdexcept>
+#include <string>
+
+#include "render_context.hpp"
+
+struct wav2png_context {
+    wav2png::RenderContext context;
+    std::string error;
+};
+
+namespace {
+
+wav2png::render_settings from_c(const wav2png_settings& settings) {
+    wav2png::render_settings result;
+    result.width = settings.width;
+    result.height = settings.height;
+    result.background_color = settings.background_color;
+    result.foreground_color = settings.foreground_color;
+    result.draw_rms = settings.draw_rms != 0;
+    result.rms_color = settings.rms_color;
+    result.db_scale = settings.db_scale != 0;
+    result.db_min = settings.db_min;
+    result.db_max = settings.db_max;
+    result.line_only = settings.line_only != 0;
+    result.percentile_low = settings.percentile_low;
+    result.percentile_high = settings.percentile_high;
+    result.threads = settings.threads;
+    result.png_level = settings.png_level;
+    result.compact_png = settings.compact_png != 0;
+    return result;
+}
+
+// Run f on the context, turning exceptions into an error code and message
+template <typename function_type>
+int guarded(wav2png_context* context, function_type&& f) {
+    if (!context) {
+        return -1;
+    }
+    try {
+        f(context->context);
+        context->error.clear();
+        return 0;
+    } catch (const std::exception& e) {
+        context->error = e.what();
+    } catch (...) {
+        context->error = "unknown error";
+    }
+    return -1;
+}
+
+} // anonymous namespace
+
+extern "C" {
+
+void wav2png_default_settings(wav2png_settings* settings) {
+    const wav2png::render_settings defaults;
+    settings->width = defaults.width;
+    settings->height = defaults.height;
+    settings->background_color = defaults.background_color;
+    settings->foreground_color = defaults.foreground_color;
+    settings->draw_rms = defaults.draw_rms;
+    settings->rms_color = defaults.rms_color;
+    settings->db_scale = defaults.db_scale;
+    settings->db_min = defaults.db_min;
+    settings->db_max = defaults.db_max;
+    settings->line_only = defaults.line_only;
+    settings->percentile_low = defaults.percentile_low;
+    settings->percentile_high = defaults.percentile_high;
+    settings->threads = defaults.threads;
+    settings->png_level = defaults.png_level;
+    settings->compact_png = defaults.compact_png;
+}
+
+wav2png_context* wav2png_create(const wav2png_settings* settings) {
+    try {
+        return new wav2png_context{
+            settings ? wav2png::RenderContext(from_c(*settings)) : wav2png::RenderContext(), std::string() };
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void wav2png_destroy(wav2png_context* context) {
+    delete context;
+}
+
+int wav2png_set_settings(wav2png_context* context, const wav2png_settings* settings) {
+    return guarded(context, [&](wav2png::RenderContext& c) {
+        if (!settings) {
+            throw std::invalid_argument("settings must not be NULL");
+        }
+        c.set_settings(from_c(*settings));
+    });
+}
+
+int wav2png_render_file(wav2png_context* context, const char* path) {
+    return guarded(context, [&](wav2png::RenderContext& c) { c.render_file(path); });
+}
+
+int wav2png_render_fd(wav2png_context* context, int fd) {
+    return guarded(context, [&](wav2png::RenderContext& c) { c.render_fd(fd); });
+}
+
+int wav2png_begin_pcm(wav2png_context* context, int channels, wav2png_sample_format format) {
+    return guarded(context, [&](wav2png::RenderContext& c) {
+        switch (format) {
+        case WAV2PNG_S16: c.begin_pcm(channels, wav2png::sample_format::s16); break;
+        case WAV2PNG_S32: c.begin_pcm(channels, wav2png::sample_format::s32); break;
+        case WAV2PNG_F32: c.begin_pcm(channels, wav2png::sample_format::f32); break;
+        default: throw std::invalid_argument("unknown sample format");
+        }
+    });
+}
+
+int wav2png_push_pcm_s16(wav2png_context* context, const int16_t* samples, size_t frames) {
+    return guarded(context, [&](wav2png::RenderContext& c) { c.push_pcm(samples, frames); });
+}
+
+int wav2png_push_pcm_s32(wav2png_context* context, const int32_t* samples, size_t frames) {
+    return guarded(context, [&](wav2png::RenderContext& c) { c.push_pcm(samples, frames); });
+}
+
+int wav2png_push_pcm_f32(wav2png_context* context, const float* samples, size_t frames) {
+    return guarded(context, [&](wav2png::RenderContext& c) { c.push_pcm(samples, frames); });
+}
+
+int wav2png_end_pcm(wav2png_context* context) {
+    return guarded(context, [&](wav2png::RenderContext& c) { c.end_pcm(); });
+}
+
+uint64_t wav2png_frames(const wav2png_context* context) {
+    return context ? context->context.frames() : 0;
+}
+
+int wav2png_draw(wav2png_context* context, uint8_t* pixels, size_t stride) {
+    return guarded(context, [&](wav2png::RenderContext& c) { c.draw(pixels, stride); });
+}
+
+int wav2png_encode_png(wav2png_context* context, const uint8_t** data, size_t* size) {
+    return guarded(context, [&](wav2png::RenderContext& c) {
+        const std::vector<std::uint8_t>& png = c.encode_png();
+        *data = png.data();
+        *size = png.size();
+    });
+}
+
+const char* wav2png_last_error(const wav2png_context* context) {
+    return context ? context->error.c_str() : "no context";
+}
+
+} // extern "C"
@@ -0,0 +1,83 @@
+#ifndef LIBWAV2PNG_H
+#define LIBWAV2PNG_H
+
+/*
+ * C interface of libwav2png, a thin wrapper of wav2png::RenderContext (see
+ * render_context.hpp). Functions returning int return 0 on success and -1 on
+ * error, after which wav2png_last_error describes the error.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct wav2png_context wav2png_context;
+
+/* Settings of a render, colors given as 0xRRGGBBAA */
+typedef struct wav2png_settings {
+    unsigned width;
+    unsigned height;
+    uint32_t background_color;
+    uint32_t foreground_color;
+    int draw_rms;
+    uint32_t rms_color;
+    int db_scale;
+    float db_min;
+    float db_max;
+    int line_only;
+    float percentile_low;
+    float percentile_high;
+    unsigned threads;
+    int png_level;
+    int compact_png;
+} wav2png_settings;
+
+typedef enum wav2png_sample_format {
+    WAV2PNG_S16,
+    WAV2PNG_S32,
+    WAV2PNG_F32
+} wav2png_sample_format;
+
+/* Fill settings with the defaults of the command line */
+void wav2png_default_settings(wav2png_settings* settings);
+
+/* Create a context with settings, or the defaults if NULL. Returns NULL if out
+ * of memory. */
+wav2png_context* wav2png_create(const wav2png_settings* settings);
+void wav2png_destroy(wav2png_context* context);
+
+/* Settings of the next render */
+int wav2png_set_settings(wav2png_context* context, const wav2png_settings* settings);
+
+int wav2png_render_file(wav2png_context* context, const char* path);
+int wav2png_render_fd(wav2png_context* context, int fd);
+
+/* Render interleaved frames pushed in blocks of any size */
+int wav2png_begin_pcm(wav2png_context* context, int channels, wav2png_sample_format format);
+int wav2png_push_pcm_s16(wav2png_context* context, const int16_t* samples, size_t frames);
+int wav2png_push_pcm_s32(wav2png_context* context, const int32_t* samples, size_t frames);
+int wav2png_push_pcm_f32(wav2png_context* context, const float* samples, size_t frames);
+int wav2png_end_pcm(wav2png_context* context);
+
+/* Frames of the input of the last render */
+uint64_t wav2png_frames(const wav2png_context* context);
+
+/* Draw the last render into height rows of width RGBA pixels, stride bytes
+ * apart */
+int wav2png_draw(wav2png_context* context, uint8_t* pixels, size_t stride);
+
+/* Encode the last render as PNG. *data stays valid until the next call on the
+ * context. */
+int wav2png_encode_png(wav2png_context* context, const uint8_t** data, size_t* size);
+
+/* Message of the last error on the context */
+const char* wav2png_last_error(const wav2png_context* context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBWAV2PNG_H */
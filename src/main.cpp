@@ -1,12 +1,12 @@
-#include <sndfile.hh>
-#include <png++/png.hpp>
-
+#include <iomanip>
 #include <iostream>
 #include <vector>
 
 #include "options.hpp"
-#include "wav2png.hpp"
-#include "audio_converter.hpp"
+#include "batch.hpp"
+#include "render.hpp"
+#include "render_stats.hpp"
+#include "serve.hpp"
 
 namespace {
 
@@ -16,45 +16,58 @@ bool progress_callback(int percent) {
     return true;
 }
 
+void report_stats(const Options& options) {
+    if (options.reports_stats()) {
+        write_render_stats(std::cerr, collect_render_stats(), options.stats_format == "json");
+    }
+}
+
 } // anonymous namespace
 
 int main(int argc, char* argv[]) {
     try {
         const Options options(argc, argv);
 
-        // Open sound file (with automatic ffmpeg conversion if needed)
-        SndfileHandle wav = AudioConverter::open_audio_file(options.input_file_name);
+        if (options.reports_stats()) {
+            enable_render_stats();
+        }
+
+        if (options.is_serving()) {
+            const int result = run_server(options);
+            report_stats(options);
+            return result;
+        }
 
-        // Handle error
-        if (wav.error()) {
+        if (options.is_batch()) {
+            const int result = run_batch(options);
+            report_stats(options);
+            return result;
+        }
+
+        std::vector<waveform_data> data;
+
+        try {
+            render_file(options, data, progress_callback);
+        } catch (const input_open_error& e) {
+            // Handle error
             std::cerr << "Error opening audio file '" << options.input_file_name << "'\n"
-                      << "Error was: '" << wav.strError() << "'" << std::endl;
+                      << "Error was: '" << e.what() << "'" << std::endl;
             std::cerr << "\nSupported formats: WAV, AIFF, FLAC, OGG, AU, CAF, and more via libsndfile" << std::endl;
             std::cerr << "MP3 and other formats require ffmpeg to be installed" << std::endl;
             return 2;
         }
 
-        // Create image
-        png::image<png::rgba_pixel> image(options.width, options.height);
-
-        // Compute waveform
-        compute_waveform(
-            wav,
-            image,
-            options.background_color,
-            options.foreground_color,
-            options.use_db_scale,
-            options.db_min,
-            options.db_max,
-            options.line_only,
-            progress_callback
-        );
-
         std::cerr << std::endl;
 
-        // Write image to disk
-        image.write(options.output_file_name);
+        if (options.preview && !data.empty() && data[0].frames > 0) {
+            const waveform_data& preview = data[0];
+            std::cerr << std::setprecision(3) << "preview: read " << 100.0 * preview.frames_read / preview.frames
+                      << "% of the frames, estimated peak error " << 100.0 * preview.peak_error
+                      << "% of full scale (at most " << 100.0 * preview.max_peak_error
+                      << "% in a column)" << std::endl;
+        }
 
+        report_stats(options);
         return 0;
 
     } catch (const std::exception& e) {
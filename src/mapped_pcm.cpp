@@ -0,0 +1,343 @@
+#include "mapped_pcm.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Location and format of the sample data, as found in the file header
+struct pcm_layout {
+    std::uint64_t data_offset = 0;
+    std::uint64_t data_size = 0;
+    std::uint16_t format_tag = 0;
+    std::uint16_t channels = 0;
+    std::uint16_t block_align = 0;
+    std::uint16_t bits_per_sample = 0;
+};
+
+constexpr std::uint16_t wave_format_pcm = 0x0001;
+constexpr std::uint16_t wave_format_ieee_float = 0x0003;
+constexpr std::uint16_t wave_format_extensible = 0xfffe;
+
+// W64 chunk GUIDs
+constexpr unsigned char w64_riff_guid[16] = {
+    'r', 'i', 'f', 'f', 0x2e, 0x91, 0xcf, 0x11, 0xa5, 0xd6, 0x28, 0xdb, 0x04, 0xc1, 0x00, 0x00
+};
+constexpr unsigned char w64_wave_guid[16] = {
+    'w', 'a', 'v', 'e', 0xf3, 0xac, 0xd3, 0x11, 0x8c, 0xd1, 0x00, 0xc0, 0x4f, 0x8e, 0xdb, 0x8a
+};
+constexpr unsigned char w64_fmt_guid[16] = {
+    'f', 'm', 't', ' ', 0xf3, 0xac, 0xd3, 0x11, 0x8c, 0xd1, 0x00, 0xc0, 0x4f, 0x8e, 0xdb, 0x8a
+};
+constexpr unsigned char w64_data_guid[16] = {
+    'd', 'a', 't', 'a', 0xf3, 0xac, 0xd3, 0x11, 0x8c, 0xd1, 0x00, 0xc0, 0x4f, 0x8e, 0xdb, 0x8a
+};
+
+// Little-endian field access
+std::uint16_t le16(const unsigned char* p) noexcept {
+    return static_cast<std::uint16_t>(p[0] | (p[1] << 8));
+}
+
+std::uint32_t le32(const unsigned char* p) noexcept {
+    return static_cast<std::uint32_t>(le16(p)) | (static_cast<std::uint32_t>(le16(p + 2)) << 16);
+}
+
+std::uint64_t le64(const unsigned char* p) noexcept {
+    return static_cast<std::uint64_t>(le32(p)) | (static_cast<std::uint64_t>(le32(p + 4)) << 32);
+}
+
+// Parse a WAVE fmt chunk body
+bool parse_fmt(const unsigned char* p, std::uint64_t size, pcm_layout& layout) noexcept {
+    if (size < 16) {
+        return false;
+    }
+
+    layout.format_tag = le16(p);
+    layout.channels = le16(p + 2);
+    layout.block_align = le16(p + 12);
+    layout.bits_per_sample = le16(p + 14);
+
+    // The sub format GUID of WAVE_FORMAT_EXTENSIBLE starts with the format tag
+    if (layout.format_tag == wave_format_extensible) {
+        if (size < 40) {
+            return false;
+        }
+        layout.format_tag = le16(p + 24);
+    }
+
+    return true;
+}
+
+// RIFF/WAVE and RF64/WAVE. RF64 stores the real data size in a ds64 chunk.
+bool parse_riff(const unsigned char* p, std::uint64_t size, pcm_layout& layout) noexcept {
+    const bool rf64 = std::memcmp(p, "RF64", 4) == 0;
+    if ((!rf64 && std::memcmp(p, "RIFF", 4) != 0) || std::memcmp(p + 8, "WAVE", 4) != 0) {
+        return false;
+    }
+
+    std::uint64_t ds64_data_size = 0;
+    bool have_fmt = false;
+    std::uint64_t offset = 12;
+
+    while (offset + 8 <= size) {
+        const unsigned char* chunk = p + offset;
+        std::uint64_t chunk_size = le32(chunk + 4);
+        const std::uint64_t body = offset + 8;
+
+        if (std::memcmp(chunk, "ds64", 4) == 0 && chunk_size >= 16 && body + 16 <= size) {
+            ds64_data_size = le64(p + body + 8);
+        } else if (std::memcmp(chunk, "fmt ", 4) == 0) {
+            if (body + chunk_size > size || !parse_fmt(p + body, chunk_size, layout)) {
+                return false;
+            }
+            have_fmt = true;
+        } else if (std::memcmp(chunk, "data", 4) == 0) {
+            if (rf64 && chunk_size == 0xffffffff) {
+                chunk_size = ds64_data_size;
+            }
+            layout.data_offset = body;
+            layout.data_size = std::min(chunk_size, size - body);
+            return have_fmt;
+        }
+
+        // Chunks are padded to an even size
+        offset = body + chunk_size + (chunk_size & 1);
+    }
+
+    return false;
+}
+
+// Sony Wave64, chunks are identified by GUIDs and aligned to 8 bytes
+bool parse_w64(const unsigned char* p, std::uint64_t size, pcm_layout& layout) noexcept {
+    if (size < 40 || std::memcmp(p, w64_riff_guid, 16) != 0 || std::memcmp(p + 24, w64_wave_guid, 16) != 0) {
+        return false;
+    }
+
+    bool have_fmt = false;
+    std::uint64_t offset = 40;
+
+    while (offset + 24 <= size) {
+        const unsigned char* chunk = p + offset;
+        const std::uint64_t chunk_size = le64(chunk + 16);  // includes the 24 byte header
+        const std::uint64_t body = offset + 24;
+
+        if (chunk_size < 24) {
+            return false;
+        }
+
+        if (std::memcmp(chunk, w64_fmt_guid, 16) == 0) {
+            if (offset + chunk_size > size || !parse_fmt(p + body, chunk_size - 24, layout)) {
+                return false;
+            }
+            have_fmt = true;
+        } else if (std::memcmp(chunk, w64_data_guid, 16) == 0) {
+            layout.data_offset = body;
+            layout.data_size = std::min(chunk_size - 24, size - body);
+            return have_fmt;
+        }
+
+        offset += (chunk_size + 7) & ~std::uint64_t(7);
+    }
+
+    return false;
+}
+
+} // anonymous namespace
+
+MappedPcmFile::~MappedPcmFile() {
+    if (mapping_) {
+        munmap(mapping_, mapping_size_);
+    }
+}
+
+std::unique_ptr<MappedPcmFile> MappedPcmFile::open(const std::string& filename, const SndfileHandle& wav) {
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    // Samples are used in place as host integers and floats, which only
+    // matches the little-endian data chunk on little-endian hosts
+    (void)filename;
+    (void)wav;
+    return nullptr;
+#endif
+
+    // Only containers with a plain interleaved little-endian data chunk qualify
+    const int container = wav.format() & SF_FORMAT_TYPEMASK;
+    const int endianness = wav.format() & SF_FORMAT_ENDMASK;
+
+    if (container != SF_FORMAT_WAV && container != SF_FORMAT_RF64 && container != SF_FORMAT_W64) {
+        return nullptr;
+    }
+    if (endianness != SF_ENDIAN_FILE && endianness != SF_ENDIAN_LITTLE) {
+        return nullptr;
+    }
+
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 44) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (mapping == MAP_FAILED) {
+        return nullptr;
+    }
+
+    std::unique_ptr<MappedPcmFile> pcm(new MappedPcmFile());
+    pcm->mapping_ = mapping;
+    pcm->mapping_size_ = st.st_size;
+
+    const auto* bytes = static_cast<const unsigned char*>(mapping);
+    pcm_layout layout;
+    const bool parsed = (container == SF_FORMAT_W64)
+        ? parse_w64(bytes, pcm->mapping_size_, layout)
+        : parse_riff(bytes, pcm->mapping_size_, layout);
+
+    if (!parsed) {
+        return nullptr;
+    }
+
+    if (layout.format_tag == wave_format_pcm && layout.bits_per_sample == 16) {
+        pcm->encoding_ = encoding::pcm_16;
+    } else if (layout.format_tag == wave_format_pcm && layout.bits_per_sample == 24) {
+        pcm->encoding_ = encoding::pcm_24;
+    } else if (layout.format_tag == wave_format_pcm && layout.bits_per_sample == 32) {
+        pcm->encoding_ = encoding::pcm_32;
+    } else if (layout.format_tag == wave_format_ieee_float && layout.bits_per_sample == 32) {
+        pcm->encoding_ = encoding::float_32;
+    } else {
+        return nullptr;
+    }
+
+    pcm->channels_ = layout.channels;
+    pcm->bytes_per_sample_ = layout.bits_per_sample / 8;
+    pcm->data_ = bytes + layout.data_offset;
+
+    if (pcm->channels_ <= 0 || layout.block_align != pcm->channels_ * pcm->bytes_per_sample_) {
+        return nullptr;
+    }
+
+    pcm->frames_ = static_cast<sf_count_t>(layout.data_size / layout.block_align);
+
+    // Anything libsndfile interprets differently is left to libsndfile
+    if (pcm->channels_ != wav.channels() || pcm->frames_ != wav.frames()) {
+        return nullptr;
+    }
+
+    // The data is read front to back, once
+    pcm->advise(MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    pcm->advise(MADV_HUGEPAGE);
+#endif
+
+    return pcm;
+}
+
+void MappedPcmFile::advise_sparse_reads() const noexcept {
+    advise(MADV_RANDOM);
+#ifdef MADV_NOHUGEPAGE
+    advise(MADV_NOHUGEPAGE);
+#endif
+}
+
+void MappedPcmFile::advise(int advice) const noexcept {
+    const auto page_size = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+    auto* data_page = reinterpret_cast<unsigned char*>(reinterpret_cast<std::uintptr_t>(data_) & ~(page_size - 1));
+    const std::size_t advised_size = mapping_size_ - (data_page - static_cast<const unsigned char*>(mapping_));
+    madvise(data_page, advised_size, advice);
+}
+
+const short* MappedPcmFile::samples_s16() const noexcept {
+    if (encoding_ != encoding::pcm_16 || reinterpret_cast<std::uintptr_t>(data_) % alignof(short) != 0) {
+        return nullptr;
+    }
+    return reinterpret_cast<const short*>(data_);
+}
+
+const int* MappedPcmFile::samples_s32() const noexcept {
+    if (encoding_ != encoding::pcm_32 || reinterpret_cast<std::uintptr_t>(data_) % alignof(int) != 0) {
+        return nullptr;
+    }
+    return reinterpret_cast<const int*>(data_);
+}
+
+const float* MappedPcmFile::samples_f32() const noexcept {
+    if (encoding_ != encoding::float_32 || reinterpret_cast<std::uintptr_t>(data_) % alignof(float) != 0) {
+        return nullptr;
+    }
+    return reinterpret_cast<const float*>(data_);
+}
+
+void MappedPcmFile::read_s16(sf_count_t first_frame, sf_count_t frame_count, short* dest) const noexcept {
+    const std::size_t n = static_cast<std::size_t>(frame_count) * channels_;
+    const unsigned char* src = data_ + static_cast<std::size_t>(first_frame) * channels_ * bytes_per_sample_;
+
+    switch (encoding_) {
+    case encoding::pcm_16:
+        std::memcpy(dest, src, n * sizeof(short));
+        break;
+    case encoding::pcm_24:
+        // Most significant 16 bits of each sample
+        for (std::size_t i = 0; i < n; ++i, src += 3) {
+            dest[i] = static_cast<short>(le16(src + 1));
+        }
+        break;
+    case encoding::pcm_32:
+        for (std::size_t i = 0; i < n; ++i, src += 4) {
+            dest[i] = static_cast<short>(le16(src + 2));
+        }
+        break;
+    case encoding::float_32:
+        // Scaling float to integer follows libsndfile's settings, which are
+        // not replicated here
+        break;
+    }
+}
+
+void MappedPcmFile::read_s32(sf_count_t first_frame, sf_count_t frame_count, int* dest) const noexcept {
+    const std::size_t n = static_cast<std::size_t>(frame_count) * channels_;
+    const unsigned char* src = data_ + static_cast<std::size_t>(first_frame) * channels_ * bytes_per_sample_;
+
+    switch (encoding_) {
+    case encoding::pcm_16:
+        for (std::size_t i = 0; i < n; ++i, src += 2) {
+            dest[i] = static_cast<int>(static_cast<std::uint32_t>(le16(src)) << 16);
+        }
+        break;
+    case encoding::pcm_24:
+        // Load 4 bytes and shift out the one of the next sample, except for
+        // the last sample, which may end the mapping
+        for (std::size_t i = 0; i + 1 < n; ++i, src += 3) {
+            std::uint32_t word;
+            std::memcpy(&word, src, sizeof(word));
+            dest[i] = static_cast<int>(word << 8);
+        }
+        if (n > 0) {
+            dest[n - 1] = static_cast<int>(static_cast<std::uint32_t>(src[0]) << 8
+                | static_cast<std::uint32_t>(le16(src + 1)) << 16);
+        }
+        break;
+    case encoding::pcm_32:
+        std::memcpy(dest, src, n * sizeof(int));
+        break;
+    case encoding::float_32:
+        break;
+    }
+}
+
+void MappedPcmFile::read_f32(sf_count_t first_frame, sf_count_t frame_count, float* dest) const noexcept {
+    if (encoding_ == encoding::float_32) {
+        const std::size_t n = static_cast<std::size_t>(frame_count) * channels_;
+        std::memcpy(dest, data_ + static_cast<std::size_t>(first_frame) * channels_ * sizeof(float), n * sizeof(float));
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <sndfile.hh>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// Read-only memory mapping of the sample data of an uncompressed PCM file
+// (WAV, RF64 or W64; 16, 24 or 32 bit integer or 32 bit float; interleaved,
+// little-endian). Lets the renderer reduce samples straight from the page
+// cache instead of copying them through libsndfile.
+class MappedPcmFile {
+public:
+    enum class encoding {
+        pcm_16,
+        pcm_24,
+        pcm_32,
+        float_32
+    };
+
+    ~MappedPcmFile();
+
+    MappedPcmFile(const MappedPcmFile&) = delete;
+    MappedPcmFile& operator=(const MappedPcmFile&) = delete;
+
+    // Map filename if it has one of the supported layouts and agrees with what
+    // libsndfile reported in wav. Returns nullptr otherwise, in which case the
+    // file should be read through libsndfile. Always returns nullptr on
+    // big-endian hosts.
+    static std::unique_ptr<MappedPcmFile> open(const std::string& filename, const SndfileHandle& wav);
+
+    encoding get_encoding() const noexcept { return encoding_; }
+    int channels() const noexcept { return channels_; }
+    sf_count_t frames() const noexcept { return frames_; }
+    sf_count_t bytes_per_frame() const noexcept {
+        return static_cast<sf_count_t>(bytes_per_sample_) * channels_;
+    }
+
+    // Samples of 16 bit, 32 bit and float files, if suitably aligned for
+    // direct access
+    const short* samples_s16() const noexcept;
+    const int* samples_s32() const noexcept;
+    const float* samples_f32() const noexcept;
+
+    // True for the integer encodings, which read_s16 and read_s32 can convert
+    bool can_read_s16() const noexcept { return encoding_ != encoding::float_32; }
+    bool can_read_s32() const noexcept { return encoding_ != encoding::float_32; }
+
+    // True for float files, which read_f32 copies
+    bool can_read_f32() const noexcept { return encoding_ == encoding::float_32; }
+
+    // Convert frames [first_frame, first_frame + frame_count) to 16 bit,
+    // truncating like libsndfile does. Requires can_read_s16().
+    void read_s16(sf_count_t first_frame, sf_count_t frame_count, short* dest) const noexcept;
+
+    // Convert frames to left-justified 32 bit, like libsndfile does. Requires
+    // can_read_s32().
+    void read_s32(sf_count_t first_frame, sf_count_t frame_count, int* dest) const noexcept;
+
+    // Copy frames of a float file. Requires can_read_f32().
+    void read_f32(sf_count_t first_frame, sf_count_t frame_count, float* dest) const noexcept;
+
+    // Read ahead only what is touched, for reading small parts of the file
+    // like previews do, instead of the whole file front to back
+    void advise_sparse_reads() const noexcept;
+
+private:
+    MappedPcmFile() = default;
+
+    void advise(int advice) const noexcept;
+
+    void* mapping_ = nullptr;
+    std::size_t mapping_size_ = 0;
+
+    const unsigned char* data_ = nullptr;
+    encoding encoding_ = encoding::pcm_16;
+    int channels_ = 0;
+    std::size_t bytes_per_sample_ = 0;
+    sf_count_t frames_ = 0;
+};
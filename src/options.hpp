@@ -2,47 +2,72 @@
 
 #include <boost/program_options.hpp>
 #include <png++/png.hpp>
+#include <algorithm>
+#include <cmath>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 #include "./version.hpp"
+#include "peak_data.hpp"
+#include "png_writer.hpp"
+#include "wav2png.hpp"
+
+// Position in the input, given as seconds or as a frame number
+struct time_position {
+    double seconds = 0.0;
+    sf_count_t frame = -1;  // used instead of seconds if not negative
+
+    sf_count_t to_frame(int samplerate) const noexcept {
+        return frame >= 0 ? frame : static_cast<sf_count_t>(std::llround(seconds * samplerate));
+    }
+};
 
 class Options {
 public:
+    // Default settings
+    Options() = default;
+
+    // Parse the command line and config file. Prints help and exits on error.
     Options(int argc, char* argv[]) {
         namespace po = boost::program_options;
 
+        const Options defaults;
+
         po::options_description generic("Generic options");
         generic.add_options()
             ("version,v", "print version string")
-            ("help", "produce help message");
+            ("help", "produce help message")
+            ("stats", po::value(&stats)->zero_tokens()->default_value(false),
+                "after rendering, print the time spent in each phase, throughput and peak memory to stderr")
+            ("stats-format", po::value(&stats_format)->default_value("text"),
+                "format of --stats, text or json");
 
         po::options_description config("Configuration");
-        config.add_options()
-            ("width,w", po::value<unsigned>(&width)->default_value(1800),
-                "width of generated image")
-            ("height,h", po::value<unsigned>(&height)->default_value(280),
-                "height of generated image")
-            ("background-color,b", po::value<std::string>(&background_color_string)->default_value("efefef"),
-                "color of background in hex (RRGGBB or RRGGBBAA)")
-            ("foreground-color,f", po::value<std::string>(&foreground_color_string)->default_value("000000"),
-                "color of foreground in hex (RRGGBB or RRGGBBAA)")
-            ("output,o", po::value<std::string>(&output_file_name)->default_value(""),
-                "name of output file, defaults to <name of inputfile>.png")
-            ("config-file,c", po::value<std::string>(&config_file_name)->default_value("wav2png.cfg"),
-                "config file to use")
-            ("db-scale,d", po::value(&use_db_scale)->zero_tokens()->default_value(false),
-                "use logarithmic (e.g. decibel) scale instead of linear scale")
-            ("db-min", po::value(&db_min)->default_value(-48.0f),
-                "minimum value of the signal in dB, that will be visible in the waveform")
-            ("db-max", po::value(&db_max)->default_value(0.0f),
-                "maximum value of the signal in dB, that will be visible in the waveform. "
-                "Useful if you know that your signal peaks at a certain level.")
-            ("line-only,l", po::value(&line_only)->zero_tokens()->default_value(false),
-                "do a line only (no fill)");
+        add_config_options(config, defaults);
+
+        po::options_description batch("Batch processing");
+        batch.add_options()
+            ("batch", po::value<std::string>(&batch_file_name),
+                "render all files listed in a manifest file, use - to read it from stdin. "
+                "Each line holds an input file name, optionally followed by options "
+                "overriding the ones given on the command line")
+            ("jobs,j", po::value<unsigned>(&jobs)->default_value(defaults.jobs),
+                "number of files rendered in parallel in batch mode, 0 uses one per CPU core")
+            ("serve", po::value<std::string>(&serve_socket_name),
+                "keep running and render requests received on this Unix socket, each a line "
+                "like the ones of a batch manifest, on a pool of --jobs workers");
+
+        po::options_description outputs("Additional outputs");
+        outputs.add_options()
+            ("extra-output", po::value<std::vector<std::string>>(&extra_output_strings),
+                "also render another image from the same decode of the input, given as options "
+                "overriding the ones above, e.g. \"-w 300 -h 60 -d -o thumb.png\". "
+                "May be given several times");
 
         po::options_description hidden("Hidden options");
         hidden.add_options()
@@ -52,13 +77,13 @@ public:
         p.add("input-file", -1);
 
         po::options_description cmdline_options;
-        cmdline_options.add(generic).add(config).add(hidden);
+        cmdline_options.add(generic).add(config).add(outputs).add(batch).add(hidden);
 
         po::options_description config_file_options;
         config_file_options.add(config).add(hidden);
 
         po::options_description visible("Allowed options");
-        visible.add(generic).add(config);
+        visible.add(generic).add(config).add(outputs).add(batch);
 
         po::variables_map vm;
 
@@ -101,32 +126,26 @@ public:
             parse_error = true;
         }
 
-        // Parse colors
-        try {
-            foreground_color = parse_color(foreground_color_string);
-            background_color = parse_color(background_color_string);
-        } catch (const std::exception& e) {
-            std::cerr << "Error: " << e.what() << std::endl;
-            parse_error = true;
-        }
+        // In batch mode, input files come from the manifest, and when serving
+        // from the requests
+        const bool needs_input = !is_batch() && !is_serving();
 
-        if (input_file_name.empty()) {
-            std::cerr << "Error: no input file supplied." << std::endl;
+        for (const auto& error : validate(needs_input)) {
+            std::cerr << "Error: " << error << std::endl;
             parse_error = true;
         }
 
-        if (output_file_name.empty()) {
-            output_file_name = input_file_name + ".png";
-        }
-
-        if (width == 0) {
-            std::cerr << "Error: width cannot be 0." << std::endl;
-            parse_error = true;
-        }
-
-        if (height == 0) {
-            std::cerr << "Error: height cannot be 0." << std::endl;
-            parse_error = true;
+        // Check the extra outputs up front rather than after decoding
+        if (!parse_error && !extra_output_strings.empty()) {
+            try {
+                if (is_batch() || is_serving()) {
+                    throw std::runtime_error("extra outputs cannot be combined with batch mode or --serve.");
+                }
+                extra_outputs();
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+                parse_error = true;
+            }
         }
 
         if (parse_error || vm.count("help")) {
@@ -140,22 +159,269 @@ public:
         }
     }
 
-    unsigned width = 0;
-    unsigned height = 0;
-    std::string background_color_string;
-    std::string foreground_color_string;
+    // Parse the arguments of a batch manifest line. Options not given in args
+    // keep the value they have in base. Throws std::runtime_error on error.
+    Options(const Options& base, const std::vector<std::string>& args) {
+        namespace po = boost::program_options;
+
+        po::options_description config("Configuration");
+        add_config_options(config, base);
+
+        po::options_description hidden("Hidden options");
+        hidden.add_options()
+            ("input-file", po::value<std::string>(&input_file_name), "input file");
+
+        po::positional_options_description p;
+        p.add("input-file", 1);
+
+        po::options_description line_options;
+        line_options.add(config).add(hidden);
+
+        po::variables_map vm;
+        po::store(
+            po::command_line_parser(args)
+                .options(line_options)
+                .positional(p)
+                .run(),
+            vm
+        );
+        po::notify(vm);
+
+        // The output file name is derived from the input of this line
+        if (!vm.count("output") || vm["output"].defaulted()) {
+            output_file_name.clear();
+        }
+
+        const auto errors = validate(true);
+        if (!errors.empty()) {
+            throw std::runtime_error(errors.front());
+        }
+    }
+
+    bool is_batch() const noexcept { return !batch_file_name.empty(); }
+
+    bool is_serving() const noexcept { return !serve_socket_name.empty(); }
+
+    // Options of the images given by --extra-output, each derived from these
+    // options. Throws std::runtime_error on error.
+    std::vector<Options> extra_outputs() const {
+        std::vector<Options> outputs;
+        std::vector<std::string> file_names{ output_file_name };
+
+        for (const auto& spec : extra_output_strings) {
+            auto args = boost::program_options::split_unix(spec);
+            args.insert(args.begin(), input_file_name);
+
+            Options output(*this, args);
+            if (std::find(file_names.begin(), file_names.end(), output.output_file_name) != file_names.end()) {
+                throw std::runtime_error(
+                    "extra output '" + spec + "' writes to '" + output.output_file_name +
+                    "' like another image. give it its own -o"
+                );
+            }
+            if (output.percentile_low != percentile_low || output.percentile_high != percentile_high) {
+                throw std::runtime_error("extra output '" + spec + "' cannot use different percentiles.");
+            }
+            if (output.start_string != start_string || output.end_string != end_string) {
+                throw std::runtime_error("extra output '" + spec + "' cannot use a different range.");
+            }
+
+            file_names.push_back(output.output_file_name);
+            outputs.push_back(std::move(output));
+        }
+
+        return outputs;
+    }
+
+    // Geometry and appearance of the waveform
+    waveform_params waveform() const {
+        waveform_params params;
+        params.width = width;
+        params.height = height;
+        params.use_db_scale = use_db_scale;
+        params.db_min = db_min;
+        params.db_max = db_max;
+        params.line_only = line_only;
+        params.percentile_low = percentile_low;
+        params.percentile_high = percentile_high;
+        params.rms_layer = !rms_color_string.empty();
+        params.statistics = writes_image() ? 0 : peak_data.values;
+        params.preview_frames = preview ? preview_frames : 0;
+        params.lanes = lanes;
+        params.split_channels = split_channels;
+        return params;
+    }
+
+    // Set the frame range of params from --start and --end, for an input of
+    // the given sample rate. Throws std::runtime_error if it is empty.
+    void apply_range(waveform_params& params, int samplerate) const {
+        params.start_frame = start_position.to_frame(samplerate);
+        params.end_frame = end_string.empty() ? -1 : end_position.to_frame(samplerate);
+
+        if (params.end_frame >= 0 && params.end_frame <= params.start_frame) {
+            throw std::runtime_error("the end of the range must be after its start.");
+        }
+    }
+
+    bool has_range() const noexcept {
+        return !start_string.empty() || !end_string.empty();
+    }
+
+    // False if the output is peak data rather than a PNG image
+    bool writes_image() const noexcept {
+        return output_format_string == "png";
+    }
+
+    // True if the input is read in a single pass without relying on its
+    // length, which standard input always is
+    bool streams() const noexcept {
+        return stream || input_file_name == "-";
+    }
+
+    // True if --stats asked for timing and throughput to be reported
+    bool reports_stats() const noexcept {
+        return stats;
+    }
+
+    // True if outputs are kept in and copied from --output-cache
+    bool caches_output() const noexcept {
+        return !output_cache_directory.empty();
+    }
+
+    // Everything about these options that affects the output file, in a
+    // normalized form: two options with the same key render the same file
+    // from the same input. Includes the version, as the renderer may change.
+    std::string render_key() const {
+        const auto color_key = [](const png::rgba_pixel& color) {
+            std::ostringstream key;
+            key << std::hex << (static_cast<unsigned>(color.red) << 24 | static_cast<unsigned>(color.green) << 16
+                                | static_cast<unsigned>(color.blue) << 8 | static_cast<unsigned>(color.alpha));
+            return key.str();
+        };
+        const auto position_key = [](const time_position& position) {
+            std::ostringstream key;
+            key << std::setprecision(17);
+            if (position.frame >= 0) {
+                key << position.frame << 'f';
+            } else {
+                key << position.seconds << 's';
+            }
+            return key.str();
+        };
+
+        std::ostringstream key;
+        key << std::setprecision(9)
+            << "wav2png " << version::version
+            << " size " << width << 'x' << height
+            << " colors " << color_key(background_color) << ' ' << color_key(foreground_color) << ' '
+            << (rms_color_string.empty() ? "-" : color_key(rms_color))
+            << " line " << line_only
+            << " percentiles " << percentile_low << ' ' << percentile_high
+            << " preview " << (preview ? preview_frames : 0)
+            << " peak-cache " << use_peak_cache
+            << " range " << (start_string.empty() ? "-" : position_key(start_position))
+            << ' ' << (end_string.empty() ? "-" : position_key(end_position));
+
+        if (use_db_scale) {
+            key << " db " << db_min << ' ' << db_max;
+        }
+
+        if (has_lanes()) {
+            key << " lanes";
+            if (split_channels) {
+                key << " split";
+            }
+            for (const auto& lane : lanes) {
+                key << ' ' << static_cast<int>(lane.source) << ':' << lane.channel;
+            }
+        }
+
+        if (writes_image()) {
+            key << " png " << png.compact << ' ' << png.level << ' ' << png.strategy << ' ' << png.filters;
+        } else {
+            key << ' ' << output_format_string << ' ' << peak_data.bits << ' ' << peak_data.values;
+        }
+
+        return key.str();
+    }
+
+    // True if a pyramid of tiles is rendered instead of a single image
+    bool writes_tiles() const noexcept {
+        return !tiles_directory.empty();
+    }
+
+    // True if --channels asked for lanes rather than all channels mixed
+    bool has_lanes() const noexcept {
+        return split_channels || !lanes.empty();
+    }
+
+    unsigned width = 1800;
+    unsigned height = 280;
+    std::string background_color_string = "efefef";
+    std::string foreground_color_string = "000000";
+
+    std::string rms_color_string;
 
     png::rgba_pixel background_color;
     png::rgba_pixel foreground_color;
+    png::rgba_pixel rms_color;
 
     std::string output_file_name;
     std::string input_file_name;
-    std::string config_file_name;
+    std::string config_file_name = "wav2png.cfg";
 
     bool use_db_scale = false;
     float db_min = -48.0f;
     float db_max = 0.0f;
     bool line_only = false;
+    unsigned threads = 1;
+
+    std::string percentile_string;
+    float percentile_low = 0.0f;
+    float percentile_high = 100.0f;
+
+    std::string channels_string = "mix";
+    std::vector<waveform_lane> lanes;
+    bool split_channels = false;
+
+    std::string start_string;
+    std::string end_string;
+    time_position start_position;
+    time_position end_position;
+
+    std::string tiles_directory;
+    unsigned tile_levels = 0;
+
+    bool preview = false;
+    unsigned preview_frames = 4096;
+
+    bool stream = false;
+    double stream_interval = 0.0;
+
+    bool use_peak_cache = false;
+    std::string peak_cache_file_name;
+
+    std::string output_cache_directory;
+    unsigned output_cache_megabytes = 1024;
+
+    std::string batch_file_name;
+    unsigned jobs = 0;
+
+    std::string serve_socket_name;
+
+    bool stats = false;
+    std::string stats_format = "text";
+
+    std::vector<std::string> extra_output_strings;
+
+    std::string output_format_string = "png";
+    std::string data_values_string = "peak,median";
+    peak_data_settings peak_data;
+
+    std::string png_format_string = "auto";
+    std::string png_strategy_string = "default";
+    std::string png_filter_string = "default";
+    png_settings png;
 
 private:
     class color_parse_error : public std::runtime_error {
@@ -164,6 +430,256 @@ private:
             : std::runtime_error(message) {}
     };
 
+    // Options shared between the command line, the config file and batch
+    // manifest lines, bound to this object and defaulting to the values in
+    // defaults
+    void add_config_options(
+        boost::program_options::options_description& config,
+        const Options& defaults
+    ) {
+        namespace po = boost::program_options;
+
+        config.add_options()
+            ("width,w", po::value<unsigned>(&width)->default_value(defaults.width),
+                "width of generated image")
+            ("height,h", po::value<unsigned>(&height)->default_value(defaults.height),
+                "height of generated image")
+            ("background-color,b", po::value<std::string>(&background_color_string)->default_value(defaults.background_color_string),
+                "color of background in hex (RRGGBB or RRGGBBAA)")
+            ("foreground-color,f", po::value<std::string>(&foreground_color_string)->default_value(defaults.foreground_color_string),
+                "color of foreground in hex (RRGGBB or RRGGBBAA)")
+            ("rms-color", po::value<std::string>(&rms_color_string)->default_value(defaults.rms_color_string),
+                "also draw the RMS of each column in this color (RRGGBB or RRGGBBAA), inside the peaks")
+            ("output,o", po::value<std::string>(&output_file_name)->default_value(defaults.output_file_name),
+                "name of output file, defaults to <name of inputfile>.png")
+            ("config-file,c", po::value<std::string>(&config_file_name)->default_value(defaults.config_file_name),
+                "config file to use")
+            ("db-scale,d", po::value(&use_db_scale)->zero_tokens()->default_value(defaults.use_db_scale),
+                "use logarithmic (e.g. decibel) scale instead of linear scale")
+            ("db-min", po::value(&db_min)->default_value(defaults.db_min),
+                "minimum value of the signal in dB, that will be visible in the waveform")
+            ("db-max", po::value(&db_max)->default_value(defaults.db_max),
+                "maximum value of the signal in dB, that will be visible in the waveform. "
+                "Useful if you know that your signal peaks at a certain level.")
+            ("line-only,l", po::value(&line_only)->zero_tokens()->default_value(defaults.line_only),
+                "do a line only (no fill)")
+            ("percentile", po::value<std::string>(&percentile_string)->default_value(defaults.percentile_string),
+                "fill between two percentiles of each column instead of its minimum and maximum, "
+                "e.g. 5,95 to ignore isolated peaks")
+            ("channels", po::value<std::string>(&channels_string)->default_value(defaults.channels_string),
+                "channels to draw: mix (all channels in one waveform), split (a lane per channel), or "
+                "lanes stacked from the top, a list of left, right, mid, side, downmix, mix and channel "
+                "numbers, e.g. mid,side or 1,2,downmix")
+            ("start", po::value<std::string>(&start_string)->default_value(defaults.start_string),
+                "start of the range to render, in seconds, as [hh:]mm:ss[.fff], or as a frame number "
+                "followed by f, e.g. 90, 1:30 or 3969000f")
+            ("end", po::value<std::string>(&end_string)->default_value(defaults.end_string),
+                "end of the range to render, like --start. defaults to the end of the input")
+            ("tiles", po::value<std::string>(&tiles_directory)->default_value(defaults.tiles_directory),
+                "render a zoom pyramid of tiles of width x height pixels into this directory instead "
+                "of a single image, as <level>/<index>.png described by tiles.json")
+            ("tile-levels", po::value<unsigned>(&tile_levels)->default_value(defaults.tile_levels),
+                "number of zoom levels of --tiles, 0 adds levels until a column holds at most 256 frames")
+            ("preview", po::value(&preview)->zero_tokens()->default_value(defaults.preview),
+                "render a fast approximate preview, reading only evenly spaced windows of each column "
+                "of seekable inputs")
+            ("preview-frames", po::value<unsigned>(&preview_frames)->default_value(defaults.preview_frames),
+                "frames read per column by --preview, which bounds the time taken by the image width "
+                "rather than the length of the input")
+            ("stream", po::value(&stream)->zero_tokens()->default_value(defaults.stream),
+                "read the input in a single pass without relying on its length, for pipes and live "
+                "capture. implied by the input file name -, which reads standard input")
+            ("stream-interval", po::value<double>(&stream_interval)->default_value(defaults.stream_interval),
+                "while streaming, rewrite the image with the waveform read so far every this many "
+                "seconds. 0 writes it once the input ends")
+            ("threads,t", po::value<unsigned>(&threads)->default_value(defaults.threads),
+                "number of threads used to compute the waveform, 0 uses one per CPU core")
+            ("peak-cache", po::value(&use_peak_cache)->zero_tokens()->default_value(defaults.use_peak_cache),
+                "render from a peak cache file, building it first if it is missing or outdated. line-only images are always rendered from the audio")
+            ("peak-cache-file", po::value<std::string>(&peak_cache_file_name)->default_value(defaults.peak_cache_file_name),
+                "name of the peak cache file, defaults to <name of inputfile>.w2p")
+            ("output-cache", po::value<std::string>(&output_cache_directory)->default_value(defaults.output_cache_directory),
+                "keep rendered outputs in this directory, keyed by the content of the input and the options, "
+                "and copy them from there instead of rendering the same output again")
+            ("output-cache-size", po::value<unsigned>(&output_cache_megabytes)->default_value(defaults.output_cache_megabytes),
+                "size limit of the output cache in megabytes. least recently used outputs are removed beyond it")
+            ("output-format", po::value<std::string>(&output_format_string)->default_value(defaults.output_format_string),
+                "format of the output: png, or the values of each column without an image as binary or json")
+            ("data-bits", po::value<int>(&peak_data.bits)->default_value(defaults.peak_data.bits),
+                "bits per value of binary and json output, 8 or 16")
+            ("data-values", po::value<std::string>(&data_values_string)->default_value(defaults.data_values_string),
+                "values of each column in binary and json output, a list of peak (min and max), mean, rms, "
+                "median and clipped, or all")
+            ("png-format", po::value<std::string>(&png_format_string)->default_value(defaults.png_format_string),
+                "pixel format of the output: auto (smallest format holding the colors, e.g. a 1 bit palette) or rgba")
+            ("png-level", po::value<int>(&png.level)->default_value(defaults.png.level),
+                "zlib compression level of the output, from 0 (none) to 9 (best)")
+            ("png-strategy", po::value<std::string>(&png_strategy_string)->default_value(defaults.png_strategy_string),
+                "zlib compression strategy: default (chosen by libpng), zlib, filtered, huffman, rle or fixed")
+            ("png-filter", po::value<std::string>(&png_filter_string)->default_value(defaults.png_filter_string),
+                "PNG row filter: default (chosen by libpng), none, sub, up, avg, paeth or all");
+    }
+
+    // Parse colors, derive defaults and check the values. Returns the error
+    // messages.
+    std::vector<std::string> validate(bool needs_input) {
+        std::vector<std::string> errors;
+
+        // Parse colors
+        try {
+            foreground_color = parse_color(foreground_color_string);
+            background_color = parse_color(background_color_string);
+            if (!rms_color_string.empty()) {
+                rms_color = parse_color(rms_color_string);
+            }
+        } catch (const std::exception& e) {
+            errors.push_back(e.what());
+        }
+
+        if (needs_input && input_file_name.empty()) {
+            errors.push_back("no input file supplied.");
+        }
+
+        if (is_serving() && (is_batch() || !input_file_name.empty())) {
+            errors.push_back("--serve takes its input files from requests, not from the command line or --batch.");
+        }
+
+        // Output format
+        if (output_format_string == "binary") {
+            peak_data.format = peak_data_format::binary;
+        } else if (output_format_string == "json") {
+            peak_data.format = peak_data_format::json;
+        } else if (output_format_string != "png") {
+            errors.push_back("unknown output format '" + output_format_string + "'.");
+        }
+
+        if (output_file_name.empty() && input_file_name == "-") {
+            errors.push_back("reading standard input requires an output file name (-o).");
+        } else if (output_file_name.empty() && !input_file_name.empty()) {
+            output_file_name = input_file_name + "." + (output_format_string == "binary" ? "peaks" : output_format_string);
+        }
+
+        if (peak_data.bits != 8 && peak_data.bits != 16) {
+            errors.push_back("data bits must be 8 or 16.");
+        }
+
+        try {
+            peak_data.values = parse_data_values(data_values_string);
+        } catch (const std::exception& e) {
+            errors.push_back(e.what());
+        }
+
+        if (width == 0) {
+            errors.push_back("width cannot be 0.");
+        }
+
+        if (height == 0) {
+            errors.push_back("height cannot be 0.");
+        }
+
+        if (!percentile_string.empty()) {
+            try {
+                parse_percentiles(percentile_string, percentile_low, percentile_high);
+            } catch (const std::exception& e) {
+                errors.push_back(e.what());
+            }
+        }
+
+        try {
+            parse_channels(channels_string, lanes, split_channels);
+        } catch (const std::exception& e) {
+            errors.push_back(e.what());
+        }
+
+        if (has_lanes()) {
+            if (!writes_image()) {
+                errors.push_back("lanes are only drawn into png images.");
+            }
+            if (writes_tiles() || !extra_output_strings.empty()) {
+                errors.push_back("lanes are rendered one image at a time, not into tiles or extra outputs.");
+            }
+        }
+
+        try {
+            start_position = start_string.empty() ? time_position() : parse_position(start_string);
+            end_position = end_string.empty() ? time_position() : parse_position(end_string);
+        } catch (const std::exception& e) {
+            errors.push_back(e.what());
+        }
+
+        if (writes_tiles()) {
+            if (!writes_image()) {
+                errors.push_back("tiles are always written as png.");
+            }
+            if (use_peak_cache) {
+                errors.push_back("tiles are rendered from the audio and cannot use the peak cache.");
+            }
+            if (!extra_output_strings.empty()) {
+                errors.push_back("tiles cannot be combined with extra outputs.");
+            }
+        }
+
+        if (preview) {
+            if (use_peak_cache) {
+                errors.push_back("previews are rendered from the audio and cannot use the peak cache.");
+            }
+            if (writes_tiles() || !extra_output_strings.empty()) {
+                errors.push_back("previews are rendered one image at a time.");
+            }
+        }
+
+        if (streams()) {
+            if (use_peak_cache || writes_tiles() || !extra_output_strings.empty() || preview) {
+                errors.push_back("streamed input is rendered into a single image, without the peak cache or previews.");
+            }
+            if (!writes_image() || !percentile_string.empty() || has_range() || has_lanes()) {
+                errors.push_back("streamed input cannot be rendered as peak data, with percentiles, in ranges or in lanes.");
+            }
+        } else if (stream_interval != 0.0) {
+            errors.push_back("a stream interval requires --stream.");
+        }
+
+        if (caches_output() && (writes_tiles() || streams() || !extra_output_strings.empty())) {
+            errors.push_back("the output cache holds single outputs of files, not tiles, streams or extra outputs.");
+        }
+
+        if (stats_format != "text" && stats_format != "json") {
+            errors.push_back("stats format must be text or json.");
+        }
+
+        if (stream_interval < 0.0) {
+            errors.push_back("stream interval cannot be negative.");
+        }
+
+        if (preview_frames < 16) {
+            errors.push_back("preview frames must be at least 16.");
+        }
+
+        if (tile_levels > 24) {
+            errors.push_back("tile levels must be in range [0-24].");
+        }
+
+        // PNG encoding
+        if (png_format_string == "auto" || png_format_string == "rgba") {
+            png.compact = png_format_string == "auto";
+        } else {
+            errors.push_back("unknown png format '" + png_format_string + "'.");
+        }
+
+        if (png.level < 0 || png.level > 9) {
+            errors.push_back("png level must be in range [0-9].");
+        }
+
+        try {
+            png.strategy = parse_png_strategy(png_strategy_string);
+            png.filters = parse_png_filter(png_filter_string);
+        } catch (const std::exception& e) {
+            errors.push_back(e.what());
+        }
+
+        return errors;
+    }
+
     static png::rgba_pixel parse_color(const std::string& str) {
         std::string color_str = str;
 
@@ -197,11 +713,138 @@ private:
         );
     }
 
+    static void parse_percentiles(const std::string& str, float& low, float& high) {
+        std::stringstream ss(str);
+        char separator = 0;
+        ss >> low >> separator >> high;
+
+        if (ss.fail() || !ss.eof() || separator != ',') {
+            throw std::runtime_error(
+                "failed to parse percentiles '" + str + "'. expected two numbers, e.g. 5,95"
+            );
+        }
+        if (low < 0.0f || high > 100.0f || low >= high) {
+            throw std::runtime_error("percentiles must be in range [0-100] and ascending.");
+        }
+    }
+
+    // Seconds, [hh:]mm:ss[.fff] or a frame number followed by f
+    static time_position parse_position(const std::string& str) {
+        time_position position;
+        bool valid = !str.empty();
+
+        if (valid && str.back() == 'f') {
+            std::stringstream ss(str.substr(0, str.size() - 1));
+            valid = (ss >> position.frame) && ss.eof() && position.frame >= 0;
+        } else {
+            // Every field before a colon counts 60 times the next one
+            std::stringstream ss(str);
+            std::string field;
+            int fields = 0;
+
+            while (valid && std::getline(ss, field, ':')) {
+                std::stringstream field_ss(field);
+                double value = 0.0;
+                valid = (field_ss >> value) && field_ss.eof() && value >= 0.0 && ++fields <= 3;
+                position.seconds = position.seconds * 60.0 + value;
+            }
+            valid = valid && std::isfinite(position.seconds);
+        }
+
+        if (!valid) {
+            throw std::runtime_error(
+                "failed to parse position '" + str + "'. expected seconds, [hh:]mm:ss or frames, "
+                "e.g. 90, 1:30 or 3969000f"
+            );
+        }
+        return position;
+    }
+
+    // mix, split, or a list of lanes
+    static void parse_channels(const std::string& str, std::vector<waveform_lane>& lanes, bool& split) {
+        lanes.clear();
+        split = str == "split";
+        if (split || str == "mix") {
+            return;
+        }
+
+        std::stringstream ss(str);
+        std::string name;
+
+        while (std::getline(ss, name, ',')) {
+            waveform_lane lane;
+            if (name == "left") lane = { lane_source::channel, 0 };
+            else if (name == "right") lane = { lane_source::channel, 1 };
+            else if (name == "mid") lane.source = lane_source::mid;
+            else if (name == "side") lane.source = lane_source::side;
+            else if (name == "downmix") lane.source = lane_source::downmix;
+            else if (name == "mix") lane.source = lane_source::mix;
+            else {
+                std::stringstream number_ss(name);
+                int channel = 0;
+                if (!(number_ss >> channel) || !number_ss.eof() || channel < 1) {
+                    throw std::runtime_error(
+                        "unknown channel '" + name + "'. expected mix, split or a list of left, right, mid, "
+                        "side, downmix, mix and channel numbers");
+                }
+                lane = { lane_source::channel, channel - 1 };
+            }
+            lanes.push_back(lane);
+        }
+
+        if (lanes.empty()) {
+            throw std::runtime_error("no channels given.");
+        }
+    }
+
+    static unsigned parse_data_values(const std::string& str) {
+        unsigned values = 0;
+        std::stringstream ss(str);
+        std::string name;
+
+        while (std::getline(ss, name, ',')) {
+            if (name == "peak") values |= stat_peak;
+            else if (name == "mean") values |= stat_mean;
+            else if (name == "rms") values |= stat_rms;
+            else if (name == "median") values |= stat_median;
+            else if (name == "clipped") values |= stat_clipped;
+            else if (name == "all") values |= stat_all;
+            else throw std::runtime_error("unknown data value '" + name + "'.");
+        }
+
+        if (values == 0) {
+            throw std::runtime_error("no data values given.");
+        }
+        return values;
+    }
+
+    static int parse_png_strategy(const std::string& str) {
+        if (str == "default") return -1;
+        if (str == "zlib") return Z_DEFAULT_STRATEGY;
+        if (str == "filtered") return Z_FILTERED;
+        if (str == "huffman") return Z_HUFFMAN_ONLY;
+        if (str == "rle") return Z_RLE;
+        if (str == "fixed") return Z_FIXED;
+        throw std::runtime_error("unknown png strategy '" + str + "'.");
+    }
+
+    static int parse_png_filter(const std::string& str) {
+        if (str == "default") return -1;
+        if (str == "none") return PNG_FILTER_NONE;
+        if (str == "sub") return PNG_FILTER_SUB;
+        if (str == "up") return PNG_FILTER_UP;
+        if (str == "avg") return PNG_FILTER_AVG;
+        if (str == "paeth") return PNG_FILTER_PAETH;
+        if (str == "all") return PNG_ALL_FILTERS;
+        throw std::runtime_error("unknown png filter '" + str + "'.");
+    }
+
     static void print_help(const boost::program_options::options_description& visible) {
         std::cout << "wav2png version " << version::version << "\n"
                   << "written by Benjamin Schulz (beschulz[the a with the circle]betabugs.de)\n"
                   << "\n"
                   << "usage: wav2png [options] input_file_name\n"
+                  << "       wav2png [options] --batch manifest_file\n"
                   << "example: wav2png my_file.wav\n"
                   << "\n"
                   << visible << std::endl;
@@ -0,0 +1,338 @@
+#include "output_cache.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "render_stats.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Temporary files of crashed processes are removed after this long
+constexpr auto stale_temp_age = std::chrono::hours(1);
+
+const char temp_prefix[] = ".tmp.";
+
+// 64 bit hash of a byte stream in the manner of XXH64: four independent
+// lanes consume 32 bytes per step, which keeps up with reading from the page
+// cache
+class content_hasher {
+public:
+    void update(const unsigned char* data, std::size_t size) noexcept {
+        length_ += size;
+
+        if (buffered_ > 0) {
+            const std::size_t n = std::min(size, sizeof(buffer_) - buffered_);
+            std::memcpy(buffer_ + buffered_, data, n);
+            buffered_ += n;
+            data += n;
+            size -= n;
+            if (buffered_ < sizeof(buffer_)) {
+                return;
+            }
+            consume(buffer_);
+            buffered_ = 0;
+        }
+
+        for (; size >= sizeof(buffer_); data += sizeof(buffer_), size -= sizeof(buffer_)) {
+            consume(data);
+        }
+
+        std::memcpy(buffer_, data, size);
+        buffered_ = size;
+    }
+
+    std::uint64_t digest() const noexcept {
+        std::uint64_t h;
+        if (length_ >= sizeof(buffer_)) {
+            h = rotl(lanes_[0], 1) + rotl(lanes_[1], 7) + rotl(lanes_[2], 12) + rotl(lanes_[3], 18);
+            for (const std::uint64_t lane : lanes_) {
+                h = (h ^ round(0, lane)) * prime1 + prime4;
+            }
+        } else {
+            h = prime5;
+        }
+        h += length_;
+
+        std::size_t i = 0;
+        for (; i + 8 <= buffered_; i += 8) {
+            h = rotl(h ^ round(0, read64(buffer_ + i)), 27) * prime1 + prime4;
+        }
+        if (i + 4 <= buffered_) {
+            std::uint32_t word;
+            std::memcpy(&word, buffer_ + i, 4);
+            h = rotl(h ^ (word * prime1), 23) * prime2 + prime3;
+            i += 4;
+        }
+        for (; i < buffered_; ++i) {
+            h = rotl(h ^ (buffer_[i] * prime5), 11) * prime1;
+        }
+
+        h ^= h >> 33;
+        h *= prime2;
+        h ^= h >> 29;
+        h *= prime3;
+        h ^= h >> 32;
+        return h;
+    }
+
+private:
+    static constexpr std::uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    static constexpr std::uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr std::uint64_t prime3 = 0x165667B19E3779F9ULL;
+    static constexpr std::uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr std::uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+    static std::uint64_t rotl(std::uint64_t x, int r) noexcept {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static std::uint64_t round(std::uint64_t lane, std::uint64_t input) noexcept {
+        return rotl(lane + input * prime2, 31) * prime1;
+    }
+
+    static std::uint64_t read64(const unsigned char* p) noexcept {
+        std::uint64_t word;
+        std::memcpy(&word, p, 8);
+        return word;
+    }
+
+    void consume(const unsigned char* stripe) noexcept {
+        for (std::size_t lane = 0; lane < 4; ++lane) {
+            lanes_[lane] = round(lanes_[lane], read64(stripe + 8 * lane));
+        }
+    }
+
+    std::uint64_t lanes_[4] = { prime1 + prime2, prime2, 0, 0 - prime1 };
+    unsigned char buffer_[32];
+    std::size_t buffered_ = 0;
+    std::uint64_t length_ = 0;
+};
+
+std::string to_hex(std::uint64_t value) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(16, '0');
+    for (int i = 15; i >= 0; --i, value >>= 4) {
+        hex[static_cast<std::size_t>(i)] = digits[value & 0xf];
+    }
+    return hex;
+}
+
+std::string hash_string(const std::string& text) {
+    content_hasher hasher;
+    hasher.update(reinterpret_cast<const unsigned char*>(text.data()), text.size());
+    return to_hex(hasher.digest());
+}
+
+// Hash the content of a file, empty if it cannot be read. The file is mapped
+// rather than read, which saves copying it.
+std::string hash_file(const std::string& file_name) {
+    const int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return {};
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return {};
+    }
+    const auto size = static_cast<std::size_t>(st.st_size);
+
+    content_hasher hasher;
+    if (size > 0) {
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            return {};
+        }
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        hasher.update(static_cast<const unsigned char*>(mapping), size);
+        munmap(mapping, size);
+    }
+    close(fd);
+
+    return to_hex(hasher.digest());
+}
+
+// Name of a temporary file unique to the calling thread
+std::string temp_file_name(const fs::path& directory, const std::string& prefix) {
+    return (directory / (prefix + std::to_string(getpid()) + "."
+        + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())))).string();
+}
+
+// Write text to file_name through a temporary file, so concurrent readers see
+// all of it or nothing
+void write_atomically(const fs::path& file_name, const std::string& text) {
+    const std::string temp = temp_file_name(file_name.parent_path(), temp_prefix);
+    {
+        std::ofstream out(temp, std::ios::trunc);
+        out << text;
+        if (!out.good()) {
+            std::remove(temp.c_str());
+            return;
+        }
+    }
+    std::error_code error;
+    fs::rename(temp, file_name, error);
+    if (error) {
+        fs::remove(temp, error);
+    }
+}
+
+// Mark a file as recently used
+void touch(const std::string& file_name) noexcept {
+    utimensat(AT_FDCWD, file_name.c_str(), nullptr, 0);
+}
+
+} // anonymous namespace
+
+OutputCache::OutputCache(std::string directory, std::uint64_t size_limit_bytes)
+    : directory_(std::move(directory)), size_limit_bytes_(size_limit_bytes) {
+    std::error_code error;
+    fs::create_directories(fs::path(directory_) / "inputs", error);
+    if (error) {
+        throw std::runtime_error("failed to create output cache '" + directory_ + "': " + error.message());
+    }
+}
+
+std::string OutputCache::key(const std::string& input_file_name, const std::string& render_key) const {
+    const std::string content = content_hash(input_file_name);
+    return content.empty() ? std::string() : content + "-" + hash_string(render_key);
+}
+
+std::string OutputCache::content_hash(const std::string& input_file_name) const {
+    struct stat st;
+    if (stat(input_file_name.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return {};
+    }
+
+    // The hash remembered for this version of the input, like the peak cache
+    // is tied to its size and modification time
+    const std::string identity = std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino)
+        + ":" + std::to_string(st.st_size) + ":" + std::to_string(st.st_mtim.tv_sec)
+        + "." + std::to_string(st.st_mtim.tv_nsec);
+    const fs::path memo = fs::path(directory_) / "inputs" / hash_string(identity);
+
+    std::string hash;
+    if (std::ifstream(memo) >> hash && hash.size() == 16) {
+        touch(memo.string());
+        return hash;
+    }
+
+    hash = hash_file(input_file_name);
+    if (!hash.empty()) {
+        write_atomically(memo, hash);
+    }
+    return hash;
+}
+
+bool OutputCache::fetch(const std::string& key, const std::string& output_file_name) const {
+    const std::string entry = (fs::path(directory_) / key).string();
+    const fs::path output(output_file_name);
+    const std::string temp = temp_file_name(
+        output.has_parent_path() ? output.parent_path() : fs::path("."), "." + output.filename().string() + temp_prefix);
+
+    // A missing entry, or one evicted by another process meanwhile, is a miss
+    std::error_code error;
+    fs::copy_file(entry, temp, fs::copy_options::overwrite_existing, error);
+    if (error) {
+        fs::remove(temp, error);
+        count_output_cache_lookup(false);
+        return false;
+    }
+
+    fs::rename(temp, output, error);
+    if (error) {
+        fs::remove(temp);
+        throw std::runtime_error("failed to write '" + output_file_name + "': " + error.message());
+    }
+
+    touch(entry);
+    count_output_cache_lookup(true);
+    return true;
+}
+
+void OutputCache::store(const std::string& key, const std::string& output_file_name) const {
+    const std::string temp = temp_file_name(directory_, temp_prefix);
+
+    std::error_code error;
+    fs::copy_file(output_file_name, temp, fs::copy_options::overwrite_existing, error);
+    if (!error) {
+        fs::rename(temp, fs::path(directory_) / key, error);
+    }
+    if (error) {
+        fs::remove(temp, error);
+        return;
+    }
+
+    evict();
+}
+
+void OutputCache::evict() const {
+    struct cache_file {
+        fs::path path;
+        std::uint64_t size;
+        fs::file_time_type used;
+    };
+
+    std::vector<cache_file> files;
+    std::uint64_t total = 0;
+    const auto now = fs::file_time_type::clock::now();
+
+    std::error_code error;
+    for (fs::recursive_directory_iterator it(directory_, error), end; !error && it != end; it.increment(error)) {
+        std::error_code file_error;
+        if (!it->is_regular_file(file_error)) {
+            continue;
+        }
+
+        const auto used = it->last_write_time(file_error);
+        const auto size = it->file_size(file_error);
+        if (file_error) {
+            continue;
+        }
+
+        if (it->path().filename().string().rfind(temp_prefix, 0) == 0) {
+            if (now - used > stale_temp_age) {
+                fs::remove(it->path(), file_error);
+            }
+            continue;
+        }
+
+        files.push_back({ it->path(), size, used });
+        total += size;
+    }
+
+    if (total <= size_limit_bytes_) {
+        return;
+    }
+
+    std::sort(files.begin(), files.end(), [](const cache_file& a, const cache_file& b) {
+        return a.used < b.used;
+    });
+
+    for (const auto& file : files) {
+        if (total <= size_limit_bytes_) {
+            break;
+        }
+        std::error_code file_error;
+        if (fs::remove(file.path, file_error)) {
+            total -= file.size;
+        }
+    }
+}
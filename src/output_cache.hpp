@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Content-addressed cache of rendered output files in a directory, which
+// concurrent processes can share.
+//
+// Outputs are keyed by a hash of the content of the input and the render key
+// of the options (see Options::render_key), so renaming or copying an input
+// still hits the cache. Hashing an input reads all of it, so its hash is
+// remembered for its inode, size and modification time. Entries are written
+// to temporary files and renamed into place, and removed least recently used
+// first once the directory exceeds its size limit.
+class OutputCache {
+public:
+    OutputCache(std::string directory, std::uint64_t size_limit_bytes);
+
+    // Key of rendering input_file_name with the given render key, or an empty
+    // string if the input is not a regular file and cannot be cached
+    std::string key(const std::string& input_file_name, const std::string& render_key) const;
+
+    // Copy the output stored for key to output_file_name, replacing it
+    // atomically. Returns false if there is none.
+    bool fetch(const std::string& key, const std::string& output_file_name) const;
+
+    // Store output_file_name as the output for key, then remove the least
+    // recently used entries beyond the size limit. Failing to store is not an
+    // error, the output has been rendered all the same.
+    void store(const std::string& key, const std::string& output_file_name) const;
+
+private:
+    std::string content_hash(const std::string& input_file_name) const;
+    void evict() const;
+
+    std::string directory_;
+    std::uint64_t size_limit_bytes_;
+};
@@ -0,0 +1,337 @@
+#include "peak_cache.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "reduce_kernels.hpp"
+#include "render_stats.hpp"
+
+// On-disk header, followed by levels uint64 bucket counts and the bucket
+// arrays of all levels, finest first. Values are stored in host byte order.
+struct peak_cache_header {
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t input_size;
+    std::int64_t input_mtime_sec;
+    std::int64_t input_mtime_nsec;
+    std::int64_t frames;
+    std::uint32_t channels;
+    std::uint32_t samplerate;
+    std::uint32_t bucket_frames;
+    std::uint32_t levels;
+    std::uint32_t reduction;
+    std::uint32_t wide_samples;  // 1 if the input has samples wider than 16 bits
+};
+
+namespace {
+
+constexpr char cache_magic[4] = { 'W', '2', 'P', 'C' };
+constexpr std::uint32_t cache_version = 2;
+
+// Identifies how buckets were reduced from the audio: all channels mixed,
+// 16-bit samples. Caches built with a different reduction are rebuilt.
+constexpr std::uint32_t reduction_mixed_s16 = 1;
+
+static_assert(sizeof(peak_bucket) == 6, "peak_bucket must be packed");
+
+bool stat_input(const std::string& input_file_name, struct stat& st) {
+    return ::stat(input_file_name.c_str(), &st) == 0;
+}
+
+// Merge two neighbouring buckets. The exact median of the merged range is not
+// known, the mean of both medians is used instead.
+peak_bucket merge(const peak_bucket& a, const peak_bucket& b) noexcept {
+    return peak_bucket{
+        std::min(a.min_val, b.min_val),
+        std::max(a.max_val, b.max_val),
+        static_cast<short>((a.median + b.median) / 2)
+    };
+}
+
+} // anonymous namespace
+
+PeakCache::~PeakCache() {
+    if (mapping_) {
+        munmap(mapping_, mapping_size_);
+    }
+}
+
+std::string PeakCache::default_path(const std::string& input_file_name) {
+    return input_file_name + ".w2p";
+}
+
+std::unique_ptr<PeakCache> PeakCache::map_file(const std::string& cache_file_name) {
+    const int fd = ::open(cache_file_name.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(peak_cache_header)) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (mapping == MAP_FAILED) {
+        return nullptr;
+    }
+
+    std::unique_ptr<PeakCache> cache(new PeakCache());
+    cache->mapping_ = mapping;
+    cache->mapping_size_ = st.st_size;
+
+    const auto* bytes = static_cast<const char*>(mapping);
+    const auto* header = reinterpret_cast<const peak_cache_header*>(bytes);
+
+    if (std::memcmp(header->magic, cache_magic, sizeof(cache_magic)) != 0
+        || header->version != cache_version
+        || header->reduction != reduction_mixed_s16
+        || header->bucket_frames != base_bucket_frames
+        || header->levels == 0
+        || header->levels > std::size(cache->level_data_)) {
+        return nullptr;
+    }
+
+    // Locate and bounds check the levels
+    std::size_t offset = sizeof(peak_cache_header) + header->levels * sizeof(std::uint64_t);
+    if (offset > cache->mapping_size_) {
+        return nullptr;
+    }
+
+    const auto* level_sizes = reinterpret_cast<const std::uint64_t*>(bytes + sizeof(peak_cache_header));
+    for (std::size_t level = 0; level < header->levels; ++level) {
+        const std::uint64_t size = level_sizes[level] * sizeof(peak_bucket);
+        if (level_sizes[level] == 0 || size > cache->mapping_size_ - offset) {
+            return nullptr;
+        }
+        cache->level_data_[level] = reinterpret_cast<const peak_bucket*>(bytes + offset);
+        offset += size;
+    }
+
+    cache->header_ = header;
+    cache->level_sizes_ = level_sizes;
+    cache->levels_ = header->levels;
+
+    // Hint that the lookups will be mostly sequential
+    madvise(mapping, cache->mapping_size_, MADV_SEQUENTIAL);
+
+    return cache;
+}
+
+std::unique_ptr<PeakCache> PeakCache::load(
+    const std::string& cache_file_name,
+    const std::string& input_file_name
+) {
+    struct stat st;
+    if (!stat_input(input_file_name, st)) {
+        return nullptr;
+    }
+
+    auto cache = map_file(cache_file_name);
+    if (!cache) {
+        return nullptr;
+    }
+
+    const auto& header = *cache->header_;
+    if (header.input_size != static_cast<std::uint64_t>(st.st_size)
+        || header.input_mtime_sec != st.st_mtim.tv_sec
+        || header.input_mtime_nsec != st.st_mtim.tv_nsec) {
+        return nullptr;
+    }
+
+    return cache;
+}
+
+std::unique_ptr<PeakCache> PeakCache::build(
+    SndfileHandle& wav,
+    const std::string& input_file_name,
+    const std::string& cache_file_name,
+    const progress_callback_t& progress_callback
+) {
+    struct stat st;
+    if (!stat_input(input_file_name, st)) {
+        throw std::runtime_error("failed to stat '" + input_file_name + "': " + strerror(errno));
+    }
+
+    // Reduce the audio into the finest level
+    const int channels = wav.channels();
+    const sf_count_t frames = wav.frames();
+    const std::size_t expected_buckets = static_cast<std::size_t>(
+        std::max<sf_count_t>(1, (frames + base_bucket_frames - 1) / base_bucket_frames));
+    const std::size_t progress_divisor = std::max<std::size_t>(1, expected_buckets / 100);
+
+    std::vector<std::vector<peak_bucket>> levels(1);
+    levels[0].reserve(expected_buckets);
+
+    std::vector<short> block(static_cast<std::size_t>(channels) * base_bucket_frames);
+
+    // Count frames while reading, as FIFOs may report a bogus length
+    sf_count_t frames_read = 0;
+
+    phase_timer timer(render_phase::reduce);
+
+    for (;;) {
+        sf_count_t frames_in_block = 0;
+        {
+            phase_timer read_timer(render_phase::decode);
+            frames_in_block = wav.readf(block.data(), base_bucket_frames);
+        }
+        const sf_count_t n = frames_in_block * channels;
+        if (n <= 0) {
+            break;
+        }
+        frames_read += frames_in_block;
+
+        peak_bucket bucket{ 0, 0, 0 };
+        minmax(block.data(), static_cast<std::size_t>(n), bucket.min_val, bucket.max_val);
+
+        std::nth_element(block.begin(), block.begin() + n / 2, block.begin() + n);
+        bucket.median = block[n / 2];
+
+        levels[0].push_back(bucket);
+
+        if (levels[0].size() % progress_divisor == 0 && progress_callback
+            && !progress_callback(static_cast<int>(
+                std::min<std::size_t>(99, 100 * levels[0].size() / expected_buckets)))) {
+            return nullptr;
+        }
+    }
+
+    count_reduced_frames(static_cast<std::uint64_t>(frames_read), channels);
+
+    if (levels[0].empty()) {
+        levels[0].push_back(peak_bucket{ 0, 0, 0 });
+    }
+
+    // Derive the coarser levels by merging pairs
+    while (levels.back().size() > 1) {
+        const auto& finer = levels.back();
+        std::vector<peak_bucket> coarser((finer.size() + 1) / 2);
+
+        for (std::size_t i = 0; i < coarser.size(); ++i) {
+            const std::size_t j = 2 * i;
+            coarser[i] = (j + 1 < finer.size()) ? merge(finer[j], finer[j + 1]) : finer[j];
+        }
+        levels.push_back(std::move(coarser));
+    }
+
+    // Write to a temporary file first, so concurrent readers never see a
+    // partially written cache
+    peak_cache_header header{};
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = cache_version;
+    header.input_size = static_cast<std::uint64_t>(st.st_size);
+    header.input_mtime_sec = st.st_mtim.tv_sec;
+    header.input_mtime_nsec = st.st_mtim.tv_nsec;
+    header.frames = frames_read;
+    header.channels = static_cast<std::uint32_t>(channels);
+    header.samplerate = static_cast<std::uint32_t>(wav.samplerate());
+    header.bucket_frames = base_bucket_frames;
+    header.levels = static_cast<std::uint32_t>(levels.size());
+    header.reduction = reduction_mixed_s16;
+    header.wide_samples = has_wide_samples(wav) ? 1 : 0;
+
+    const std::string temp_file_name = cache_file_name + ".tmp." + std::to_string(getpid())
+        + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream out(temp_file_name, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const auto& level : levels) {
+            const std::uint64_t size = level.size();
+            out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        }
+        for (const auto& level : levels) {
+            out.write(reinterpret_cast<const char*>(level.data()), level.size() * sizeof(peak_bucket));
+        }
+
+        if (!out.good()) {
+            std::remove(temp_file_name.c_str());
+            throw std::runtime_error("failed to write peak cache '" + temp_file_name + "'");
+        }
+    }
+
+    if (std::rename(temp_file_name.c_str(), cache_file_name.c_str()) != 0) {
+        std::remove(temp_file_name.c_str());
+        throw std::runtime_error("failed to write peak cache '" + cache_file_name + "': " + strerror(errno));
+    }
+
+    if (progress_callback && !progress_callback(100)) {
+        return nullptr;
+    }
+
+    auto cache = map_file(cache_file_name);
+    if (!cache) {
+        throw std::runtime_error("failed to map peak cache '" + cache_file_name + "'");
+    }
+    return cache;
+}
+
+sf_count_t PeakCache::frames() const noexcept {
+    return header_->frames;
+}
+
+int PeakCache::channels() const noexcept {
+    return static_cast<int>(header_->channels);
+}
+
+int PeakCache::samplerate() const noexcept {
+    return static_cast<int>(header_->samplerate);
+}
+
+bool PeakCache::wide_samples() const noexcept {
+    return header_->wide_samples != 0;
+}
+
+bool PeakCache::can_render(std::size_t width) const noexcept {
+    return can_render(width, frames());
+}
+
+bool PeakCache::can_render(std::size_t width, sf_count_t frame_count) const noexcept {
+    return width > 0 && frame_count / static_cast<sf_count_t>(width) >= base_bucket_frames;
+}
+
+peak_bucket PeakCache::query(sf_count_t first_frame, sf_count_t frame_count, std::vector<short>& medians) const {
+    // Pick the coarsest level whose buckets fit into the range
+    std::size_t level = 0;
+    while (level + 1 < levels_
+           && (static_cast<sf_count_t>(base_bucket_frames) << (level + 1)) <= frame_count) {
+        ++level;
+    }
+
+    const sf_count_t level_bucket_frames = static_cast<sf_count_t>(base_bucket_frames) << level;
+    const std::size_t size = static_cast<std::size_t>(level_sizes_[level]);
+    const std::size_t begin = std::min<std::size_t>(size - 1, first_frame / level_bucket_frames);
+    const std::size_t end = std::clamp<std::size_t>(
+        (first_frame + frame_count + level_bucket_frames - 1) / level_bucket_frames, begin + 1, size);
+
+    const peak_bucket* buckets = level_data_[level];
+
+    peak_bucket result{ 0, 0, 0 };
+    medians.clear();
+
+    for (std::size_t i = begin; i < end; ++i) {
+        result.min_val = std::min(result.min_val, buckets[i].min_val);
+        result.max_val = std::max(result.max_val, buckets[i].max_val);
+        medians.push_back(buckets[i].median);
+    }
+
+    // Median of the bucket medians
+    std::nth_element(medians.begin(), medians.begin() + medians.size() / 2, medians.end());
+    result.median = medians[medians.size() / 2];
+
+    return result;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <sndfile.hh>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "wav2png.hpp"
+
+// Statistics of one bucket of frames, all channels mixed
+struct peak_bucket {
+    short min_val;
+    short max_val;
+    short median;
+};
+
+// Multi-resolution peak pyramid stored in a binary sidecar file (.w2p).
+//
+// Level 0 holds one bucket per bucket_frames() frames, every following level
+// merges pairs of buckets of the level below. The file is tied to the size and
+// modification time of the input it was built from and is memory-mapped on
+// load, so rendering from it does not touch the audio at all.
+class PeakCache {
+public:
+    // Frames per bucket on level 0
+    static constexpr std::uint32_t base_bucket_frames = 256;
+
+    ~PeakCache();
+
+    PeakCache(const PeakCache&) = delete;
+    PeakCache& operator=(const PeakCache&) = delete;
+
+    // Default sidecar path for an input file
+    static std::string default_path(const std::string& input_file_name);
+
+    // Map the cache at cache_file_name. Returns nullptr if it does not exist,
+    // is malformed, or was built from a different version of input_file_name.
+    static std::unique_ptr<PeakCache> load(
+        const std::string& cache_file_name,
+        const std::string& input_file_name
+    );
+
+    // Build the pyramid in a single pass over wav, write it to cache_file_name
+    // and return the mapped result. Returns nullptr if cancelled.
+    static std::unique_ptr<PeakCache> build(
+        SndfileHandle& wav,
+        const std::string& input_file_name,
+        const std::string& cache_file_name,
+        const progress_callback_t& progress_callback
+    );
+
+    sf_count_t frames() const noexcept;
+    int channels() const noexcept;
+    int samplerate() const noexcept;
+
+    // True if the input has samples wider than 16 bits. Buckets always hold
+    // 16 bit values, which cannot resolve quiet passages of such inputs in
+    // dB scale.
+    bool wide_samples() const noexcept;
+
+    std::uint32_t bucket_frames() const noexcept { return base_bucket_frames; }
+    std::size_t levels() const noexcept { return levels_; }
+
+    // True if a render of the given width has at least one bucket per column,
+    // rendering all frames or frame_count of them
+    bool can_render(std::size_t width) const noexcept;
+    bool can_render(std::size_t width, sf_count_t frame_count) const noexcept;
+
+    // Statistics of the frames [first_frame, first_frame + frame_count),
+    // taken from the coarsest level whose buckets are no larger than
+    // frame_count. Buckets partially covered by the range are included. The
+    // median is the median of the bucket medians, gathered in medians, which
+    // callers keep between queries.
+    peak_bucket query(sf_count_t first_frame, sf_count_t frame_count, std::vector<short>& medians) const;
+
+private:
+    PeakCache() = default;
+
+    static std::unique_ptr<PeakCache> map_file(const std::string& cache_file_name);
+
+    void* mapping_ = nullptr;
+    std::size_t mapping_size_ = 0;
+    std::size_t levels_ = 0;
+
+    const struct peak_cache_header* header_ = nullptr;
+    const std::uint64_t* level_sizes_ = nullptr;
+    const peak_bucket* level_data_[64] = {};
+};
@@ -0,0 +1,177 @@
+#include "peak_data.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include "render_stats.hpp"
+
+namespace {
+
+constexpr char data_magic[4] = { 'W', '2', 'P', 'D' };
+constexpr std::uint32_t data_version = 1;
+
+// Amplitude fields in file order, with the statistic that provides them
+struct amplitude_field {
+    const char* name;
+    unsigned statistic;
+    float column_statistics::*value;
+};
+
+constexpr amplitude_field amplitude_fields[] = {
+    { "min", stat_peak, &column_statistics::min_val },
+    { "max", stat_peak, &column_statistics::max_val },
+    { "mean", stat_mean, &column_statistics::mean },
+    { "rms", stat_rms, &column_statistics::rms },
+    { "median", stat_median, &column_statistics::median }
+};
+
+// Scale an amplitude in [-1, 1] to a signed integer of the given bits
+long quantize(float value, int bits) noexcept {
+    const long full_scale = 1L << (bits - 1);
+    const long quantized = std::lround(static_cast<double>(value) * full_scale);
+    return std::clamp(quantized, -full_scale, full_scale - 1);
+}
+
+std::uint32_t saturate_u32(std::uint64_t value) noexcept {
+    return static_cast<std::uint32_t>(std::min<std::uint64_t>(value, UINT32_MAX));
+}
+
+void append_le(std::vector<char>& out, std::uint64_t value, std::size_t bytes) {
+    for (std::size_t i = 0; i < bytes; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+std::vector<char> encode_binary(
+    const waveform_data& data,
+    int samplerate,
+    const peak_data_settings& settings
+) {
+    const std::size_t columns = data.columns.size();
+    const std::size_t value_bytes = static_cast<std::size_t>(settings.bits / 8);
+
+    std::vector<char> out;
+    out.reserve(40 + columns * (std::size(amplitude_fields) * value_bytes + 4) + 4);
+
+    out.insert(out.end(), std::begin(data_magic), std::end(data_magic));
+    append_le(out, data_version, 4);
+    append_le(out, static_cast<std::uint32_t>(settings.bits), 4);
+    append_le(out, settings.values, 4);
+    append_le(out, static_cast<std::uint32_t>(samplerate), 4);
+    append_le(out, static_cast<std::uint32_t>(columns), 4);
+    append_le(out, static_cast<std::uint64_t>(data.frames), 8);
+    append_le(out, static_cast<std::uint64_t>(data.frames_per_column), 8);
+
+    for (const auto& field : amplitude_fields) {
+        if (settings.values & field.statistic) {
+            for (const auto& column : data.columns) {
+                append_le(out, static_cast<std::uint64_t>(quantize(column.*field.value, settings.bits)), value_bytes);
+            }
+        }
+    }
+
+    if (settings.values & stat_clipped) {
+        out.resize((out.size() + 3) & ~std::size_t(3), 0);
+        for (const auto& column : data.columns) {
+            append_le(out, saturate_u32(column.clipped), 4);
+        }
+    }
+
+    return out;
+}
+
+// Append value as decimal text
+template <typename integer_type>
+void append_number(std::string& out, integer_type value) {
+    char buffer[24];
+    const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, result.ptr);
+}
+
+template <typename value_function>
+void append_array(std::string& out, const char* name, const waveform_data& data, value_function value) {
+    out += ",\n  \"";
+    out += name;
+    out += "\": [";
+    for (std::size_t x = 0; x < data.columns.size(); ++x) {
+        if (x > 0) {
+            out += ',';
+        }
+        append_number(out, value(data.columns[x]));
+    }
+    out += ']';
+}
+
+std::string encode_json(
+    const waveform_data& data,
+    int samplerate,
+    const peak_data_settings& settings
+) {
+    std::string out = "{\n  \"version\": ";
+    append_number(out, data_version);
+    out += ",\n  \"bits\": ";
+    append_number(out, settings.bits);
+    out += ",\n  \"samplerate\": ";
+    append_number(out, samplerate);
+    out += ",\n  \"columns\": ";
+    append_number(out, data.columns.size());
+    out += ",\n  \"frames\": ";
+    append_number(out, static_cast<long long>(data.frames));
+    out += ",\n  \"frames_per_column\": ";
+    append_number(out, static_cast<long long>(data.frames_per_column));
+
+    for (const auto& field : amplitude_fields) {
+        if (settings.values & field.statistic) {
+            append_array(out, field.name, data, [&](const column_statistics& column) {
+                return quantize(column.*field.value, settings.bits);
+            });
+        }
+    }
+
+    if (settings.values & stat_clipped) {
+        append_array(out, "clipped", data, [](const column_statistics& column) {
+            return saturate_u32(column.clipped);
+        });
+    }
+
+    out += "\n}\n";
+    return out;
+}
+
+} // anonymous namespace
+
+void write_peak_data(
+    const std::string& file_name,
+    const waveform_data& data,
+    int samplerate,
+    const peak_data_settings& settings
+) {
+    if (settings.bits != 8 && settings.bits != 16) {
+        throw std::runtime_error("peak data must have 8 or 16 bits per value");
+    }
+    if (settings.values != 0 && data.columns.empty()) {
+        throw std::runtime_error("no column statistics to write to '" + file_name + "'");
+    }
+
+    phase_timer timer(render_phase::encode);
+    std::ofstream out(file_name, std::ios::binary | std::ios::trunc);
+
+    if (settings.format == peak_data_format::binary) {
+        const std::vector<char> bytes = encode_binary(data, samplerate, settings);
+        out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    } else {
+        const std::string text = encode_json(data, samplerate, settings);
+        out.write(text.data(), static_cast<std::streamsize>(text.size()));
+    }
+
+    out.close();
+    if (!out.good()) {
+        std::remove(file_name.c_str());
+        throw std::runtime_error("failed to write '" + file_name + "'");
+    }
+}
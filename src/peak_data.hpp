@@ -0,0 +1,52 @@
+#pragma once
+
+#include <sndfile.hh>
+#include <cstdint>
+#include <string>
+
+#include "wav2png.hpp"
+
+// Formats of per-column data written instead of an image
+enum class peak_data_format {
+    binary,
+    json
+};
+
+// Settings of a peak data file
+struct peak_data_settings {
+    peak_data_format format = peak_data_format::binary;
+
+    // Bits per amplitude value, 8 or 16
+    int bits = 16;
+
+    // Values written per column, a mask of column_statistic values. They must
+    // have been collected by the reduction, see waveform_params::statistics.
+    unsigned values = stat_peak | stat_median;
+};
+
+// Write the statistics of the reduced columns of data to file_name, without
+// rasterizing them.
+//
+// Amplitudes are scaled to signed integers of settings.bits bits, full scale
+// being 2^(bits - 1); clip counts are unsigned 32 bit integers. The binary
+// format starts with a 40 byte header of little-endian fields:
+//
+//     char     magic[4]     "W2PD"
+//     uint32   version      1
+//     uint32   bits         8 or 16
+//     uint32   values       mask of column_statistic values
+//     uint32   samplerate
+//     uint32   columns
+//     uint64   frames
+//     uint64   frames_per_column
+//
+// followed by one array of columns values for each value present, in the
+// order min, max, mean, rms, median, clipped. The clip count array is aligned
+// to 4 bytes. The JSON format holds the same fields, and the arrays by name.
+// Throws std::runtime_error on failure.
+void write_peak_data(
+    const std::string& file_name,
+    const waveform_data& data,
+    int samplerate,
+    const peak_data_settings& settings
+);
@@ -0,0 +1,451 @@
+#include "png_writer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csetjmp>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "render_stats.hpp"
+
+namespace {
+
+bool same_color(const png::rgba_pixel& a, const png::rgba_pixel& b) noexcept {
+    return a.red == b.red && a.green == b.green && a.blue == b.blue && a.alpha == b.alpha;
+}
+
+} // anonymous namespace
+
+png_pixel_format choose_pixel_format(const std::vector<png::rgba_pixel>& colors, bool compact) {
+    png_pixel_format format;
+    if (!compact) {
+        return format;
+    }
+
+    for (const auto& color : colors) {
+        const bool known = std::any_of(format.palette.begin(), format.palette.end(),
+            [&](const png::rgba_pixel& entry) { return same_color(entry, color); });
+        if (!known) {
+            format.palette.push_back(color);
+        }
+    }
+
+    // With at most 256 colors, a palette is never larger than any of the
+    // other formats
+    if (format.palette.size() > 256) {
+        format.palette.clear();
+        return format;
+    }
+
+    format.color_type = PNG_COLOR_TYPE_PALETTE;
+    format.bit_depth = 1;
+    while ((std::size_t(1) << format.bit_depth) < format.palette.size()) {
+        format.bit_depth *= 2;
+    }
+    return format;
+}
+
+PngStreamWriter::PngStreamWriter(
+    const std::string& file_name,
+    std::uint32_t width,
+    std::uint32_t height,
+    const png_pixel_format& format,
+    const png_settings& settings
+)
+    : file_name_(file_name) {
+    try {
+        open(width, height, format, settings);
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+PngStreamWriter::PngStreamWriter(
+    std::vector<unsigned char>& buffer,
+    std::uint32_t width,
+    std::uint32_t height,
+    const png_pixel_format& format,
+    const png_settings& settings
+)
+    : file_name_("PNG in memory"), buffer_(&buffer) {
+    buffer.clear();
+    try {
+        open(width, height, format, settings);
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+PngStreamWriter::~PngStreamWriter() {
+    close();
+}
+
+void PngStreamWriter::open(
+    std::uint32_t width,
+    std::uint32_t height,
+    const png_pixel_format& format,
+    const png_settings& settings
+) {
+    if (!buffer_) {
+        file_ = std::fopen(file_name_.c_str(), "wb");
+        if (!file_) {
+            throw std::runtime_error("failed to open '" + file_name_ + "' for writing: " + strerror(errno));
+        }
+        created_ = true;
+    }
+
+    png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, this, on_error, on_warning);
+    info_ = png_ ? png_create_info_struct(png_) : nullptr;
+    if (!info_) {
+        throw std::runtime_error("failed to initialize libpng");
+    }
+
+    // The palette is built before libpng may jump, which would skip the
+    // destructors of anything created after setjmp
+    png_color palette[PNG_MAX_PALETTE_LENGTH];
+    png_byte alpha[PNG_MAX_PALETTE_LENGTH];
+    int palette_size = 0;
+    bool opaque = true;
+
+    if (format.color_type == PNG_COLOR_TYPE_PALETTE) {
+        if (format.palette.size() > PNG_MAX_PALETTE_LENGTH) {
+            throw std::invalid_argument("a png palette holds at most 256 colors");
+        }
+        for (const auto& color : format.palette) {
+            palette[palette_size] = png_color{ color.red, color.green, color.blue };
+            alpha[palette_size] = color.alpha;
+            opaque = opaque && color.alpha == 255;
+            ++palette_size;
+        }
+    }
+
+    // libpng reports errors by jumping back here, from where they are thrown
+    // as exceptions
+    if (setjmp(png_jmpbuf(png_))) {
+        raise();
+    }
+
+    if (buffer_) {
+        png_set_write_fn(png_, buffer_, on_write, on_flush);
+    } else {
+        png_init_io(png_, file_);
+    }
+    png_set_IHDR(
+        png_, info_, width, height, format.bit_depth, format.color_type,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT
+    );
+
+    if (format.color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_set_PLTE(png_, info_, palette, palette_size);
+        if (!opaque) {
+            png_set_tRNS(png_, info_, alpha, palette_size, nullptr);
+        }
+    }
+
+    png_set_compression_level(png_, settings.level);
+    if (settings.strategy >= 0) {
+        png_set_compression_strategy(png_, settings.strategy);
+    }
+    if (settings.filters >= 0) {
+        png_set_filter(png_, PNG_FILTER_TYPE_BASE, settings.filters);
+    } else if (format.color_type == PNG_COLOR_TYPE_PALETTE) {
+        // libpng does not filter palette images by default, but waveform rows
+        // mostly repeat the row above, which the up filter reduces to zeros
+        png_set_filter(png_, PNG_FILTER_TYPE_BASE, PNG_FILTER_UP);
+    }
+
+    png_write_info(png_, info_);
+
+    // Rows hold one byte per palette index
+    if (format.bit_depth < 8) {
+        png_set_packing(png_);
+    }
+}
+
+void PngStreamWriter::close() noexcept {
+    if (png_) {
+        png_destroy_write_struct(&png_, info_ ? &info_ : nullptr);
+    }
+    if (file_) {
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+    if (created_ && !finished_) {
+        std::remove(file_name_.c_str());
+    }
+}
+
+void PngStreamWriter::write_row(const void* row) {
+    if (setjmp(png_jmpbuf(png_))) {
+        raise();
+    }
+    png_write_row(png_, static_cast<png_const_bytep>(row));
+}
+
+void PngStreamWriter::finish() {
+    if (setjmp(png_jmpbuf(png_))) {
+        raise();
+    }
+    png_write_end(png_, info_);
+
+    if (buffer_) {
+        finished_ = true;
+        return;
+    }
+
+    const bool closed = std::fclose(file_) == 0;
+    file_ = nullptr;
+    if (!closed) {
+        throw std::runtime_error("failed to write '" + file_name_ + "': " + strerror(errno));
+    }
+
+    finished_ = true;
+}
+
+void PngStreamWriter::on_error(png_structp png, png_const_charp message) {
+    auto* writer = static_cast<PngStreamWriter*>(png_get_error_ptr(png));
+    writer->error_ = message;
+    longjmp(png_jmpbuf(png), 1);
+}
+
+void PngStreamWriter::on_write(png_structp png, png_bytep data, png_size_t size) {
+    auto* buffer = static_cast<std::vector<unsigned char>*>(png_get_io_ptr(png));
+    buffer->insert(buffer->end(), data, data + size);
+}
+
+void PngStreamWriter::on_flush(png_structp) {
+}
+
+void PngStreamWriter::on_warning(png_structp, png_const_charp) {
+}
+
+void PngStreamWriter::raise() {
+    throw std::runtime_error("failed to write '" + file_name_ + "': " + error_);
+}
+
+namespace {
+
+// Two strip buffers, handed back and forth between the rasterizing thread
+// and the compressing one
+template <typename pixel_type>
+class strip_buffers {
+public:
+    strip_buffers(std::size_t width, std::uint32_t strip_rows) {
+        for (auto& strip : strips_) {
+            strip.pixels.resize(width * strip_rows);
+        }
+    }
+
+    // Wait until strip i has been written and may be filled again. Returns
+    // false if the writer gave up.
+    bool acquire_empty(std::size_t i) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [&] { return !strips_[i].full || aborted_; });
+        return !aborted_;
+    }
+
+    void release_full(std::size_t i, std::uint32_t rows) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        strips_[i].rows = rows;
+        strips_[i].full = true;
+        changed_.notify_all();
+    }
+
+    // Wait until strip i has been filled. Returns its number of rows.
+    std::uint32_t acquire_full(std::size_t i) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [&] { return strips_[i].full; });
+        return strips_[i].rows;
+    }
+
+    void release_empty(std::size_t i) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        strips_[i].full = false;
+        changed_.notify_all();
+    }
+
+    void abort() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        aborted_ = true;
+        changed_.notify_all();
+    }
+
+    pixel_type* pixels(std::size_t i) { return strips_[i].pixels.data(); }
+
+private:
+    struct strip {
+        std::vector<pixel_type> pixels;
+        std::uint32_t rows = 0;
+        bool full = false;
+    };
+
+    strip strips_[2];
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    bool aborted_ = false;
+};
+
+// Layer with its color as a pixel of the output format
+template <typename pixel_type>
+struct pixel_layer {
+    const std::vector<column_span>* spans;
+    pixel_type color;
+};
+
+// Rasterize layers with pixels of the given type and compress them through
+// writer, one strip at a time
+template <typename pixel_type>
+void stream_strips(
+    PngStreamWriter& writer,
+    const std::vector<pixel_layer<pixel_type>>& layers,
+    std::uint32_t height,
+    const pixel_type& bg_color,
+    std::uint32_t strip_rows
+) {
+    const std::vector<column_span>& spans = *layers.front().spans;
+    const std::size_t width = spans.size();
+    strip_buffers<pixel_type> buffers(width, strip_rows);
+
+    std::thread rasterizer([&]() {
+        std::size_t i = 0;
+        for (std::uint32_t y_begin = 0; y_begin < height; y_begin += strip_rows, i ^= 1) {
+            if (!buffers.acquire_empty(i)) {
+                return;
+            }
+
+            phase_timer timer(render_phase::rasterize);
+            const std::uint32_t rows = std::min(strip_rows, height - y_begin);
+            pixel_type* pixels = buffers.pixels(i);
+            for (std::uint32_t row = 0; row < rows; ++row) {
+                pixel_type* pixel_row = pixels + row * width;
+                rasterize_row(spans, y_begin + row, bg_color, layers.front().color, pixel_row);
+                for (std::size_t layer = 1; layer < layers.size(); ++layer) {
+                    paint_row(*layers[layer].spans, y_begin + row, layers[layer].color, pixel_row);
+                }
+            }
+
+            buffers.release_full(i, rows);
+        }
+    });
+
+    try {
+        std::size_t i = 0;
+        for (std::uint32_t y_begin = 0; y_begin < height; y_begin += strip_rows, i ^= 1) {
+            const std::uint32_t rows = buffers.acquire_full(i);
+            const pixel_type* pixels = buffers.pixels(i);
+            {
+                phase_timer timer(render_phase::encode);
+                for (std::uint32_t row = 0; row < rows; ++row) {
+                    writer.write_row(pixels + row * width);
+                }
+            }
+            buffers.release_empty(i);
+        }
+    } catch (...) {
+        buffers.abort();
+        rasterizer.join();
+        throw;
+    }
+
+    rasterizer.join();
+}
+
+// Encode layers through the writer returned by open_writer(width, format)
+template <typename open_function>
+void encode_layers(
+    open_function&& open_writer,
+    const std::vector<waveform_layer>& layers,
+    std::uint32_t height,
+    const png::rgba_pixel& bg_color,
+    const png_settings& settings,
+    std::uint32_t strip_rows
+) {
+    if (layers.empty()) {
+        throw std::invalid_argument("waveform image without layers");
+    }
+
+    strip_rows = std::clamp<std::uint32_t>(strip_rows, 1, std::max<std::uint32_t>(1, height));
+
+    std::vector<png::rgba_pixel> colors{ bg_color };
+    for (const auto& layer : layers) {
+        colors.push_back(layer.color);
+    }
+
+    const auto width = static_cast<std::uint32_t>(layers.front().spans->size());
+    const auto format = choose_pixel_format(colors, settings.compact);
+    PngStreamWriter writer = open_writer(width, format);
+
+    if (format.color_type == PNG_COLOR_TYPE_PALETTE) {
+        // Background is the first palette entry
+        const auto index_of = [&](const png::rgba_pixel& color) {
+            const auto entry = std::find_if(format.palette.begin(), format.palette.end(),
+                [&](const png::rgba_pixel& e) { return same_color(e, color); });
+            return static_cast<png::byte>(entry - format.palette.begin());
+        };
+
+        std::vector<pixel_layer<png::byte>> indexed;
+        for (const auto& layer : layers) {
+            indexed.push_back({ layer.spans, index_of(layer.color) });
+        }
+        stream_strips<png::byte>(writer, indexed, height, 0, strip_rows);
+    } else {
+        std::vector<pixel_layer<png::rgba_pixel>> direct;
+        for (const auto& layer : layers) {
+            direct.push_back({ layer.spans, layer.color });
+        }
+        stream_strips(writer, direct, height, bg_color, strip_rows);
+    }
+
+    phase_timer timer(render_phase::encode);
+    writer.finish();
+}
+
+} // anonymous namespace
+
+void write_waveform_png(
+    const std::string& file_name,
+    const std::vector<column_span>& spans,
+    std::uint32_t height,
+    const png::rgba_pixel& bg_color,
+    const png::rgba_pixel& fg_color,
+    const png_settings& settings,
+    std::uint32_t strip_rows
+) {
+    write_waveform_png(file_name, { waveform_layer{ &spans, fg_color } }, height, bg_color, settings, strip_rows);
+}
+
+void write_waveform_png(
+    const std::string& file_name,
+    const std::vector<waveform_layer>& layers,
+    std::uint32_t height,
+    const png::rgba_pixel& bg_color,
+    const png_settings& settings,
+    std::uint32_t strip_rows
+) {
+    encode_layers(
+        [&](std::uint32_t width, const png_pixel_format& format) {
+            return PngStreamWriter(file_name, width, height, format, settings);
+        },
+        layers, height, bg_color, settings, strip_rows);
+}
+
+void encode_waveform_png(
+    std::vector<unsigned char>& buffer,
+    const std::vector<waveform_layer>& layers,
+    std::uint32_t height,
+    const png::rgba_pixel& bg_color,
+    const png_settings& settings,
+    std::uint32_t strip_rows
+) {
+    encode_layers(
+        [&](std::uint32_t width, const png_pixel_format& format) {
+            return PngStreamWriter(buffer, width, height, format, settings);
+        },
+        layers, height, bg_color, settings, strip_rows);
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <png++/png.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "rasterizer.hpp"
+
+// Rows per strip when streaming a waveform into a PNG file
+constexpr std::uint32_t default_strip_rows = 64;
+
+// Encoding settings of PNG output
+struct png_settings {
+    // Use the smallest pixel format that can hold the colors of the image
+    // instead of always writing RGBA
+    bool compact = true;
+
+    // zlib compression level (0-9)
+    int level = 6;
+
+    // zlib strategy (Z_FILTERED, ...), or -1 to let libpng choose
+    int strategy = -1;
+
+    // Mask of PNG_FILTER_* values, or -1 to let libpng choose
+    int filters = -1;
+};
+
+// Pixel layout of a PNG file. Palette images store one palette index per
+// pixel and byte in the rows passed to PngStreamWriter, which packs them to
+// bit_depth bits.
+struct png_pixel_format {
+    int color_type = PNG_COLOR_TYPE_RGBA;
+    int bit_depth = 8;
+    std::vector<png::rgba_pixel> palette;
+};
+
+// Smallest pixel format that can represent all of colors exactly
+png_pixel_format choose_pixel_format(const std::vector<png::rgba_pixel>& colors, bool compact);
+
+// Writes a PNG file row by row through libpng, so that the image never has to
+// be held in memory as a whole. libpng errors are raised as
+// std::runtime_error. The file is removed again unless finish() was reached.
+class PngStreamWriter {
+public:
+    PngStreamWriter(
+        const std::string& file_name,
+        std::uint32_t width,
+        std::uint32_t height,
+        const png_pixel_format& format,
+        const png_settings& settings
+    );
+
+    // Write the encoded PNG into buffer instead of a file, replacing its
+    // contents. buffer must outlive the writer.
+    PngStreamWriter(
+        std::vector<unsigned char>& buffer,
+        std::uint32_t width,
+        std::uint32_t height,
+        const png_pixel_format& format,
+        const png_settings& settings
+    );
+    ~PngStreamWriter();
+
+    PngStreamWriter(const PngStreamWriter&) = delete;
+    PngStreamWriter& operator=(const PngStreamWriter&) = delete;
+
+    // Append the next row of width pixels in the layout of the pixel format
+    void write_row(const void* row);
+
+    // Flush the remaining data and close the file
+    void finish();
+
+private:
+    void open(std::uint32_t width, std::uint32_t height, const png_pixel_format& format, const png_settings& settings);
+    void close() noexcept;
+
+    static void on_error(png_structp png, png_const_charp message);
+    static void on_warning(png_structp png, png_const_charp message);
+    static void on_write(png_structp png, png_bytep data, png_size_t size);
+    static void on_flush(png_structp png);
+
+    [[noreturn]] void raise();
+
+    std::string file_name_;
+    std::FILE* file_ = nullptr;
+    std::vector<unsigned char>* buffer_ = nullptr;
+    png_structp png_ = nullptr;
+    png_infop info_ = nullptr;
+    std::string error_;
+    bool created_ = false;
+    bool finished_ = false;
+};
+
+// Spans drawn in a single color, over the layers before them
+struct waveform_layer {
+    const std::vector<column_span>* spans;
+    png::rgba_pixel color;
+};
+
+// Rasterize spans into an image of the given height and stream it to
+// file_name, strip_rows rows at a time. The next strip is rasterized on a
+// separate thread while the current one is being compressed, so memory use
+// depends on the strip height rather than on the image size.
+void write_waveform_png(
+    const std::string& file_name,
+    const std::vector<column_span>& spans,
+    std::uint32_t height,
+    const png::rgba_pixel& bg_color,
+    const png::rgba_pixel& fg_color,
+    const png_settings& settings = png_settings(),
+    std::uint32_t strip_rows = default_strip_rows
+);
+
+// Like write_waveform_png with a single foreground, for images of several
+// layers, e.g. an RMS band over the peak envelope. All layers must have the
+// same width. Colors are not blended, every layer replaces the pixels it
+// covers.
+void write_waveform_png(
+    const std::string& file_name,
+    const std::vector<waveform_layer>& layers,
+    std::uint32_t height,
+    const png::rgba_pixel& bg_color,
+    const png_settings& settings = png_settings(),
+    std::uint32_t strip_rows = default_strip_rows
+);
+
+// Like write_waveform_png, but encode the PNG into buffer instead of a file.
+// Only the encoded image is held in memory, the pixels are still produced in
+// strips.
+void encode_waveform_png(
+    std::vector<unsigned char>& buffer,
+    const std::vector<waveform_layer>& layers,
+    std::uint32_t height,
+    const png::rgba_pixel& bg_color,
+    const png_settings& settings = png_settings(),
+    std::uint32_t strip_rows = default_strip_rows
+);
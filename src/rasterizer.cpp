@@ -0,0 +1,127 @@
+#include "rasterizer.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+
+namespace {
+
+// Rows of a vertical-ish line from (x - 1, y0) to (x, y1) that fall into
+// column x - 1 (the head) and column x (the tail). The first half of the rows
+// is drawn in the left column, the rest in the right one. Ranges are inclusive;
+// the head is empty if head_last < head_first.
+struct line_split {
+    long head_first;
+    long head_last;
+    long tail_first;
+    long tail_last;
+};
+
+line_split split_line(long y0, long y1) noexcept {
+    const long ydiff = y1 - y0;
+    const long abs_ydiff = std::abs(ydiff);
+    const long sign = (ydiff == 0) ? 0 : (ydiff / abs_ydiff);
+    const long half = abs_ydiff / 2;
+
+    line_split split;
+    if (half > 0) {
+        split.head_first = std::min(y0, y0 + sign * (half - 1));
+        split.head_last = std::max(y0, y0 + sign * (half - 1));
+    } else {
+        split.head_first = 0;
+        split.head_last = -1;
+    }
+    split.tail_first = std::min(y0 + sign * half, y1);
+    split.tail_last = std::max(y0 + sign * half, y1);
+    return split;
+}
+
+// Spans of line-only mode. Both parts of the lines drawn into a column touch
+// its median, so their union is a single span.
+std::vector<column_span> line_spans(const std::vector<column_extent>& extents, std::uint32_t h) {
+    const std::size_t width = extents.size();
+    std::vector<column_span> spans(width);
+
+    for (std::size_t x = 0; x < width; ++x) {
+        long first = 0;
+        long last = -1;
+
+        // Tail of the line coming from the previous column
+        if (x > 0) {
+            const auto split = split_line(extents[x - 1].y_median, extents[x].y_median);
+            first = split.tail_first;
+            last = split.tail_last;
+        }
+
+        // Head of the line going to the next column
+        if (x + 1 < width) {
+            const auto split = split_line(extents[x].y_median, extents[x + 1].y_median);
+            if (split.head_last >= split.head_first) {
+                if (last < first) {
+                    first = split.head_first;
+                    last = split.head_last;
+                } else {
+                    first = std::min(first, split.head_first);
+                    last = std::max(last, split.head_last);
+                }
+            }
+        }
+
+        if (last >= first) {
+            spans[x].y_begin = static_cast<std::uint32_t>(std::min<long>(first, h));
+            spans[x].y_end = static_cast<std::uint32_t>(std::min<long>(last + 1, h));
+        }
+    }
+
+    return spans;
+}
+
+} // anonymous namespace
+
+std::vector<column_span> build_spans(
+    const std::vector<column_extent>& extents,
+    std::size_t width,
+    std::uint32_t h,
+    bool line_only
+) {
+    assert(!extents.empty());
+
+    std::vector<column_span> spans;
+
+    if (line_only) {
+        spans = line_spans(extents, h);
+    } else {
+        spans.resize(extents.size());
+        for (std::size_t x = 0; x < extents.size(); ++x) {
+            spans[x].y_begin = std::min(extents[x].y1, h);
+            spans[x].y_end = std::min(extents[x].y2, h);
+        }
+    }
+
+    // Stretch to the image width if there were fewer columns than pixels
+    if (width != spans.size()) {
+        std::vector<column_span> stretched(width);
+        for (std::size_t x = 0; x < width; ++x) {
+            stretched[x] = spans[x * spans.size() / width];
+        }
+        spans.swap(stretched);
+    }
+
+    return spans;
+}
+
+void rasterize(
+    const std::vector<column_span>& spans,
+    std::uint32_t y_begin,
+    std::uint32_t y_end,
+    const png::rgba_pixel& bg_color,
+    const png::rgba_pixel& fg_color,
+    png::image<png::rgba_pixel>& image
+) {
+    assert(spans.size() == image.get_width());
+    assert(y_end <= image.get_height());
+
+    for (std::uint32_t y = y_begin; y < y_end; ++y) {
+        rasterize_row(spans, y, bg_color, fg_color, image[y].data());
+    }
+}
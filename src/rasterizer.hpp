@@ -0,0 +1,91 @@
+#pragma once
+
+#include <png++/png.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Pixel rows of a single column, as computed by the reduction stage
+struct column_extent {
+    std::uint32_t y1 = 0;
+    std::uint32_t y2 = 0;
+    std::uint32_t y_median = 0;
+};
+
+// Foreground rows [y_begin, y_end) of a single column. Every column of a
+// waveform has exactly one such span; everything else is background.
+struct column_span {
+    std::uint32_t y_begin = 0;
+    std::uint32_t y_end = 0;
+};
+
+// Turn the extents of the reduced columns into the foreground spans of an
+// image of width columns and height h. In fill mode a column covers
+// [y1, y2), in line-only mode the spans trace the line connecting the medians
+// of neighbouring columns. If width is larger than the number of extents, the
+// columns are stretched (nearest neighbor).
+std::vector<column_span> build_spans(
+    const std::vector<column_extent>& extents,
+    std::size_t width,
+    std::uint32_t h,
+    bool line_only
+);
+
+// Fill one image row of spans.size() pixels. pixel_type may be anything
+// assignable, e.g. an RGBA pixel or a palette index.
+template <typename pixel_type>
+void rasterize_row(
+    const std::vector<column_span>& spans,
+    std::uint32_t y,
+    const pixel_type& bg_color,
+    const pixel_type& fg_color,
+    pixel_type* row
+) {
+    const auto covers = [y](const column_span& span) {
+        return y >= span.y_begin && y < span.y_end;
+    };
+
+    const std::size_t width = spans.size();
+
+    // Fill runs of neighbouring columns that have the same color in this row
+    std::size_t x = 0;
+    while (x < width) {
+        const bool inside = covers(spans[x]);
+
+        std::size_t run_end = x + 1;
+        while (run_end < width && covers(spans[run_end]) == inside) {
+            ++run_end;
+        }
+
+        std::fill(row + x, row + run_end, inside ? fg_color : bg_color);
+        x = run_end;
+    }
+}
+
+// Set the pixels of one image row that spans cover to color, leaving the
+// others as they are. Used to draw further layers over a rasterized row.
+template <typename pixel_type>
+void paint_row(
+    const std::vector<column_span>& spans,
+    std::uint32_t y,
+    const pixel_type& color,
+    pixel_type* row
+) {
+    const std::size_t width = spans.size();
+    for (std::size_t x = 0; x < width; ++x) {
+        if (y >= spans[x].y_begin && y < spans[x].y_end) {
+            row[x] = color;
+        }
+    }
+}
+
+// Fill rows [y_begin, y_end) of image, row by row
+void rasterize(
+    const std::vector<column_span>& spans,
+    std::uint32_t y_begin,
+    std::uint32_t y_end,
+    const png::rgba_pixel& bg_color,
+    const png::rgba_pixel& fg_color,
+    png::image<png::rgba_pixel>& image
+);
@@ -0,0 +1,588 @@
+#include "reduce_kernels.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WAV2PNG_X86 1
+#endif
+
+namespace {
+
+// Scalar fallback, also used for the tails of the vectorized kernels.
+// Note that std::min(a, b) keeps a if b is NaN, which the vector kernels
+// mirror by passing the accumulator as second operand to min/max.
+template <typename T>
+void minmax_scalar(const T* data, std::size_t n, T& min_val, T& max_val) noexcept {
+    T lo = min_val;
+    T hi = max_val;
+    for (std::size_t i = 0; i < n; ++i) {
+        lo = std::min(lo, data[i]);
+        hi = std::max(hi, data[i]);
+    }
+    min_val = lo;
+    max_val = hi;
+}
+
+// Fold the lanes of a stored vector into min_val/max_val
+template <typename T, std::size_t N>
+inline void fold_lanes(const T (&lo)[N], const T (&hi)[N], T& min_val, T& max_val) noexcept {
+    for (std::size_t i = 0; i < N; ++i) {
+        min_val = std::min(min_val, lo[i]);
+        max_val = std::max(max_val, hi[i]);
+    }
+}
+
+// Moments of 16 bit samples. Sums are exact in integers, which lets the
+// compiler vectorize the loop for whichever instruction set it is inlined into.
+__attribute__((always_inline))
+inline void moments_s16_body(const short* data, std::size_t n, sample_moments<short>& moments) noexcept {
+    short lo = moments.min_val;
+    short hi = moments.max_val;
+    std::int64_t sum = 0;
+    std::uint64_t sum_sq = 0;
+    std::uint64_t clipped = 0;
+
+    for (std::size_t i = 0; i < n; ++i) {
+        const int v = data[i];
+        lo = std::min(lo, data[i]);
+        hi = std::max(hi, data[i]);
+        sum += v;
+        sum_sq += static_cast<std::uint32_t>(v * v);
+        clipped += (v == 32767) | (v == -32768);
+    }
+
+    moments.min_val = lo;
+    moments.max_val = hi;
+    moments.sum += static_cast<double>(sum);
+    moments.sum_sq += static_cast<double>(sum_sq);
+    moments.clipped += clipped;
+}
+
+// Moments of 32 bit samples, which is how libsndfile returns 24 and 32 bit
+// PCM: left-justified, 24 bit samples having 8 zero bits. Squares are summed
+// from the top 24 bits, exact for 24 bit input, in integer pieces short enough
+// not to overflow. Samples whose top 24 bits are at full scale count as clipped.
+__attribute__((always_inline))
+inline void moments_s32_body(const int* data, std::size_t n, sample_moments<int>& moments) noexcept {
+    constexpr std::size_t piece_size = 65536;
+
+    int lo = moments.min_val;
+    int hi = moments.max_val;
+
+    for (std::size_t begin = 0; begin < n; begin += piece_size) {
+        const std::size_t end = std::min(n, begin + piece_size);
+        std::int64_t sum = 0;
+        std::uint64_t sum_sq = 0;
+        std::uint64_t clipped = 0;
+
+        for (std::size_t i = begin; i < end; ++i) {
+            const int v = data[i];
+            const std::int64_t top = v >> 8;
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+            sum += v;
+            sum_sq += static_cast<std::uint64_t>(top * top);
+            clipped += (top == 0x7fffff) | (top == -0x800000);
+        }
+
+        moments.sum += static_cast<double>(sum);
+        moments.sum_sq += static_cast<double>(sum_sq) * 65536.0;
+        moments.clipped += clipped;
+    }
+
+    moments.min_val = lo;
+    moments.max_val = hi;
+}
+
+// Moments of float samples, accumulated in double precision. Only the
+// extremes vectorize, as reordering the sums would change the result.
+__attribute__((always_inline))
+inline void moments_f32_body(const float* data, std::size_t n, sample_moments<float>& moments) noexcept {
+    float lo = moments.min_val;
+    float hi = moments.max_val;
+    double sum = 0.0;
+    double sum_sq = 0.0;
+    std::uint64_t clipped = 0;
+
+    for (std::size_t i = 0; i < n; ++i) {
+        const float v = data[i];
+        lo = std::min(lo, v);
+        hi = std::max(hi, v);
+        sum += v;
+        sum_sq += static_cast<double>(v) * v;
+        clipped += std::abs(v) >= 1.0f;
+    }
+
+    moments.min_val = lo;
+    moments.max_val = hi;
+    moments.sum += sum;
+    moments.sum_sq += sum_sq;
+    moments.clipped += clipped;
+}
+
+// Split stereo frames. Mid and side are halved before they are combined where
+// the sum could overflow, so that full scale stays full scale. Written as
+// plain loops over the frames, which the compiler vectorizes with shuffles for
+// whichever instruction set it is inlined into.
+__attribute__((always_inline))
+inline void split_stereo_s16_body(
+    const short* __restrict frames, std::size_t n,
+    short* __restrict left, short* __restrict right, short* __restrict mid, short* __restrict side
+) noexcept {
+    for (std::size_t i = 0; i < n; ++i) {
+        const int l = frames[2 * i];
+        const int r = frames[2 * i + 1];
+        left[i] = static_cast<short>(l);
+        right[i] = static_cast<short>(r);
+        mid[i] = static_cast<short>((l + r) >> 1);
+        side[i] = static_cast<short>((l - r) >> 1);
+    }
+}
+
+__attribute__((always_inline))
+inline void split_stereo_s32_body(
+    const int* __restrict frames, std::size_t n,
+    int* __restrict left, int* __restrict right, int* __restrict mid, int* __restrict side
+) noexcept {
+    for (std::size_t i = 0; i < n; ++i) {
+        const int l = frames[2 * i];
+        const int r = frames[2 * i + 1];
+        left[i] = l;
+        right[i] = r;
+        mid[i] = (l >> 1) + (r >> 1);
+        side[i] = (l >> 1) - (r >> 1);
+    }
+}
+
+__attribute__((always_inline))
+inline void split_stereo_f32_body(
+    const float* __restrict frames, std::size_t n,
+    float* __restrict left, float* __restrict right, float* __restrict mid, float* __restrict side
+) noexcept {
+    for (std::size_t i = 0; i < n; ++i) {
+        const float l = frames[2 * i];
+        const float r = frames[2 * i + 1];
+        left[i] = l;
+        right[i] = r;
+        mid[i] = (l + r) * 0.5f;
+        side[i] = (l - r) * 0.5f;
+    }
+}
+
+void moments_s16_scalar(const short* data, std::size_t n, sample_moments<short>& moments) noexcept {
+    moments_s16_body(data, n, moments);
+}
+
+void moments_s32_scalar(const int* data, std::size_t n, sample_moments<int>& moments) noexcept {
+    moments_s32_body(data, n, moments);
+}
+
+void moments_f32_scalar(const float* data, std::size_t n, sample_moments<float>& moments) noexcept {
+    moments_f32_body(data, n, moments);
+}
+
+void split_stereo_s16_scalar(
+    const short* frames, std::size_t n, short* left, short* right, short* mid, short* side
+) noexcept {
+    split_stereo_s16_body(frames, n, left, right, mid, side);
+}
+
+void split_stereo_s32_scalar(
+    const int* frames, std::size_t n, int* left, int* right, int* mid, int* side
+) noexcept {
+    split_stereo_s32_body(frames, n, left, right, mid, side);
+}
+
+void split_stereo_f32_scalar(
+    const float* frames, std::size_t n, float* left, float* right, float* mid, float* side
+) noexcept {
+    split_stereo_f32_body(frames, n, left, right, mid, side);
+}
+
+#ifdef WAV2PNG_X86
+
+__attribute__((target("sse2")))
+void moments_s16_sse2(const short* data, std::size_t n, sample_moments<short>& moments) noexcept {
+    moments_s16_body(data, n, moments);
+}
+
+__attribute__((target("avx2")))
+void moments_s16_avx2(const short* data, std::size_t n, sample_moments<short>& moments) noexcept {
+    moments_s16_body(data, n, moments);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void moments_s16_avx512(const short* data, std::size_t n, sample_moments<short>& moments) noexcept {
+    moments_s16_body(data, n, moments);
+}
+
+__attribute__((target("sse2")))
+void moments_s32_sse2(const int* data, std::size_t n, sample_moments<int>& moments) noexcept {
+    moments_s32_body(data, n, moments);
+}
+
+__attribute__((target("avx2")))
+void moments_s32_avx2(const int* data, std::size_t n, sample_moments<int>& moments) noexcept {
+    moments_s32_body(data, n, moments);
+}
+
+__attribute__((target("avx512f")))
+void moments_s32_avx512(const int* data, std::size_t n, sample_moments<int>& moments) noexcept {
+    moments_s32_body(data, n, moments);
+}
+
+__attribute__((target("sse2")))
+void minmax_s16_sse2(const short* data, std::size_t n, short& min_val, short& max_val) noexcept {
+    __m128i lo = _mm_set1_epi16(min_val);
+    __m128i hi = _mm_set1_epi16(max_val);
+
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        lo = _mm_min_epi16(lo, v);
+        hi = _mm_max_epi16(hi, v);
+    }
+
+    short lo_lanes[8];
+    short hi_lanes[8];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lo_lanes), lo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(hi_lanes), hi);
+    fold_lanes(lo_lanes, hi_lanes, min_val, max_val);
+
+    minmax_scalar(data + i, n - i, min_val, max_val);
+}
+
+__attribute__((target("sse2")))
+void minmax_f32_sse2(const float* data, std::size_t n, float& min_val, float& max_val) noexcept {
+    __m128 lo = _mm_set1_ps(min_val);
+    __m128 hi = _mm_set1_ps(max_val);
+
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128 v = _mm_loadu_ps(data + i);
+        lo = _mm_min_ps(v, lo);
+        hi = _mm_max_ps(v, hi);
+    }
+
+    float lo_lanes[4];
+    float hi_lanes[4];
+    _mm_storeu_ps(lo_lanes, lo);
+    _mm_storeu_ps(hi_lanes, hi);
+    fold_lanes(lo_lanes, hi_lanes, min_val, max_val);
+
+    minmax_scalar(data + i, n - i, min_val, max_val);
+}
+
+__attribute__((target("avx2")))
+void minmax_s16_avx2(const short* data, std::size_t n, short& min_val, short& max_val) noexcept {
+    __m256i lo = _mm256_set1_epi16(min_val);
+    __m256i hi = _mm256_set1_epi16(max_val);
+
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        lo = _mm256_min_epi16(lo, v);
+        hi = _mm256_max_epi16(hi, v);
+    }
+
+    short lo_lanes[16];
+    short hi_lanes[16];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lo_lanes), lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(hi_lanes), hi);
+    fold_lanes(lo_lanes, hi_lanes, min_val, max_val);
+
+    minmax_scalar(data + i, n - i, min_val, max_val);
+}
+
+__attribute__((target("avx2")))
+void minmax_s32_avx2(const int* data, std::size_t n, int& min_val, int& max_val) noexcept {
+    __m256i lo = _mm256_set1_epi32(min_val);
+    __m256i hi = _mm256_set1_epi32(max_val);
+
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        lo = _mm256_min_epi32(lo, v);
+        hi = _mm256_max_epi32(hi, v);
+    }
+
+    int lo_lanes[8];
+    int hi_lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lo_lanes), lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(hi_lanes), hi);
+    fold_lanes(lo_lanes, hi_lanes, min_val, max_val);
+
+    minmax_scalar(data + i, n - i, min_val, max_val);
+}
+
+__attribute__((target("avx2")))
+void minmax_f32_avx2(const float* data, std::size_t n, float& min_val, float& max_val) noexcept {
+    __m256 lo = _mm256_set1_ps(min_val);
+    __m256 hi = _mm256_set1_ps(max_val);
+
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 v = _mm256_loadu_ps(data + i);
+        lo = _mm256_min_ps(v, lo);
+        hi = _mm256_max_ps(v, hi);
+    }
+
+    float lo_lanes[8];
+    float hi_lanes[8];
+    _mm256_storeu_ps(lo_lanes, lo);
+    _mm256_storeu_ps(hi_lanes, hi);
+    fold_lanes(lo_lanes, hi_lanes, min_val, max_val);
+
+    minmax_scalar(data + i, n - i, min_val, max_val);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void minmax_s16_avx512(const short* data, std::size_t n, short& min_val, short& max_val) noexcept {
+    __m512i lo = _mm512_set1_epi16(min_val);
+    __m512i hi = _mm512_set1_epi16(max_val);
+
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m512i v = _mm512_loadu_si512(data + i);
+        lo = _mm512_min_epi16(lo, v);
+        hi = _mm512_max_epi16(hi, v);
+    }
+
+    short lo_lanes[32];
+    short hi_lanes[32];
+    _mm512_storeu_si512(lo_lanes, lo);
+    _mm512_storeu_si512(hi_lanes, hi);
+    fold_lanes(lo_lanes, hi_lanes, min_val, max_val);
+
+    minmax_scalar(data + i, n - i, min_val, max_val);
+}
+
+__attribute__((target("avx512f")))
+void minmax_s32_avx512(const int* data, std::size_t n, int& min_val, int& max_val) noexcept {
+    __m512i lo = _mm512_set1_epi32(min_val);
+    __m512i hi = _mm512_set1_epi32(max_val);
+
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // Masked forms, see minmax_f32_avx512
+        const __m512i v = _mm512_loadu_si512(data + i);
+        lo = _mm512_mask_min_epi32(lo, 0xffff, lo, v);
+        hi = _mm512_mask_max_epi32(hi, 0xffff, hi, v);
+    }
+
+    int lo_lanes[16];
+    int hi_lanes[16];
+    _mm512_storeu_si512(lo_lanes, lo);
+    _mm512_storeu_si512(hi_lanes, hi);
+    fold_lanes(lo_lanes, hi_lanes, min_val, max_val);
+
+    minmax_scalar(data + i, n - i, min_val, max_val);
+}
+
+__attribute__((target("avx512f")))
+void minmax_f32_avx512(const float* data, std::size_t n, float& min_val, float& max_val) noexcept {
+    __m512 lo = _mm512_set1_ps(min_val);
+    __m512 hi = _mm512_set1_ps(max_val);
+
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // Masked forms, as the unmasked ones trip -Wmaybe-uninitialized in
+        // some gcc versions
+        const __m512 v = _mm512_loadu_ps(data + i);
+        lo = _mm512_mask_min_ps(lo, 0xffff, v, lo);
+        hi = _mm512_mask_max_ps(hi, 0xffff, v, hi);
+    }
+
+    float lo_lanes[16];
+    float hi_lanes[16];
+    _mm512_storeu_ps(lo_lanes, lo);
+    _mm512_storeu_ps(hi_lanes, hi);
+    fold_lanes(lo_lanes, hi_lanes, min_val, max_val);
+
+    minmax_scalar(data + i, n - i, min_val, max_val);
+}
+
+__attribute__((target("sse2")))
+void split_stereo_s16_sse2(
+    const short* frames, std::size_t n, short* left, short* right, short* mid, short* side
+) noexcept {
+    split_stereo_s16_body(frames, n, left, right, mid, side);
+}
+
+__attribute__((target("avx2")))
+void split_stereo_s16_avx2(
+    const short* frames, std::size_t n, short* left, short* right, short* mid, short* side
+) noexcept {
+    split_stereo_s16_body(frames, n, left, right, mid, side);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void split_stereo_s16_avx512(
+    const short* frames, std::size_t n, short* left, short* right, short* mid, short* side
+) noexcept {
+    split_stereo_s16_body(frames, n, left, right, mid, side);
+}
+
+__attribute__((target("sse2")))
+void split_stereo_s32_sse2(
+    const int* frames, std::size_t n, int* left, int* right, int* mid, int* side
+) noexcept {
+    split_stereo_s32_body(frames, n, left, right, mid, side);
+}
+
+__attribute__((target("avx2")))
+void split_stereo_s32_avx2(
+    const int* frames, std::size_t n, int* left, int* right, int* mid, int* side
+) noexcept {
+    split_stereo_s32_body(frames, n, left, right, mid, side);
+}
+
+__attribute__((target("avx512f")))
+void split_stereo_s32_avx512(
+    const int* frames, std::size_t n, int* left, int* right, int* mid, int* side
+) noexcept {
+    split_stereo_s32_body(frames, n, left, right, mid, side);
+}
+
+__attribute__((target("sse2")))
+void split_stereo_f32_sse2(
+    const float* frames, std::size_t n, float* left, float* right, float* mid, float* side
+) noexcept {
+    split_stereo_f32_body(frames, n, left, right, mid, side);
+}
+
+__attribute__((target("avx2")))
+void split_stereo_f32_avx2(
+    const float* frames, std::size_t n, float* left, float* right, float* mid, float* side
+) noexcept {
+    split_stereo_f32_body(frames, n, left, right, mid, side);
+}
+
+__attribute__((target("avx512f")))
+void split_stereo_f32_avx512(
+    const float* frames, std::size_t n, float* left, float* right, float* mid, float* side
+) noexcept {
+    split_stereo_f32_body(frames, n, left, right, mid, side);
+}
+
+#endif // WAV2PNG_X86
+
+constexpr reduce_kernels scalar_kernels = {
+    "scalar",
+    minmax_scalar<short>,
+    minmax_scalar<int>,
+    minmax_scalar<float>,
+    moments_s16_scalar,
+    moments_s32_scalar,
+    moments_f32_scalar,
+    split_stereo_s16_scalar,
+    split_stereo_s32_scalar,
+    split_stereo_f32_scalar
+};
+
+#ifdef WAV2PNG_X86
+
+constexpr reduce_kernels sse2_kernels = {
+    "sse2",
+    minmax_s16_sse2,
+    minmax_scalar<int>,  // 32 bit min/max only came with SSE4.1
+    minmax_f32_sse2,
+    moments_s16_sse2,
+    moments_s32_sse2,
+    moments_f32_scalar,
+    split_stereo_s16_sse2,
+    split_stereo_s32_sse2,
+    split_stereo_f32_sse2
+};
+
+constexpr reduce_kernels avx2_kernels = {
+    "avx2",
+    minmax_s16_avx2,
+    minmax_s32_avx2,
+    minmax_f32_avx2,
+    moments_s16_avx2,
+    moments_s32_avx2,
+    moments_f32_scalar,
+    split_stereo_s16_avx2,
+    split_stereo_s32_avx2,
+    split_stereo_f32_avx2
+};
+
+constexpr reduce_kernels avx512_kernels = {
+    "avx512",
+    minmax_s16_avx512,
+    minmax_s32_avx512,
+    minmax_f32_avx512,
+    moments_s16_avx512,
+    moments_s32_avx512,
+    moments_f32_scalar,
+    split_stereo_s16_avx512,
+    split_stereo_s32_avx512,
+    split_stereo_f32_avx512
+};
+
+#endif // WAV2PNG_X86
+
+// Kernel tables from best to worst, with a check for CPU support
+struct kernel_candidate {
+    const reduce_kernels* kernels;
+    bool (*supported)();
+};
+
+const kernel_candidate candidates[] = {
+#ifdef WAV2PNG_X86
+    { &avx512_kernels, [] {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    } },
+    { &avx2_kernels, [] { return __builtin_cpu_supports("avx2") != 0; } },
+    { &sse2_kernels, [] { return __builtin_cpu_supports("sse2") != 0; } },
+#endif
+    { &scalar_kernels, [] { return true; } }
+};
+
+const reduce_kernels* find_candidate(const char* name) noexcept {
+#ifdef WAV2PNG_X86
+    __builtin_cpu_init();
+#endif
+    for (const auto& candidate : candidates) {
+        if (std::strcmp(candidate.kernels->name, name) == 0) {
+            return candidate.supported() ? candidate.kernels : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+const reduce_kernels& select_reduce_kernels() noexcept {
+    // Allow forcing a specific instruction set, e.g. for comparing variants
+    if (const char* forced = std::getenv("WAV2PNG_SIMD")) {
+        if (const auto* kernels = find_candidate(forced)) {
+            return *kernels;
+        }
+    }
+
+#ifdef WAV2PNG_X86
+    __builtin_cpu_init();
+#endif
+    for (const auto& candidate : candidates) {
+        if (candidate.supported()) {
+            return *candidate.kernels;
+        }
+    }
+    return scalar_kernels;
+}
+
+} // anonymous namespace
+
+const reduce_kernels& get_reduce_kernels() noexcept {
+    static const reduce_kernels& kernels = select_reduce_kernels();
+    return kernels;
+}
+
+const reduce_kernels* find_reduce_kernels(const char* name) noexcept {
+    return find_candidate(name);
+}
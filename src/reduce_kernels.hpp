@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Running statistics of a block of samples. min_val and max_val fold into the
+// values they hold, the sums accumulate.
+template <typename T>
+struct sample_moments {
+    T min_val = 0;
+    T max_val = 0;
+    double sum = 0.0;
+    double sum_sq = 0.0;
+    std::uint64_t clipped = 0;  // samples at or beyond full scale
+};
+
+// Table of reduction kernels used by the renderer. One table exists per
+// instruction set; the best one supported by the running CPU is selected once,
+// on first use.
+struct reduce_kernels {
+    // Name of the instruction set, e.g. "avx2"
+    const char* name;
+
+    // Fold data[0..n) into min_val and max_val
+    void (*minmax_s16)(const short* data, std::size_t n, short& min_val, short& max_val);
+    void (*minmax_s32)(const int* data, std::size_t n, int& min_val, int& max_val);
+    void (*minmax_f32)(const float* data, std::size_t n, float& min_val, float& max_val);
+
+    // Fold data[0..n) into all fields of moments, in a single pass
+    void (*moments_s16)(const short* data, std::size_t n, sample_moments<short>& moments);
+    void (*moments_s32)(const int* data, std::size_t n, sample_moments<int>& moments);
+    void (*moments_f32)(const float* data, std::size_t n, sample_moments<float>& moments);
+
+    // Split n interleaved stereo frames into their left and right channels
+    // and the mid (left + right) / 2 and side (left - right) / 2 signals, in
+    // a single pass
+    void (*split_stereo_s16)(const short* frames, std::size_t n, short* left, short* right, short* mid, short* side);
+    void (*split_stereo_s32)(const int* frames, std::size_t n, int* left, int* right, int* mid, int* side);
+    void (*split_stereo_f32)(const float* frames, std::size_t n, float* left, float* right, float* mid, float* side);
+};
+
+// Kernels selected for the running CPU
+const reduce_kernels& get_reduce_kernels() noexcept;
+
+// Kernels for a named instruction set ("scalar", "sse2", "avx2", "avx512").
+// Returns nullptr if the set is unknown or not supported by the running CPU.
+const reduce_kernels* find_reduce_kernels(const char* name) noexcept;
+
+// Overloads used by the sample type templated renderer
+inline void minmax(const short* data, std::size_t n, short& min_val, short& max_val) noexcept {
+    get_reduce_kernels().minmax_s16(data, n, min_val, max_val);
+}
+
+inline void minmax(const int* data, std::size_t n, int& min_val, int& max_val) noexcept {
+    get_reduce_kernels().minmax_s32(data, n, min_val, max_val);
+}
+
+inline void minmax(const float* data, std::size_t n, float& min_val, float& max_val) noexcept {
+    get_reduce_kernels().minmax_f32(data, n, min_val, max_val);
+}
+
+inline void fold_moments(const short* data, std::size_t n, sample_moments<short>& moments) noexcept {
+    get_reduce_kernels().moments_s16(data, n, moments);
+}
+
+inline void fold_moments(const int* data, std::size_t n, sample_moments<int>& moments) noexcept {
+    get_reduce_kernels().moments_s32(data, n, moments);
+}
+
+inline void fold_moments(const float* data, std::size_t n, sample_moments<float>& moments) noexcept {
+    get_reduce_kernels().moments_f32(data, n, moments);
+}
+
+inline void split_stereo(
+    const short* frames, std::size_t n, short* left, short* right, short* mid, short* side
+) noexcept {
+    get_reduce_kernels().split_stereo_s16(frames, n, left, right, mid, side);
+}
+
+inline void split_stereo(
+    const int* frames, std::size_t n, int* left, int* right, int* mid, int* side
+) noexcept {
+    get_reduce_kernels().split_stereo_s32(frames, n, left, right, mid, side);
+}
+
+inline void split_stereo(
+    const float* frames, std::size_t n, float* left, float* right, float* mid, float* side
+) noexcept {
+    get_reduce_kernels().split_stereo_f32(frames, n, left, right, mid, side);
+}
@@ -0,0 +1,373 @@
+#include "render.hpp"
+
+#include <sndfile.hh>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "audio_converter.hpp"
+#include "output_cache.hpp"
+#include "peak_cache.hpp"
+#include "peak_data.hpp"
+#include "png_writer.hpp"
+#include "render_stats.hpp"
+
+namespace {
+
+// Open sound file (with automatic ffmpeg conversion if needed) and map its
+// samples if it is plain PCM. converter must outlive the returned handle.
+SndfileHandle open_input(
+    const Options& options,
+    std::unique_ptr<MappedPcmFile>& mapped,
+    std::unique_ptr<FFmpegConverter>& converter
+) {
+    phase_timer timer(render_phase::open);
+    SndfileHandle wav = AudioConverter::open_audio_file(options.input_file_name, mapped, converter);
+
+    if (wav.error()) {
+        throw input_open_error(wav.strError());
+    }
+
+    return wav;
+}
+
+// Load the peak cache for the input, building it if necessary. Returns nullptr
+// for dB scale renders of inputs wider than 16 bits, whose quiet passages the
+// 16 bit buckets cannot resolve.
+std::unique_ptr<PeakCache> load_peak_cache(
+    const Options& options,
+    bool db_scale,
+    const progress_callback_t& progress_callback
+) {
+    const std::string cache_file_name = options.peak_cache_file_name.empty()
+        ? PeakCache::default_path(options.input_file_name)
+        : options.peak_cache_file_name;
+
+    std::unique_ptr<PeakCache> peaks;
+    {
+        phase_timer timer(render_phase::open);
+        peaks = PeakCache::load(cache_file_name, options.input_file_name);
+    }
+    if (peaks) {
+        if (db_scale && peaks->wide_samples()) {
+            return nullptr;
+        }
+        return peaks;
+    }
+
+    std::unique_ptr<MappedPcmFile> mapped;
+    std::unique_ptr<FFmpegConverter> converter;
+    SndfileHandle wav = open_input(options, mapped, converter);
+    if (db_scale && has_wide_samples(wav)) {
+        return nullptr;
+    }
+
+    if (progress_callback) {
+        std::cerr << "building peak cache " << cache_file_name << std::endl;
+    }
+    return PeakCache::build(wav, options.input_file_name, cache_file_name, progress_callback);
+}
+
+// Write one image to file_name, drawing the RMS band inside the envelope but
+// below a line, in every lane. Peak data outputs are written without
+// rasterizing.
+void write_image(const Options& options, const std::string& file_name, const waveform_data& data, int samplerate) {
+    if (!options.writes_image()) {
+        write_peak_data(file_name, data, samplerate, options.peak_data);
+        return;
+    }
+
+    std::vector<waveform_layer> layers{ { &data.spans, options.foreground_color } };
+    for (const lane_layers& lane : data.lanes) {
+        layers.push_back({ &lane.spans, options.foreground_color });
+    }
+
+    if (!data.rms_spans.empty()) {
+        std::vector<waveform_layer> rms{ { &data.rms_spans, options.rms_color } };
+        for (const lane_layers& lane : data.lanes) {
+            rms.push_back({ &lane.rms_spans, options.rms_color });
+        }
+        layers.insert(options.line_only ? layers.begin() : layers.end(), rms.begin(), rms.end());
+    }
+
+    write_waveform_png(
+        file_name,
+        layers,
+        options.height,
+        options.background_color,
+        options.png
+    );
+}
+
+// Set the frame ranges of the waveforms of images for an input of the given
+// sample rate
+void apply_ranges(const std::vector<Options>& images, std::vector<waveform_params>& waveforms, int samplerate) {
+    for (std::size_t i = 0; i < images.size(); ++i) {
+        images[i].apply_range(waveforms[i], samplerate);
+    }
+}
+
+// Describe the levels of a tile pyramid for viewers, as tiles.json
+void write_tile_manifest(
+    const std::filesystem::path& file_name,
+    const std::vector<tile_level>& pyramid,
+    const waveform_params& tile,
+    sf_count_t frames,
+    int samplerate
+) {
+    std::ofstream out(file_name, std::ios::trunc);
+    out << "{\n"
+        << "  \"tile_width\": " << tile.width << ",\n"
+        << "  \"tile_height\": " << tile.height << ",\n"
+        << "  \"samplerate\": " << samplerate << ",\n"
+        << "  \"start_frame\": " << tile.start_frame << ",\n"
+        << "  \"frames\": " << frames << ",\n"
+        << "  \"levels\": [";
+
+    for (std::size_t z = 0; z < pyramid.size(); ++z) {
+        out << (z > 0 ? ",\n" : "\n")
+            << "    { \"frames_per_column\": " << pyramid[z].frames_per_column
+            << ", \"columns\": " << pyramid[z].columns
+            << ", \"tiles\": " << pyramid[z].tiles << " }";
+    }
+    out << "\n  ]\n}\n";
+
+    out.close();
+    if (!out.good()) {
+        throw std::runtime_error("failed to write '" + file_name.string() + "'");
+    }
+}
+
+// Render the tile pyramid of options into its tile directory, from a single
+// decode of the input
+bool render_tiles(const Options& options, const progress_callback_t& progress_callback) {
+    namespace fs = std::filesystem;
+
+    std::unique_ptr<MappedPcmFile> mapped;
+    std::unique_ptr<FFmpegConverter> converter;
+    SndfileHandle wav = open_input(options, mapped, converter);
+
+    waveform_params tile = options.waveform();
+    options.apply_range(tile, wav.samplerate());
+
+    const sf_count_t frames = tile.range_frames(wav.frames());
+    if (frames == 0) {
+        throw std::runtime_error("the range to render is empty");
+    }
+
+    const fs::path directory(options.tiles_directory);
+    const std::vector<tile_level> pyramid = plan_tile_pyramid(frames, tile.width, options.tile_levels);
+    for (std::size_t z = 0; z < pyramid.size(); ++z) {
+        fs::create_directories(directory / std::to_string(z));
+    }
+
+    const reopen_callback_t reopen = [&options]() {
+        return SndfileHandle(options.input_file_name.c_str());
+    };
+
+    const bool completed = compute_tile_pyramid(
+        wav, tile, options.tile_levels,
+        [&](unsigned level, std::size_t index, const waveform_data& data) {
+            const fs::path file_name = directory / std::to_string(level) / (std::to_string(index) + ".png");
+            write_image(options, file_name.string(), data, wav.samplerate());
+            return true;
+        },
+        progress_callback, options.threads, reopen, mapped.get()
+    );
+
+    if (completed) {
+        write_tile_manifest(directory / "tiles.json", pyramid, tile, frames, wav.samplerate());
+    }
+    return completed;
+}
+
+// Render input of unknown length in a single pass. With a stream interval,
+// the image is rewritten with the waveform read so far at that interval. It is
+// always replaced as a whole, so that viewers never see a partial file.
+bool render_stream(
+    const Options& options,
+    std::vector<waveform_data>& data,
+    const progress_callback_t& progress_callback
+) {
+    std::unique_ptr<MappedPcmFile> mapped;
+    std::unique_ptr<FFmpegConverter> converter;
+    SndfileHandle wav = open_input(options, mapped, converter);
+
+    const auto replace_image = [&](const waveform_data& current) {
+        const std::string temporary_file_name = options.output_file_name + ".tmp";
+        write_image(options, temporary_file_name, current, wav.samplerate());
+        std::filesystem::rename(temporary_file_name, options.output_file_name);
+        return true;
+    };
+
+    data.resize(1);
+    if (!compute_waveform_spans_streaming(
+            wav, data[0], options.waveform(), progress_callback, options.stream_interval, replace_image)) {
+        return false;
+    }
+
+    return replace_image(data[0]);
+}
+
+} // anonymous namespace
+
+bool render_file(
+    const Options& options,
+    std::vector<waveform_data>& data,
+    progress_callback_t progress_callback
+) {
+    if (options.writes_tiles()) {
+        return render_tiles(options, progress_callback);
+    }
+    if (options.streams()) {
+        return render_stream(options, data, progress_callback);
+    }
+
+    // Copy the output from the cache if it was rendered before
+    std::optional<OutputCache> cache;
+    std::string cache_key;
+    if (options.caches_output()) {
+        phase_timer timer(render_phase::open);
+        cache.emplace(options.output_cache_directory, std::uint64_t(options.output_cache_megabytes) << 20);
+        // Compressed inputs are decoded in segments by several threads or for
+        // a range, which can differ from a decode in one pass at the segment
+        // boundaries
+        std::string render_key = options.render_key();
+        if ((options.threads != 1 || options.has_range()) && AudioConverter::needs_ffmpeg(options.input_file_name)) {
+            render_key += " segmented";
+        }
+        cache_key = cache->key(options.input_file_name, render_key);
+        if (!cache_key.empty() && cache->fetch(cache_key, options.output_file_name)) {
+            return true;
+        }
+    }
+
+    bool completed = true;
+    const auto on_progress = [&](int percent) {
+        completed = !progress_callback || progress_callback(percent);
+        return completed;
+    };
+
+    // All images come from a single decode of the input
+    std::vector<Options> images{ options };
+    for (auto& extra : options.extra_outputs()) {
+        images.push_back(std::move(extra));
+    }
+
+    std::vector<waveform_params> waveforms;
+    bool needs_audio = false;
+    bool db_scale = false;
+    for (const auto& image : images) {
+        waveforms.push_back(image.waveform());
+        needs_audio = needs_audio || waveforms.back().needs_audio();
+        db_scale = db_scale || waveforms.back().use_db_scale;
+    }
+
+    data.resize(images.size());
+
+    // Render from the peak cache if it has enough resolution for all images.
+    // The cache only holds extremes and medians, percentiles and the RMS
+    // need the audio.
+    std::unique_ptr<PeakCache> peaks;
+    if (options.use_peak_cache && !needs_audio) {
+        peaks = load_peak_cache(options, db_scale, on_progress);
+        if (!completed) {
+            return false;
+        }
+    }
+
+    bool from_peaks = false;
+    if (peaks) {
+        apply_ranges(images, waveforms, peaks->samplerate());
+        from_peaks = std::all_of(waveforms.begin(), waveforms.end(), [&](const waveform_params& waveform) {
+            return peaks->can_render(waveform.width, waveform.range_frames(peaks->frames()));
+        });
+    }
+
+    ffmpeg_probe probe;
+    int samplerate = 0;
+    bool reduced = false;
+
+    if (from_peaks) {
+        samplerate = peaks->samplerate();
+        for (std::size_t i = 0; i < images.size() && completed; ++i) {
+            compute_waveform_spans_from_peaks(*peaks, data[i], waveforms[i], on_progress);
+        }
+        reduced = true;
+    } else if ((options.threads != 1 || options.has_range())
+               && AudioConverter::probe_ffmpeg_input(options.input_file_name, probe)) {
+        // Compressed input: decode the column range of each worker in a
+        // separate ffmpeg process, which also seeks to the start of a range
+        // instead of decoding up to it. The processes are kept until all
+        // segment handles are closed.
+        std::vector<std::unique_ptr<FFmpegConverter>> converters;
+        samplerate = probe.samplerate;
+        apply_ranges(images, waveforms, samplerate);
+
+        const segment_callback_t open_segment = [&](sf_count_t first_frame, sf_count_t frame_count) {
+            std::unique_ptr<FFmpegConverter> converter;
+            SndfileHandle handle = AudioConverter::open_segment(
+                options.input_file_name, probe, first_frame, frame_count, converter);
+            converters.push_back(std::move(converter));
+            return handle;
+        };
+
+        // The probed length is an estimate, which is off for some compressed
+        // formats. The input is then decoded again in one pass.
+        try {
+            if (images.size() == 1) {
+                compute_waveform_spans_segmented(
+                    probe.frames, probe.channels, open_segment, data[0], waveforms[0], on_progress, options.threads);
+            } else {
+                compute_waveform_spans_segmented(
+                    probe.frames, open_segment, data, waveforms, on_progress, options.threads);
+            }
+            reduced = true;
+        } catch (const segment_length_error& e) {
+            if (progress_callback) {
+                std::cerr << e.what() << ", decoding it in one pass" << std::endl;
+            }
+        }
+    }
+
+    if (!reduced) {
+        std::unique_ptr<MappedPcmFile> mapped;
+        std::unique_ptr<FFmpegConverter> converter;
+        SndfileHandle wav = open_input(options, mapped, converter);
+        samplerate = wav.samplerate();
+        apply_ranges(images, waveforms, samplerate);
+
+        const reopen_callback_t reopen = [&options]() {
+            return SndfileHandle(options.input_file_name.c_str());
+        };
+
+        if (images.size() == 1) {
+            compute_waveform_spans(
+                wav, data[0], waveforms[0], on_progress, options.threads, reopen, mapped.get());
+        } else {
+            compute_waveform_spans(
+                wav, data, waveforms, on_progress, options.threads, reopen, mapped.get());
+        }
+    }
+
+    if (!completed) {
+        return false;
+    }
+
+    // Rasterize and write the images to disk strip by strip
+    for (std::size_t i = 0; i < images.size(); ++i) {
+        write_image(images[i], images[i].output_file_name, data[i], samplerate);
+    }
+
+    if (!cache_key.empty()) {
+        phase_timer timer(render_phase::encode);
+        cache->store(cache_key, options.output_file_name);
+    }
+
+    return true;
+}
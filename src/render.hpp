@@ -0,0 +1,30 @@
+#pragma once
+
+#include <png++/png.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "options.hpp"
+#include "wav2png.hpp"
+
+// Raised when the input file cannot be opened or decoded
+class input_open_error : public std::runtime_error {
+public:
+    explicit input_open_error(const std::string& message)
+        : std::runtime_error(message) {}
+};
+
+// Render the input file of options and write the PNG to its output file, as
+// well as the images of its extra outputs, all from one decode of the input.
+// With a tiles directory, writes the tile pyramid of the input there instead.
+// Streamed input is read in a single pass, see compute_waveform_spans_streaming.
+// The images are never held in memory as a whole: the waveform is reduced
+// into spans, which are rasterized and encoded in strips. Callers rendering
+// many files can pass the same data to reuse its storage. Returns false if
+// cancelled through progress_callback.
+bool render_file(
+    const Options& options,
+    std::vector<waveform_data>& data,
+    progress_callback_t progress_callback
+);
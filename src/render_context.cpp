@@ -0,0 +1,235 @@
+#include "render_context.hpp"
+
+#include <sndfile.hh>
+#include <png++/png.hpp>
+#include <stdexcept>
+#include <sys/stat.h>
+
+#include "mapped_pcm.hpp"
+#include "png_writer.hpp"
+#include "wav2png.hpp"
+
+static_assert(sizeof(png::rgba_pixel) == 4, "pixels are drawn into caller buffers as 4 bytes");
+
+namespace wav2png {
+
+namespace {
+
+png::rgba_pixel to_pixel(std::uint32_t color) noexcept {
+    return png::rgba_pixel(
+        static_cast<png::byte>(color >> 24), static_cast<png::byte>(color >> 16),
+        static_cast<png::byte>(color >> 8), static_cast<png::byte>(color));
+}
+
+waveform_params to_params(const render_settings& settings) {
+    if (settings.width == 0 || settings.height == 0) {
+        throw std::invalid_argument("width and height must be greater than 0");
+    }
+    // Written to also reject NaN
+    if (!(settings.percentile_low >= 0.0f && settings.percentile_low < settings.percentile_high
+          && settings.percentile_high <= 100.0f)) {
+        throw std::invalid_argument("percentiles must be in range [0-100] and ascending");
+    }
+    if (!(settings.db_min < settings.db_max)) {
+        throw std::invalid_argument("db_min must be less than db_max");
+    }
+
+    waveform_params params;
+    params.width = settings.width;
+    params.height = settings.height;
+    params.use_db_scale = settings.db_scale;
+    params.db_min = settings.db_min;
+    params.db_max = settings.db_max;
+    params.line_only = settings.line_only;
+    params.percentile_low = settings.percentile_low;
+    params.percentile_high = settings.percentile_high;
+    params.rms_layer = settings.draw_rms;
+    return params;
+}
+
+pcm_format to_pcm_format(sample_format format) {
+    switch (format) {
+    case sample_format::s16: return pcm_format::s16;
+    case sample_format::s32: return pcm_format::s32;
+    case sample_format::f32: return pcm_format::f32;
+    }
+    throw std::invalid_argument("unknown sample format");
+}
+
+} // anonymous namespace
+
+struct RenderContext::state {
+    render_settings settings;
+
+    // Settings and result of the last render. The spans keep their storage
+    // from one render to the next.
+    render_settings rendered;
+    waveform_data data;
+    bool has_render = false;
+
+    std::unique_ptr<WaveformStream> stream;
+    std::vector<std::uint8_t> png;
+
+    // The layers of the last render, drawn like the command line does: the
+    // RMS band inside the envelope, but below a line
+    std::vector<waveform_layer> layers() const {
+        if (!has_render) {
+            throw std::logic_error("nothing has been rendered yet");
+        }
+
+        std::vector<waveform_layer> result{ { &data.spans, to_pixel(rendered.foreground_color) } };
+        if (!data.rms_spans.empty()) {
+            const waveform_layer rms{ &data.rms_spans, to_pixel(rendered.rms_color) };
+            result.insert(rendered.line_only ? result.begin() : result.end(), rms);
+        }
+        return result;
+    }
+
+    void begin_render() {
+        if (stream) {
+            throw std::logic_error("a render of pushed samples is still in progress");
+        }
+        has_render = false;
+        rendered = settings;
+    }
+
+    // Render a whole file that can seek, reading it in place if mapped
+    void render_path(const std::string& path) {
+        begin_render();
+        const waveform_params params = to_params(rendered);
+
+        SndfileHandle wav(path.c_str());
+        if (wav.error()) {
+            throw std::runtime_error("failed to open '" + path + "': " + wav.strError());
+        }
+
+        const std::unique_ptr<MappedPcmFile> mapped = MappedPcmFile::open(path, wav);
+        const reopen_callback_t reopen = [path]() {
+            return SndfileHandle(path.c_str());
+        };
+
+        compute_waveform_spans(wav, data, params, nullptr, rendered.threads, reopen, mapped.get());
+        has_render = true;
+    }
+
+    // Render input that cannot seek in a single pass
+    void render_stream(int fd) {
+        begin_render();
+        const waveform_params params = to_params(rendered);
+
+        SndfileHandle wav(fd, false);
+        if (wav.error()) {
+            throw std::runtime_error(std::string("failed to read audio: ") + wav.strError());
+        }
+
+        compute_waveform_spans_streaming(wav, data, params, nullptr);
+        has_render = true;
+    }
+};
+
+RenderContext::RenderContext(const render_settings& settings)
+    : state_(std::make_unique<state>()) {
+    state_->settings = settings;
+}
+
+RenderContext::~RenderContext() = default;
+RenderContext::RenderContext(RenderContext&&) noexcept = default;
+RenderContext& RenderContext::operator=(RenderContext&&) noexcept = default;
+
+const render_settings& RenderContext::settings() const noexcept {
+    return state_->settings;
+}
+
+void RenderContext::set_settings(const render_settings& settings) {
+    state_->settings = settings;
+}
+
+void RenderContext::render_file(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && !S_ISREG(st.st_mode)) {
+        throw std::invalid_argument("'" + path + "' is not a regular file, use render_fd for pipes");
+    }
+    state_->render_path(path);
+}
+
+void RenderContext::render_fd(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        throw std::invalid_argument("invalid file descriptor");
+    }
+
+    // A regular file is opened again through its descriptor, which gives it
+    // the mapping and the worker threads of a file given by name
+    if (S_ISREG(st.st_mode)) {
+        state_->render_path("/proc/self/fd/" + std::to_string(fd));
+    } else {
+        state_->render_stream(fd);
+    }
+}
+
+void RenderContext::begin_pcm(int channels, sample_format format) {
+    state_->begin_render();
+    state_->stream = std::make_unique<WaveformStream>(channels, to_pcm_format(format), to_params(state_->rendered));
+}
+
+void RenderContext::push_pcm(const std::int16_t* samples, std::size_t frames) {
+    if (!state_->stream) {
+        throw std::logic_error("samples pushed without begin_pcm");
+    }
+    state_->stream->push(samples, frames);
+}
+
+void RenderContext::push_pcm(const std::int32_t* samples, std::size_t frames) {
+    if (!state_->stream) {
+        throw std::logic_error("samples pushed without begin_pcm");
+    }
+    state_->stream->push(samples, frames);
+}
+
+void RenderContext::push_pcm(const float* samples, std::size_t frames) {
+    if (!state_->stream) {
+        throw std::logic_error("samples pushed without begin_pcm");
+    }
+    state_->stream->push(samples, frames);
+}
+
+void RenderContext::end_pcm() {
+    if (!state_->stream) {
+        throw std::logic_error("end_pcm without begin_pcm");
+    }
+    const std::unique_ptr<WaveformStream> stream = std::move(state_->stream);
+    stream->finish(state_->data);
+    state_->has_render = true;
+}
+
+std::uint64_t RenderContext::frames() const noexcept {
+    return state_->has_render ? static_cast<std::uint64_t>(state_->data.frames) : 0;
+}
+
+void RenderContext::draw(std::uint8_t* pixels, std::size_t stride) const {
+    const std::vector<waveform_layer> layers = state_->layers();
+    const png::rgba_pixel background = to_pixel(state_->rendered.background_color);
+
+    for (std::uint32_t y = 0; y < state_->rendered.height; ++y) {
+        auto* row = reinterpret_cast<png::rgba_pixel*>(pixels + y * stride);
+        rasterize_row(*layers.front().spans, y, background, layers.front().color, row);
+        for (std::size_t i = 1; i < layers.size(); ++i) {
+            paint_row(*layers[i].spans, y, layers[i].color, row);
+        }
+    }
+}
+
+const std::vector<std::uint8_t>& RenderContext::encode_png() {
+    png_settings settings;
+    settings.compact = state_->rendered.compact_png;
+    settings.level = state_->rendered.png_level;
+    if (settings.level < 0 || settings.level > 9) {
+        throw std::invalid_argument("png level must be in range [0-9]");
+    }
+
+    encode_waveform_png(
+        state_->png, state_->layers(), state_->rendered.height, to_pixel(state_->rendered.background_color), settings);
+    return state_->png;
+}
+
+} // namespace wav2png
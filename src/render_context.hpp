@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Embeddable interface of libwav2png, for rendering waveforms in-process
+// without the command line, temporary files or FIFOs. Only needs the standard
+// library; libsndfile and libpng are used internally.
+namespace wav2png {
+
+// Settings of a render. Colors are given as 0xRRGGBBAA.
+struct render_settings {
+    unsigned width = 1800;
+    unsigned height = 280;
+    std::uint32_t background_color = 0xefefefff;
+    std::uint32_t foreground_color = 0x000000ff;
+
+    // Also draw the RMS of each column in rms_color, inside the peaks
+    bool draw_rms = false;
+    std::uint32_t rms_color = 0x808080ff;
+
+    bool db_scale = false;
+    float db_min = -48.0f;
+    float db_max = 0.0f;
+    bool line_only = false;
+
+    // Fill between these percentiles of each column instead of between its
+    // minimum and maximum. Not available for streamed input (pipes and pushed
+    // samples).
+    float percentile_low = 0.0f;
+    float percentile_high = 100.0f;
+
+    // Threads reducing regular files, 0 uses one per CPU core
+    unsigned threads = 1;
+
+    // zlib level of encode_png (0-9). compact_png writes the smallest pixel
+    // format that holds the colors instead of always RGBA.
+    int png_level = 6;
+    bool compact_png = true;
+};
+
+// Formats of interleaved samples pushed into a render
+enum class sample_format {
+    s16,    // 16 bit integer
+    s32,    // left-justified 32 bit integer
+    f32     // float in [-1, 1]
+};
+
+// Renders waveforms one after another, keeping the buffers of the reduction
+// and of the encoded PNG between renders. Errors are raised as exceptions
+// derived from std::exception. A context must not be used by several threads
+// at once; use one context per thread.
+class RenderContext {
+public:
+    explicit RenderContext(const render_settings& settings = render_settings());
+    ~RenderContext();
+
+    RenderContext(RenderContext&&) noexcept;
+    RenderContext& operator=(RenderContext&&) noexcept;
+
+    // Settings of the next render
+    const render_settings& settings() const noexcept;
+    void set_settings(const render_settings& settings);
+
+    // Render an audio file libsndfile can read, e.g. WAV, FLAC or Ogg.
+    // Uncompressed PCM files are memory-mapped and read in place.
+    void render_file(const std::string& path);
+
+    // Render the audio read from fd, which stays open. A regular file is read
+    // whole, regardless of the position of fd; pipes and sockets are read in a
+    // single pass from their current position to their end.
+    void render_fd(int fd);
+
+    // Render interleaved frames pushed in blocks of any size. Memory use does
+    // not depend on the length of the input.
+    void begin_pcm(int channels, sample_format format);
+    void push_pcm(const std::int16_t* samples, std::size_t frames);
+    void push_pcm(const std::int32_t* samples, std::size_t frames);
+    void push_pcm(const float* samples, std::size_t frames);
+    void end_pcm();
+
+    // Frames of the input of the last render
+    std::uint64_t frames() const noexcept;
+
+    // Draw the last render into a caller-owned buffer of height rows of width
+    // pixels, 4 bytes each in the order red, green, blue, alpha. Rows start
+    // stride bytes apart.
+    void draw(std::uint8_t* pixels, std::size_t stride) const;
+
+    // Encode the last render as PNG. The buffer belongs to the context and is
+    // reused by the next call.
+    const std::vector<std::uint8_t>& encode_png();
+
+private:
+    struct state;
+    std::unique_ptr<state> state_;
+};
+
+} // namespace wav2png
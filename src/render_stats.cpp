@@ -0,0 +1,203 @@
+#include "render_stats.hpp"
+
+#include <atomic>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <sys/resource.h>
+
+namespace {
+
+std::atomic<bool> enabled{ false };
+
+// Nanoseconds per phase, and the counters
+std::atomic<std::int64_t> phase_wall[render_phase_count];
+std::atomic<std::int64_t> phase_cpu[render_phase_count];
+std::atomic<std::uint64_t> frames_reduced{ 0 };
+std::atomic<std::uint64_t> samples_reduced{ 0 };
+std::atomic<std::uint64_t> mapped_bytes{ 0 };
+std::atomic<std::uint64_t> output_cache_hits{ 0 };
+std::atomic<std::uint64_t> output_cache_misses{ 0 };
+
+// Baselines taken by enable_render_stats
+std::int64_t start_wall = 0;
+std::int64_t start_cpu = 0;
+std::uint64_t start_read_bytes = 0;
+
+// Innermost running timer of the calling thread
+thread_local phase_timer* current_timer = nullptr;
+
+std::int64_t now_ns(clockid_t clock) noexcept {
+    timespec ts{};
+    clock_gettime(clock, &ts);
+    return static_cast<std::int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+double seconds(std::int64_t ns) noexcept {
+    return static_cast<double>(ns) * 1e-9;
+}
+
+// Bytes the process has read through read calls, including pipes and FIFOs
+std::uint64_t read_call_bytes() {
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    std::uint64_t value = 0;
+    while (io >> key >> value) {
+        if (key == "rchar:") {
+            return value;
+        }
+    }
+    return 0;
+}
+
+std::uint64_t peak_rss() noexcept {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;
+}
+
+} // anonymous namespace
+
+const char* render_phase_name(render_phase phase) noexcept {
+    switch (phase) {
+    case render_phase::open: return "open";
+    case render_phase::ffmpeg_start: return "ffmpeg_start";
+    case render_phase::decode: return "decode";
+    case render_phase::reduce: return "reduce";
+    case render_phase::rasterize: return "rasterize";
+    case render_phase::encode: return "encode";
+    default: return "unknown";
+    }
+}
+
+void enable_render_stats() {
+    start_wall = now_ns(CLOCK_MONOTONIC);
+    start_cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+    start_read_bytes = read_call_bytes();
+    enabled.store(true);
+}
+
+bool render_stats_enabled() noexcept {
+    return enabled.load(std::memory_order_relaxed);
+}
+
+render_stats collect_render_stats() {
+    render_stats stats;
+
+    for (std::size_t i = 0; i < render_phase_count; ++i) {
+        stats.phases[i].wall_seconds = seconds(phase_wall[i].load());
+        stats.phases[i].cpu_seconds = seconds(phase_cpu[i].load());
+    }
+
+    stats.wall_seconds = seconds(now_ns(CLOCK_MONOTONIC) - start_wall);
+    stats.cpu_seconds = seconds(now_ns(CLOCK_PROCESS_CPUTIME_ID) - start_cpu);
+    stats.frames = frames_reduced.load();
+    stats.samples = samples_reduced.load();
+    stats.bytes_read = read_call_bytes() - start_read_bytes + mapped_bytes.load();
+    stats.peak_rss_bytes = peak_rss();
+    stats.output_cache_hits = output_cache_hits.load();
+    stats.output_cache_misses = output_cache_misses.load();
+    return stats;
+}
+
+void count_reduced_frames(std::uint64_t frames, int channels) noexcept {
+    if (render_stats_enabled()) {
+        frames_reduced.fetch_add(frames, std::memory_order_relaxed);
+        samples_reduced.fetch_add(frames * static_cast<std::uint64_t>(channels), std::memory_order_relaxed);
+    }
+}
+
+void count_mapped_bytes(std::uint64_t bytes) noexcept {
+    if (render_stats_enabled()) {
+        mapped_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+}
+
+void count_output_cache_lookup(bool hit) noexcept {
+    if (render_stats_enabled()) {
+        (hit ? output_cache_hits : output_cache_misses).fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void write_render_stats(std::ostream& out, const render_stats& stats, bool json) {
+    const auto flags = out.flags();
+    const auto precision = out.precision();
+
+    if (json) {
+        out << std::fixed << std::setprecision(6)
+            << "{\"wall_seconds\": " << stats.wall_seconds
+            << ", \"cpu_seconds\": " << stats.cpu_seconds
+            << ", \"frames\": " << stats.frames
+            << ", \"samples\": " << stats.samples
+            << ", \"bytes_read\": " << stats.bytes_read
+            << ", \"samples_per_second\": " << std::setprecision(0) << stats.samples_per_second()
+            << ", \"peak_rss_bytes\": " << stats.peak_rss_bytes
+            << ", \"output_cache_hits\": " << stats.output_cache_hits
+            << ", \"output_cache_misses\": " << stats.output_cache_misses
+            << ", \"phases\": {" << std::setprecision(6);
+
+        for (std::size_t i = 0; i < render_phase_count; ++i) {
+            out << (i > 0 ? ", \"" : "\"") << render_phase_name(static_cast<render_phase>(i))
+                << "\": {\"wall_seconds\": " << stats.phases[i].wall_seconds
+                << ", \"cpu_seconds\": " << stats.phases[i].cpu_seconds << "}";
+        }
+        out << "}}\n";
+    } else {
+        out << std::fixed << std::setprecision(3)
+            << std::left << std::setw(14) << "phase" << std::right
+            << std::setw(10) << "wall s" << std::setw(10) << "cpu s" << "\n";
+
+        for (std::size_t i = 0; i < render_phase_count; ++i) {
+            out << std::left << std::setw(14) << render_phase_name(static_cast<render_phase>(i)) << std::right
+                << std::setw(10) << stats.phases[i].wall_seconds
+                << std::setw(10) << stats.phases[i].cpu_seconds << "\n";
+        }
+
+        out << std::left << std::setw(14) << "total" << std::right
+            << std::setw(10) << stats.wall_seconds << std::setw(10) << stats.cpu_seconds << "\n"
+            << "frames " << stats.frames << ", samples " << stats.samples
+            << ", bytes read " << stats.bytes_read << "\n"
+            << std::setprecision(1) << stats.samples_per_second() / 1e6 << " Msamples/s, peak RSS "
+            << stats.peak_rss_bytes / (1024 * 1024) << " MB\n";
+
+        if (stats.output_cache_hits + stats.output_cache_misses > 0) {
+            out << "output cache " << stats.output_cache_hits << " hits, "
+                << stats.output_cache_misses << " misses\n";
+        }
+    }
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
+phase_timer::phase_timer(render_phase phase) noexcept
+    : phase_(phase), active_(render_stats_enabled()) {
+    if (!active_) {
+        return;
+    }
+
+    outer_ = current_timer;
+    current_timer = this;
+    wall_start_ = now_ns(CLOCK_MONOTONIC);
+    cpu_start_ = now_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+phase_timer::~phase_timer() {
+    if (!active_) {
+        return;
+    }
+
+    const std::int64_t wall = now_ns(CLOCK_MONOTONIC) - wall_start_;
+    const std::int64_t cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start_;
+
+    const auto i = static_cast<std::size_t>(phase_);
+    phase_wall[i].fetch_add(wall - inner_wall_, std::memory_order_relaxed);
+    phase_cpu[i].fetch_add(cpu - inner_cpu_, std::memory_order_relaxed);
+
+    current_timer = outer_;
+    if (outer_) {
+        outer_->inner_wall_ += wall;
+        outer_->inner_cpu_ += cpu;
+    }
+}
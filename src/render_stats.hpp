@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// Phases of rendering that are timed for --stats
+enum class render_phase {
+    open,           // opening, probing and mapping the input
+    ffmpeg_start,   // starting ffmpeg until it delivers audio
+    decode,         // reading samples, including waiting for them
+    reduce,         // reducing samples into columns and spans
+    rasterize,
+    encode,         // compressing and writing the output
+    count
+};
+
+constexpr std::size_t render_phase_count = static_cast<std::size_t>(render_phase::count);
+
+const char* render_phase_name(render_phase phase) noexcept;
+
+// Time spent in a phase, summed over all threads. Phases running on several
+// threads at once can take more time than has passed.
+struct phase_time {
+    double wall_seconds = 0.0;
+    double cpu_seconds = 0.0;
+};
+
+// Statistics of all renders of the process since enable_render_stats()
+struct render_stats {
+    phase_time phases[render_phase_count];
+
+    // Time passed and CPU time of the whole process
+    double wall_seconds = 0.0;
+    double cpu_seconds = 0.0;
+
+    // Frames and samples reduced, and bytes read from inputs, through read
+    // calls and from mappings
+    std::uint64_t frames = 0;
+    std::uint64_t samples = 0;
+    std::uint64_t bytes_read = 0;
+
+    std::uint64_t peak_rss_bytes = 0;
+
+    // Lookups in the output cache
+    std::uint64_t output_cache_hits = 0;
+    std::uint64_t output_cache_misses = 0;
+
+    double samples_per_second() const noexcept {
+        return wall_seconds > 0.0 ? static_cast<double>(samples) / wall_seconds : 0.0;
+    }
+};
+
+// Start collecting statistics. Until then, timers and counters cost a single
+// check of a flag.
+void enable_render_stats();
+
+bool render_stats_enabled() noexcept;
+
+render_stats collect_render_stats();
+
+// Count frames of channels channels as reduced
+void count_reduced_frames(std::uint64_t frames, int channels) noexcept;
+
+// Count bytes read from a mapping, which read calls do not see
+void count_mapped_bytes(std::uint64_t bytes) noexcept;
+
+// Count a lookup in the output cache
+void count_output_cache_lookup(bool hit) noexcept;
+
+// Write stats as a table, or as a single line of JSON
+void write_render_stats(std::ostream& out, const render_stats& stats, bool json);
+
+// Times the phase of the enclosing scope on the calling thread. Timers nest:
+// the time of an inner timer is counted for its phase only, not for the one
+// of the outer timer. Time it per chunk of work, never per sample or pixel.
+class phase_timer {
+public:
+    explicit phase_timer(render_phase phase) noexcept;
+    ~phase_timer();
+
+    phase_timer(const phase_timer&) = delete;
+    phase_timer& operator=(const phase_timer&) = delete;
+
+private:
+    render_phase phase_;
+    bool active_;
+    phase_timer* outer_ = nullptr;
+    std::int64_t wall_start_ = 0;
+    std::int64_t cpu_start_ = 0;
+    std::int64_t inner_wall_ = 0;
+    std::int64_t inner_cpu_ = 0;
+};
@@ -0,0 +1,323 @@
+#include "serve.hpp"
+
+#include <boost/program_options/parsers.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "render.hpp"
+
+namespace {
+
+// Longest request line accepted, and how long a client may take to send it
+constexpr std::size_t max_request_bytes = 64 * 1024;
+constexpr int request_timeout_seconds = 10;
+
+// Closes a file descriptor when going out of scope
+class scoped_fd {
+public:
+    explicit scoped_fd(int fd) noexcept : fd_(fd) {}
+    ~scoped_fd() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    scoped_fd(const scoped_fd&) = delete;
+    scoped_fd& operator=(const scoped_fd&) = delete;
+
+    int get() const noexcept { return fd_; }
+
+private:
+    int fd_;
+};
+
+// Accepted connections waiting for a worker
+class connection_queue {
+public:
+    void push(int fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        connections_.push_back(fd);
+        not_empty_.notify_one();
+    }
+
+    // Wait for the next connection. Returns false once the queue is closed
+    // and empty.
+    bool pop(int& fd) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return !connections_.empty() || closed_; });
+        if (connections_.empty()) {
+            return false;
+        }
+        fd = connections_.front();
+        connections_.pop_front();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+private:
+    std::deque<int> connections_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+};
+
+// Tab separated status lines on stdout, one per request, like in batch mode
+class request_log {
+public:
+    void ok(const std::string& input, const std::string& output) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::cout << "ok\t" << input << '\t' << output << std::endl;
+        ++succeeded_;
+    }
+
+    void error(const std::string& input, const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::cout << "error\t" << input << '\t' << message << std::endl;
+        ++failed_;
+    }
+
+    void cancelled(const std::string& input) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::cout << "cancelled\t" << input << std::endl;
+        ++cancelled_;
+    }
+
+    std::size_t succeeded() const { return succeeded_; }
+    std::size_t failed() const { return failed_; }
+    std::size_t cancelled() const { return cancelled_; }
+
+private:
+    std::mutex mutex_;
+    std::size_t succeeded_ = 0;
+    std::size_t failed_ = 0;
+    std::size_t cancelled_ = 0;
+};
+
+sockaddr_un socket_address(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("invalid socket path '" + path + "'");
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+// Listen on path, replacing a socket file left behind by a server that is no
+// longer running. Descriptors are close-on-exec, so ffmpeg processes do not
+// keep connections open.
+int listen_on(const std::string& path) {
+    const sockaddr_un address = socket_address(path);
+    const auto* addr = reinterpret_cast<const sockaddr*>(&address);
+
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            throw std::runtime_error("'" + path + "' exists and is not a socket");
+        }
+        scoped_fd probe(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        if (connect(probe.get(), addr, sizeof(address)) == 0) {
+            throw std::runtime_error("another server is listening on '" + path + "'");
+        }
+        unlink(path.c_str());
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, addr, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        const std::string message = strerror(errno);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        throw std::runtime_error("failed to listen on '" + path + "': " + message);
+    }
+    return fd;
+}
+
+// Read the request line of a connection. Returns false if the client sends
+// nothing, too much or takes too long.
+bool read_request(int fd, std::string& line) {
+    const timeval timeout{ request_timeout_seconds, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    line.clear();
+    char buffer[4096];
+    while (line.size() < max_request_bytes) {
+        const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n == 0 && !line.empty();
+        }
+
+        line.append(buffer, static_cast<std::size_t>(n));
+        const auto end = line.find('\n');
+        if (end != std::string::npos) {
+            line.resize(end);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void send_reply(int fd, const std::string& reply) {
+    std::size_t sent = 0;
+    while (sent < reply.size()) {
+        const ssize_t n = send(fd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        sent += static_cast<std::size_t>(n);
+    }
+}
+
+// True once the client has closed its end of the connection. A client that
+// only shut down writing after its request still waits for the reply.
+bool client_hung_up(int fd) {
+    pollfd connection{ fd, 0, 0 };
+    return poll(&connection, 1, 0) > 0 && (connection.revents & (POLLHUP | POLLERR));
+}
+
+void serve_connection(const Options& options, int fd, std::vector<waveform_data>& data, request_log& log) {
+    std::string line;
+    if (!read_request(fd, line)) {
+        return;
+    }
+
+    const auto args = boost::program_options::split_unix(line);
+    const std::string input = args.empty() ? line : args.front();
+    std::string reply;
+
+    try {
+        if (args.empty()) {
+            throw std::runtime_error("empty request");
+        }
+
+        const Options request(options, args);
+        if (request.input_file_name == "-") {
+            throw std::runtime_error("the server cannot render its standard input");
+        }
+
+        if (!render_file(request, data, [fd](int) { return !client_hung_up(fd); })) {
+            log.cancelled(input);
+            return;
+        }
+        log.ok(request.input_file_name, request.output_file_name);
+        reply = "ok\t" + request.input_file_name + '\t' + request.output_file_name + '\n';
+    } catch (const std::exception& e) {
+        log.error(input, e.what());
+        reply = "error\t" + input + '\t' + e.what() + '\n';
+    }
+
+    send_reply(fd, reply);
+}
+
+// Serve connections until the queue is closed, reusing the waveform storage
+// for all requests of this worker
+void server_worker(const Options& options, connection_queue& queue, request_log& log) {
+    std::vector<waveform_data> data;
+    int fd = -1;
+
+    while (queue.pop(fd)) {
+        scoped_fd connection(fd);
+        serve_connection(options, connection.get(), data, log);
+    }
+}
+
+} // anonymous namespace
+
+int run_server(const Options& options) {
+    // Shutdown signals are read from a signalfd by the accepting thread. They
+    // are blocked before the workers start, which inherit the mask.
+    sigset_t shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, nullptr);
+
+    scoped_fd signal_fd(signalfd(-1, &shutdown_signals, SFD_CLOEXEC));
+    if (signal_fd.get() < 0) {
+        throw std::runtime_error(std::string("failed to create signalfd: ") + strerror(errno));
+    }
+
+    scoped_fd listener(listen_on(options.serve_socket_name));
+
+    const unsigned jobs = options.jobs > 0
+        ? options.jobs
+        : std::max(1u, std::thread::hardware_concurrency());
+
+    connection_queue queue;
+    request_log log;
+
+    std::vector<std::thread> workers;
+    workers.reserve(jobs);
+    for (unsigned i = 0; i < jobs; ++i) {
+        workers.emplace_back(server_worker, std::cref(options), std::ref(queue), std::ref(log));
+    }
+
+    std::cerr << "serving on " << options.serve_socket_name << " with " << jobs << " workers" << std::endl;
+
+    for (;;) {
+        pollfd fds[2] = {
+            { listener.get(), POLLIN, 0 },
+            { signal_fd.get(), POLLIN, 0 }
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error: poll failed: " << strerror(errno) << std::endl;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            const int fd = accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                queue.push(fd);
+            }
+        }
+    }
+
+    // Stop accepting, then serve the requests already accepted
+    unlink(options.serve_socket_name.c_str());
+    queue.close();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    std::cerr << log.succeeded() << " requests rendered, " << log.failed() << " failed, "
+              << log.cancelled() << " cancelled" << std::endl;
+
+    return 0;
+}
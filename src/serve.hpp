@@ -0,0 +1,19 @@
+#pragma once
+
+#include "options.hpp"
+
+// Serve render requests on the Unix socket of options until SIGINT or
+// SIGTERM, keeping one process with its options, ffmpeg probe and worker
+// pool warm between requests. Requests are rendered on a pool of options.jobs
+// workers.
+//
+// A client connects, writes one request line and reads one reply line, then
+// the server closes the connection. The request line has the syntax of a
+// batch manifest line: an input file name, optionally followed by options
+// overriding the ones in options. Relative file names are resolved in the
+// working directory of the server. The reply is
+//   ok<TAB>input<TAB>output
+//   error<TAB>input<TAB>message
+// A client that hangs up before the reply cancels its render. Returns 0 after
+// all accepted requests have been served.
+int run_server(const Options& options);
@@ -1,13 +1,32 @@
 #include "wav2png.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 #include <sndfile.hh>
 #include <png++/png.hpp>
 
+#include "mapped_pcm.hpp"
+#include "peak_cache.hpp"
+#include "reduce_kernels.hpp"
+#include "render_stats.hpp"
+
 namespace {
 
 // Template metaprogramming to get value range of sample format T
@@ -19,6 +38,12 @@ struct sample_scale<short> {
     static constexpr unsigned short value = 1 << (sizeof(short) * 8 - 1);
 };
 
+// Wider integer PCM, left-justified to 32 bit
+template <>
+struct sample_scale<int> {
+    static constexpr double value = 2147483648.0;
+};
+
 template <>
 struct sample_scale<float> {
     static constexpr int value = 1;
@@ -41,178 +66,2753 @@ inline float map2range(float x, float in_min, float in_max, float out_min, float
     return std::clamp(mapped, out_min, out_max);
 }
 
-// Draw a vertical-ish line for line-only mode
-void draw_vertish_line(
-    png::image<png::rgba_pixel>& image,
-    int x0,
-    int y0,
-    int y1,
-    const png::rgba_pixel& color
-) {
-    const int ydiff = y1 - y0;
-    const int abs_ydiff = std::abs(ydiff);
-    const int sign = (ydiff == 0) ? 0 : (ydiff / abs_ydiff);
+// Statistics of the samples in a single column
+template <typename sample_type>
+struct column_stats {
+    sample_type min_val = 0;
+    sample_type max_val = 0;
+    sample_type median = 0;
+};
+
+// Maps the statistics of a column to pixel rows of an image of height h.
+// Specialized on the sample type and the scale, so that mapping a column does
+// not branch on either.
+template <typename sample_type, bool use_db_scale>
+class column_mapping {
+public:
+    column_mapping(unsigned h, float db_min, float db_max)
+        : h_(h), db_min_(db_min), db_max_(db_max) {}
+
+    std::uint32_t y1(sample_type min_val) const noexcept {
+        const float y1_float = use_db_scale
+            ? h_ / 2 - map2range(float2db(min_val / scale), db_min_, db_max_, 0.0f, h_ / 2.0f)
+            : map2range(min_val, -scale, 0.0f, 0.0f, h_ / 2.0f);
 
-    for (int dy = 0; dy <= abs_ydiff; ++dy) {
-        const int y = y0 + (sign * dy);
-        const int x = (dy < abs_ydiff / 2) ? x0 : x0 + 1;
-        image.set_pixel(x, y, color);
+        assert(y1_float > -1.0f && y1_float <= h_ / 2.0f);
+        return static_cast<std::uint32_t>(y1_float);
     }
-}
 
-} // anonymous namespace
+    std::uint32_t y2(sample_type max_val) const noexcept {
+        const float y2_float = use_db_scale
+            ? h_ / 2 + map2range(float2db(max_val / scale), db_min_, db_max_, 0.0f, h_ / 2.0f)
+            : map2range(max_val, 0.0f, scale, h_ / 2.0f, static_cast<float>(h_));
 
-void compute_waveform(
-    const SndfileHandle& wav,
-    png::image<png::rgba_pixel>& out_image,
-    const png::rgba_pixel& bg_color,
-    const png::rgba_pixel& fg_color,
+        assert(y2_float >= h_ / 2 && y2_float <= h_);
+        return static_cast<std::uint32_t>(y2_float);
+    }
+
+    std::uint32_t y_median(sample_type median) const noexcept {
+        const float y_median_float = use_db_scale
+            ? h_ / 2 + map2range(float2db(median / scale), db_min_, db_max_, 0.0f, h_ / 2.0f)
+            : map2range(median, -scale, scale, 0.0f, static_cast<float>(h_));
+
+        return static_cast<std::uint32_t>(y_median_float);
+    }
+
+private:
+    static constexpr float scale = static_cast<float>(sample_scale<sample_type>::value);
+
+    unsigned h_;
+    float db_min_;
+    float db_max_;
+};
+
+// Maps columns by evaluating column_mapping. The median is only mapped in
+// line-only mode.
+template <typename sample_type, bool use_db_scale, bool line_only>
+class direct_mapper {
+public:
+    static constexpr bool need_median = line_only;
+
+    direct_mapper(unsigned h, float db_min, float db_max) : mapping_(h, db_min, db_max) {}
+
+    column_extent operator()(const column_stats<sample_type>& stats) const noexcept {
+        column_extent extent;
+        extent.y1 = mapping_.y1(stats.min_val);
+        extent.y2 = mapping_.y2(stats.max_val);
+        if (need_median) {
+            extent.y_median = mapping_.y_median(stats.median);
+        }
+        return extent;
+    }
+
+private:
+    column_mapping<sample_type, use_db_scale> mapping_;
+};
+
+// Sample-to-row tables of all 65536 16 bit values, so that mapping a column
+// is a lookup per value instead of up to three log10
+class row_tables {
+public:
+    template <bool use_db_scale>
+    void build(unsigned h, float db_min, float db_max, bool with_median) {
+        h_ = h;
+        db_min_ = db_min;
+        db_max_ = db_max;
+        use_db_scale_ = use_db_scale;
+        with_median_ = with_median;
+
+        const column_mapping<short, use_db_scale> mapping(h, db_min, db_max);
+
+        y1_.resize(size);
+        y2_.resize(size);
+        y_median_.resize(with_median ? size : 0);
+
+        for (int value = -32768; value <= 32767; ++value) {
+            const auto sample = static_cast<short>(value);
+            y1_[index(sample)] = mapping.y1(sample);
+            y2_[index(sample)] = mapping.y2(sample);
+            if (with_median) {
+                y_median_[index(sample)] = mapping.y_median(sample);
+            }
+        }
+    }
+
+    bool matches(unsigned h, float db_min, float db_max, bool use_db_scale, bool with_median) const noexcept {
+        return !y1_.empty() && h == h_ && db_min == db_min_ && db_max == db_max_
+            && use_db_scale == use_db_scale_ && (with_median_ || !with_median);
+    }
+
+    std::uint32_t y1(short value) const noexcept { return y1_[index(value)]; }
+    std::uint32_t y2(short value) const noexcept { return y2_[index(value)]; }
+    std::uint32_t y_median(short value) const noexcept { return y_median_[index(value)]; }
+
+private:
+    static constexpr std::size_t size = 65536;
+
+    static std::size_t index(short value) noexcept {
+        return static_cast<std::uint16_t>(value);
+    }
+
+    unsigned h_ = 0;
+    float db_min_ = 0.0f;
+    float db_max_ = 0.0f;
+    bool use_db_scale_ = false;
+    bool with_median_ = false;
+
+    std::vector<std::uint32_t> y1_;
+    std::vector<std::uint32_t> y2_;
+    std::vector<std::uint32_t> y_median_;
+};
+
+// Maps columns of 16 bit samples through row_tables
+template <bool line_only>
+class table_mapper {
+public:
+    static constexpr bool need_median = line_only;
+
+    explicit table_mapper(const row_tables& tables) : tables_(&tables) {}
+
+    column_extent operator()(const column_stats<short>& stats) const noexcept {
+        column_extent extent;
+        extent.y1 = tables_->y1(stats.min_val);
+        extent.y2 = tables_->y2(stats.max_val);
+        if (need_median) {
+            extent.y_median = tables_->y_median(stats.median);
+        }
+        return extent;
+    }
+
+private:
+    const row_tables* tables_;
+};
+
+// Building the tables costs 65536 evaluations each, which pays off for wide
+// images in dB scale. Linear mapping is cheap enough to evaluate directly.
+constexpr std::size_t row_table_min_columns = 16384;
+
+// dB scale tables for a render. The tables of the last render on this thread
+// are reused, e.g. by batch renders of the same geometry.
+const row_tables& db_row_tables(unsigned h, float db_min, float db_max, bool line_only) {
+    thread_local row_tables tables;
+    if (!tables.matches(h, db_min, db_max, true, line_only)) {
+        tables.build<true>(h, db_min, db_max, line_only);
+    }
+    return tables;
+}
+
+// Invoke f with the column mapper for the sample type, scale and mode of a
+// render of the given number of columns
+template <typename sample_type, typename function_type>
+bool with_column_mapper(
+    std::size_t columns,
+    unsigned h,
     bool use_db_scale,
     float db_min,
     float db_max,
     bool line_only,
-    progress_callback_t progress_callback
+    function_type&& f
 ) {
-    using std::size_t;
+    if constexpr (std::is_same<sample_type, short>::value) {
+        if (use_db_scale && columns >= row_table_min_columns) {
+            const row_tables& tables = db_row_tables(h, db_min, db_max, line_only);
+            return line_only
+                ? f(table_mapper<true>(tables))
+                : f(table_mapper<false>(tables));
+        }
+    }
 
-    const auto h = out_image.get_height();
+    if (use_db_scale) {
+        return line_only
+            ? f(direct_mapper<sample_type, true, true>(h, db_min, db_max))
+            : f(direct_mapper<sample_type, true, false>(h, db_min, db_max));
+    }
+    return line_only
+        ? f(direct_mapper<sample_type, false, true>(h, db_min, db_max))
+        : f(direct_mapper<sample_type, false, false>(h, db_min, db_max));
+}
 
-    // Using short samples for performance
-    using sample_type = short;
+// Parameters of the reduction that stay the same for all columns. How columns
+// are mapped to rows is up to the mapper passed alongside.
+struct reduce_params {
+    // Frames [first_frame, first_frame + frame_count) of the input are
+    // reduced, frames_per_pixel per column
+    sf_count_t first_frame = 0;
+    sf_count_t frame_count = 0;
+    int frames_per_pixel = 1;
+
+    // Previews read columns longer than preview_frames() in preview_windows
+    // evenly spaced windows of preview_window_frames frames
+    sf_count_t preview_window_frames = 0;
+    int preview_windows = 0;
+
+    // Take the envelope from these percentiles instead of the extremes
+    bool use_percentiles = false;
+    float percentile_low = 0.0f;
+    float percentile_high = 100.0f;
+
+    // Map the RMS of every column, and collect these column_statistic values
+    bool rms_layer = false;
+    unsigned statistics = 0;
+
+    // Keep the unmapped columns, for deriving several images from them, with
+    // or without their medians
+    bool keep_raw = false;
+    bool raw_median = false;
 
-    // Handle cases where there aren't enough samples
-    png::image<png::rgba_pixel> small_image;
-    const bool not_enough_samples = wav.frames() < static_cast<sf_count_t>(out_image.get_width());
+    // Reduce each of these lanes into columns of its own, see
+    // waveform_params::lanes. None reduces all channels mixed.
+    std::vector<waveform_lane> lanes;
 
-    if (not_enough_samples) {
-        const auto frames = std::max<sf_count_t>(1, wav.frames());
-        small_image = png::image<png::rgba_pixel>(frames, out_image.get_height());
+    // True if the sums of the samples are needed, not just the extremes
+    bool need_moments() const noexcept {
+        return rms_layer || keep_raw || (statistics & (stat_peak | stat_mean | stat_rms | stat_clipped)) != 0;
     }
 
-    auto& image = not_enough_samples ? small_image : out_image;
-    assert(image.get_width() > 0);
+    // Frames read of a column at most, all of them unless previewing
+    sf_count_t preview_frames() const noexcept {
+        return preview_windows > 0 ? preview_window_frames * preview_windows : frames_per_pixel;
+    }
+};
+
+// Frames read of a column of a preview and the estimated error of its peak
+struct preview_column {
+    sf_count_t frames_read = 0;
+    float peak_error = 0.0f;
+};
 
-    const int frames_per_pixel = std::max(1, static_cast<int>(wav.frames() / image.get_width()));
-    const int samples_per_pixel = wav.channels() * frames_per_pixel;
-    const size_t progress_divisor = std::max<size_t>(1, image.get_width() / 100);
+// Unmapped column in sample units: the envelope, the median and what is
+// needed to merge the RMS of neighbouring columns. Doubles hold samples of
+// any type exactly.
+struct raw_column {
+    double min_val = 0.0;
+    double max_val = 0.0;
+    double median = 0.0;
+    double sum_sq = 0.0;
+    std::uint64_t samples = 0;
+};
 
-    // Buffer for samples from audio file
-    std::vector<sample_type> block(samples_per_pixel);
+// Reduced columns of a render, written by the workers at their column index
+struct reduced_columns {
+    reduced_columns(std::size_t width, const reduce_params& params)
+        : frames_per_column(params.frames_per_pixel),
+          extents(params.lanes.empty() ? width : 0),
+          rms_extents(params.rms_layer && params.lanes.empty() ? width : 0),
+          lane_extents(params.lanes.size(), std::vector<column_extent>(width)),
+          lane_rms_extents(params.rms_layer ? params.lanes.size() : 0, std::vector<column_extent>(width)),
+          statistics(params.statistics != 0 ? width : 0),
+          raw(params.keep_raw ? width : 0),
+          preview(params.preview_windows > 0 ? width : 0) {}
 
-    size_t y_median_last = 0;
+    sf_count_t frames_per_column;
+    std::vector<column_extent> extents;
+    std::vector<column_extent> rms_extents;
 
-    for (size_t x = 0; x < image.get_width(); ++x) {
-        // Read frames from audio file
-        auto& wav_mut = const_cast<SndfileHandle&>(wav);
-        const sf_count_t n = wav_mut.readf(block.data(), frames_per_pixel) * wav.channels();
-        assert(n <= static_cast<sf_count_t>(block.size()));
+    // Extents of every lane instead, if the render has lanes
+    std::vector<std::vector<column_extent>> lane_extents;
+    std::vector<std::vector<column_extent>> lane_rms_extents;
+    std::vector<column_statistics> statistics;
+    std::vector<raw_column> raw;
+    std::vector<preview_column> preview;
+};
 
-        // Find min and max values
-        sample_type min_val = 0;
-        sample_type max_val = 0;
+// Column statistics of the band drawn for an RMS value, an envelope of +-rms
+template <typename sample_type>
+column_stats<sample_type> rms_band(double rms) noexcept {
+    column_stats<sample_type> band;
+    band.max_val = static_cast<sample_type>(std::min<double>(rms, std::numeric_limits<sample_type>::max()));
+    band.min_val = static_cast<sample_type>(-band.max_val);
+    return band;
+}
+
+// Mapper of reductions that only keep raw columns
+template <typename sample_type>
+struct raw_mapper {
+    static constexpr bool need_median = false;
+
+    column_extent operator()(const column_stats<sample_type>&) const noexcept {
+        return column_extent();
+    }
+};
+
+// Keys of a sample type: unsigned integers in ascending order of value, which
+// the histogram counts. Keys of 16 bits are counted exactly; wider keys are
+// counted by their top 16 bits first, and the bin holding the requested rank
+// is then resolved by its low 16 bits.
+template <typename sample_type>
+struct histogram_keys {};
+
+template <>
+struct histogram_keys<short> {
+    static constexpr bool wide = false;
+
+    static std::uint32_t key(short value) noexcept {
+        return static_cast<std::uint32_t>(value + 32768);
+    }
+
+    static short value(std::uint32_t key) noexcept {
+        return static_cast<short>(static_cast<int>(key) - 32768);
+    }
+};
+
+template <>
+struct histogram_keys<int> {
+    static constexpr bool wide = true;
+
+    static std::uint32_t key(int value) noexcept {
+        return static_cast<std::uint32_t>(value) ^ 0x80000000u;
+    }
+
+    static int value(std::uint32_t key) noexcept {
+        return static_cast<int>(key ^ 0x80000000u);
+    }
+};
 
-        for (int i = 0; i < n; ++i) {
-            min_val = std::min(min_val, block[i]);
-            max_val = std::max(max_val, block[i]);
+// Float keys are their bit patterns, with the order of negative values
+// reversed, so that the bins get finer towards zero like the dB scale does.
+// NaN is counted as zero.
+template <>
+struct histogram_keys<float> {
+    static constexpr bool wide = true;
+
+    static std::uint32_t key(float value) noexcept {
+        if (value != value) {
+            value = 0.0f;
         }
+        std::uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        const std::uint32_t sign = static_cast<std::uint32_t>(static_cast<std::int32_t>(bits) >> 31);
+        return bits ^ (sign | 0x80000000u);
+    }
 
-        // Calculate median
-        std::nth_element(block.begin(), block.begin() + block.size() / 2, block.end());
-        const sample_type median = block[n / 2];
+    static float value(std::uint32_t key) noexcept {
+        const std::uint32_t bits = (key & 0x80000000u) ? key & 0x7fffffffu : ~key;
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+};
 
-        // Compute y-coordinates for waveform
-        const float y1_float = use_db_scale
-            ? h / 2 - map2range(
-                float2db(min_val / static_cast<float>(sample_scale<sample_type>::value)),
-                db_min, db_max, 0.0f, h / 2.0f
-            )
-            : map2range(
-                min_val,
-                -static_cast<float>(sample_scale<sample_type>::value),
-                0.0f, 0.0f, h / 2.0f
-            );
-
-        assert(y1_float >= 0 && y1_float <= h / 2);
-        const size_t y1 = static_cast<size_t>(y1_float);
+// Counting histogram of the samples of a column, giving the median and any
+// percentile exactly, without reordering or copying the samples. Bins are
+// grouped into 256 coarse bins, so that finding a rank scans at most 512
+// counters. For samples wider than 16 bits, a query takes a second pass over
+// the samples of the bin holding the rank.
+template <typename sample_type>
+class sample_histogram {
+    using keys = histogram_keys<sample_type>;
 
-        const float y2_float = use_db_scale
-            ? h / 2 + map2range(
-                float2db(max_val / static_cast<float>(sample_scale<sample_type>::value)),
-                db_min, db_max, 0.0f, h / 2.0f
-            )
-            : map2range(
-                max_val,
-                0.0f,
-                static_cast<float>(sample_scale<sample_type>::value),
-                h / 2.0f, static_cast<float>(h)
-            );
-
-        assert(y2_float >= h / 2 && y2_float <= h);
-        const size_t y2 = static_cast<size_t>(y2_float);
+public:
+    sample_histogram() : counts_(bins), coarse_(bins / fine_bins) {
+        if (keys::wide) {
+            low_counts_.resize(bins);
+            low_coarse_.resize(bins / fine_bins);
+        }
+    }
 
-        const float y_median_float = use_db_scale
-            ? h / 2 + map2range(
-                float2db(median / static_cast<float>(sample_scale<sample_type>::value)),
-                db_min, db_max, 0.0f, h / 2.0f
-            )
-            : map2range(
-                median,
-                -static_cast<float>(sample_scale<sample_type>::value),
-                static_cast<float>(sample_scale<sample_type>::value),
-                0.0f, static_cast<float>(h)
-            );
-
-        const size_t y_median = static_cast<size_t>(y_median_float);
-
-        if (line_only) {
-            // Fill background
-            for (size_t y = 0; y < h; ++y) {
-                image.set_pixel(x, y, bg_color);
-            }
-
-            // Draw line connecting median points
-            if (x != 0) {
-                draw_vertish_line(image, x - 1, y_median_last, y_median, fg_color);
-            }
-            y_median_last = y_median;
+    void add(const sample_type* samples, std::size_t n) noexcept {
+        for (std::size_t i = 0; i < n; ++i) {
+            const std::size_t bin = high_bits(keys::key(samples[i]));
+            ++counts_[bin];
+            ++coarse_[bin / fine_bins];
+        }
+        total_ += n;
+    }
+
+    // Reset after add(samples, n). Small columns are cleared bin by bin,
+    // large ones by clearing the coarse bins they touched.
+    void clear(const sample_type* samples, std::size_t n) noexcept {
+        if (n < bins / 16) {
+            for (std::size_t i = 0; i < n; ++i) {
+                counts_[high_bits(keys::key(samples[i]))] = 0;
+            }
+            std::fill(coarse_.begin(), coarse_.end(), 0);
         } else {
-            // Fill top background
-            for (size_t y = 0; y < y1; ++y) {
-                image.set_pixel(x, y, bg_color);
+            clear_bins(counts_, coarse_);
+        }
+        total_ = 0;
+    }
+
+    // Value below which percent of the samples[0..n) added lie. The 50th
+    // percentile is the same element std::nth_element selects at n / 2.
+    sample_type percentile(const sample_type* samples, std::size_t n, float percent) noexcept {
+        if (total_ == 0) {
+            return 0;
+        }
+        // In double, so that the median is exactly at n / 2 for columns of
+        // any length
+        auto rank = static_cast<std::size_t>(static_cast<double>(percent) / 100.0 * static_cast<double>(total_));
+        rank = std::min(rank, total_ - 1);
+
+        const std::size_t bin = find_rank(counts_, coarse_, rank);
+        if constexpr (!keys::wide) {
+            return keys::value(static_cast<std::uint32_t>(bin));
+        }
+
+        for (std::size_t i = 0; i < n; ++i) {
+            const std::uint32_t key = keys::key(samples[i]);
+            if (high_bits(key) == bin) {
+                const std::size_t low = key & 0xffffu;
+                ++low_counts_[low];
+                ++low_coarse_[low / fine_bins];
+            }
+        }
+        const std::size_t low = find_rank(low_counts_, low_coarse_, rank);
+        clear_bins(low_counts_, low_coarse_);
+
+        return keys::value(static_cast<std::uint32_t>(bin << 16 | low));
+    }
+
+private:
+    static constexpr std::size_t bins = 65536;
+    static constexpr std::size_t fine_bins = 256;
+
+    static std::size_t high_bits(std::uint32_t key) noexcept {
+        return keys::wide ? key >> 16 : key;
+    }
+
+    // Bin holding rank (0 = smallest), leaving the rank within that bin
+    static std::size_t find_rank(
+        const std::vector<std::uint32_t>& counts,
+        const std::vector<std::uint32_t>& coarse,
+        std::size_t& rank
+    ) noexcept {
+        std::size_t c = 0;
+        for (; c + 1 < coarse.size() && rank >= coarse[c]; ++c) {
+            rank -= coarse[c];
+        }
+
+        std::size_t bin = c * fine_bins;
+        for (; bin + 1 < (c + 1) * fine_bins && rank >= counts[bin]; ++bin) {
+            rank -= counts[bin];
+        }
+        return bin;
+    }
+
+    static void clear_bins(std::vector<std::uint32_t>& counts, std::vector<std::uint32_t>& coarse) noexcept {
+        for (std::size_t c = 0; c < coarse.size(); ++c) {
+            if (coarse[c] != 0) {
+                std::fill_n(counts.begin() + c * fine_bins, fine_bins, 0);
+                coarse[c] = 0;
             }
+        }
+    }
 
-            // Fill waveform
-            for (size_t y = y1; y < y2; ++y) {
-                image.set_pixel(x, y, fg_color);
+    std::vector<std::uint32_t> counts_;
+    std::vector<std::uint32_t> coarse_;
+    std::vector<std::uint32_t> low_counts_;
+    std::vector<std::uint32_t> low_coarse_;
+    std::size_t total_ = 0;
+};
+
+// Throw std::invalid_argument if one of lanes needs channels that an input of
+// the given number of channels does not have
+void check_lane_channels(const std::vector<waveform_lane>& lanes, int channels) {
+    for (const waveform_lane& lane : lanes) {
+        if (lane.source == lane_source::channel && (lane.channel < 0 || lane.channel >= channels)) {
+            throw std::invalid_argument(
+                "the input has no channel " + std::to_string(lane.channel + 1) + ", only "
+                + std::to_string(channels));
+        }
+        if ((lane.source == lane_source::mid || lane.source == lane_source::side) && channels < 2) {
+            throw std::invalid_argument("mid and side lanes need at least two channels");
+        }
+    }
+}
+
+// Splits the interleaved samples of a column into the signals of its lanes.
+// Stereo is split into both channels, mid and side at once by a vectorized
+// kernel. Other layouts gather the channels their lanes show one by one, and
+// take mid and side from the first two channels the same way as stereo.
+template <typename sample_type>
+class lane_splitter {
+public:
+    lane_splitter(const std::vector<waveform_lane>& lanes, int channels)
+        : lanes_(lanes), channels_(static_cast<std::size_t>(channels)), channel_(channels_) {
+        for (const waveform_lane& lane : lanes_) {
+            switch (lane.source) {
+            case lane_source::channel:
+                need_channel_.resize(channels_);
+                need_channel_[static_cast<std::size_t>(lane.channel)] = true;
+                break;
+            case lane_source::mid:
+            case lane_source::side:
+                need_stereo_ = true;
+                break;
+            case lane_source::downmix:
+                need_downmix_ = true;
+                break;
+            case lane_source::mix:
+                break;
             }
+        }
 
-            // Fill bottom background
-            for (size_t y = y2; y < h; ++y) {
-                image.set_pixel(x, y, bg_color);
+        // Stereo takes every signal from the kernel, mono needs no copies
+        if (channels_ == 2) {
+            need_stereo_ = need_stereo_ || need_downmix_ || !need_channel_.empty();
+            need_channel_.clear();
+            need_downmix_ = false;
+        } else if (channels_ == 1) {
+            need_channel_.clear();
+            need_downmix_ = false;
+        }
+        signals_.resize(lanes_.size());
+    }
+
+    // Split the n samples of a column. The signals of the lanes are valid
+    // until the next call.
+    void split(const sample_type* samples, std::size_t n) {
+        const std::size_t frames = n / channels_;
+
+        if (need_stereo_) {
+            const sample_type* stereo = samples;
+            if (channels_ > 2) {
+                pair_.resize(2 * frames);
+                for (std::size_t i = 0; i < frames; ++i) {
+                    pair_[2 * i] = samples[i * channels_];
+                    pair_[2 * i + 1] = samples[i * channels_ + 1];
+                }
+                stereo = pair_.data();
             }
+            channel_[0].resize(frames);
+            channel_[1].resize(frames);
+            mid_.resize(frames);
+            side_.resize(frames);
+            split_stereo(stereo, frames, channel_[0].data(), channel_[1].data(), mid_.data(), side_.data());
         }
 
-        // Report progress
-        if (x % progress_divisor == 0) {
-            if (progress_callback && !progress_callback(100 * x / image.get_width())) {
-                return;
+        for (std::size_t c = 0; c < need_channel_.size(); ++c) {
+            if (need_channel_[c] && !(need_stereo_ && c < 2)) {
+                channel_[c].resize(frames);
+                for (std::size_t i = 0; i < frames; ++i) {
+                    channel_[c][i] = samples[i * channels_ + c];
+                }
             }
         }
+
+        if (need_downmix_) {
+            downmix(samples, frames);
+        }
+
+        for (std::size_t i = 0; i < lanes_.size(); ++i) {
+            signals_[i] = signal(lanes_[i], samples, n, frames);
+        }
     }
 
-    // Final progress report
-    if (progress_callback && !progress_callback(100)) {
-        return;
+    // Samples of lane i and their number
+    const sample_type* samples(std::size_t i) const noexcept { return signals_[i].first; }
+    std::size_t size(std::size_t i) const noexcept { return signals_[i].second; }
+
+private:
+    using signal_type = std::pair<const sample_type*, std::size_t>;
+
+    signal_type signal(const waveform_lane& lane, const sample_type* samples, std::size_t n, std::size_t frames) const {
+        if (lane.source == lane_source::mix || channels_ == 1) {
+            return { samples, n };
+        }
+        switch (lane.source) {
+        case lane_source::channel:
+            return { channel_[static_cast<std::size_t>(lane.channel)].data(), frames };
+        case lane_source::mid:
+            return { mid_.data(), frames };
+        case lane_source::side:
+            return { side_.data(), frames };
+        default:
+            return { channels_ == 2 ? mid_.data() : downmix_.data(), frames };
+        }
+    }
+
+    // Mean of the channels of each frame, summed in a wider type
+    void downmix(const sample_type* samples, std::size_t frames) {
+        using sum_type = typename std::conditional<
+            std::is_floating_point<sample_type>::value, float, std::int64_t>::type;
+
+        downmix_.resize(frames);
+        const auto count = static_cast<sum_type>(channels_);
+        for (std::size_t i = 0; i < frames; ++i) {
+            sum_type sum = 0;
+            for (std::size_t c = 0; c < channels_; ++c) {
+                sum += samples[i * channels_ + c];
+            }
+            downmix_[i] = static_cast<sample_type>(sum / count);
+        }
+    }
+
+    std::vector<waveform_lane> lanes_;
+    std::size_t channels_;
+
+    std::vector<bool> need_channel_;
+    bool need_stereo_ = false;
+    bool need_downmix_ = false;
+
+    std::vector<std::vector<sample_type>> channel_;
+    std::vector<sample_type> pair_;
+    std::vector<sample_type> mid_;
+    std::vector<sample_type> side_;
+    std::vector<sample_type> downmix_;
+    std::vector<signal_type> signals_;
+};
+
+// Grow block to hold at least size samples and return its storage. Readers
+// that copy samples own such a block, so it lives only as long as the render.
+template <typename sample_type>
+sample_type* reserve_block(std::vector<sample_type>& block, std::size_t size) {
+    if (block.size() < size) {
+        block.resize(size);
+    }
+    return block.data();
+}
+
+// Reads consecutive columns through libsndfile
+template <typename sample_type>
+class sndfile_reader {
+public:
+    explicit sndfile_reader(const SndfileHandle& wav) : wav_(wav) {}
+
+    int channels() const { return wav_.channels(); }
+
+    // Read the next frame_count frames. Returns the samples, valid until the
+    // next read, and sets n to their number.
+    const sample_type* read(int frame_count, sf_count_t& n) {
+        sample_type* block = reserve_block(block_, static_cast<std::size_t>(frame_count) * wav_.channels());
+        n = wav_.readf(block, frame_count) * wav_.channels();
+        return block;
+    }
+
+private:
+    SndfileHandle wav_;
+    std::vector<sample_type> block_;
+};
+
+// Reads consecutive columns through libsndfile, decoding on a separate thread
+// that keeps a ring of chunks filled ahead of the reduction. Decoding (or an
+// ffmpeg process writing into a FIFO) and reducing thus overlap instead of
+// waiting for each other.
+template <typename sample_type>
+class prefetching_reader {
+public:
+    // Chunks hold a whole number of columns of frames_per_column frames, so
+    // that no column straddles two chunks
+    prefetching_reader(const SndfileHandle& wav, int frames_per_column)
+        : state_(new state(wav, frames_per_column)) {
+        state_->decoder = std::thread([s = state_.get()]() { s->decode(); });
+    }
+
+    ~prefetching_reader() {
+        if (state_) {
+            state_->stop();
+        }
+    }
+
+    prefetching_reader(prefetching_reader&&) = default;
+
+    int channels() const { return state_->channels; }
+
+    const sample_type* read(int frame_count, sf_count_t& n) {
+        return state_->next_column(frame_count, n);
     }
 
-    // Upscale small image if necessary (nearest neighbor)
-    if (not_enough_samples) {
-        for (size_t y = 0; y < out_image.get_height(); ++y) {
-            for (size_t x = 0; x < out_image.get_width(); ++x) {
-                const size_t xx = x * small_image.get_width() / out_image.get_width();
-                assert(xx < out_image.get_width());
-                out_image[y][x] = small_image[y][xx];
+private:
+    static constexpr std::size_t ring_size = 4;
+    static constexpr sf_count_t min_chunk_frames = 65536;
+
+    struct chunk {
+        std::vector<sample_type> samples;
+        sf_count_t frames = 0;
+    };
+
+    struct state {
+        state(const SndfileHandle& wav, int frames_per_column)
+            : wav(wav), channels(wav.channels()) {
+            const sf_count_t columns = std::max<sf_count_t>(1, min_chunk_frames / frames_per_column);
+            chunk_frames = columns * frames_per_column;
+            for (auto& c : ring) {
+                c.samples.resize(static_cast<std::size_t>(chunk_frames * channels));
+            }
+        }
+
+        // Decoder thread: fill free chunks until the end of the input
+        void decode() {
+            for (std::size_t i = 0;; i = (i + 1) % ring_size) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [&] { return filled < ring_size || stopped; });
+                    if (stopped) {
+                        return;
+                    }
+                }
+
+                chunk& c = ring[i];
+                {
+                    phase_timer timer(render_phase::decode);
+                    c.frames = wav.readf(c.samples.data(), chunk_frames);
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                ++filled;
+                changed.notify_all();
+
+                // libsndfile only returns short reads at the end of the input
+                if (c.frames < chunk_frames) {
+                    return;
+                }
+            }
+        }
+
+        const sample_type* next_column(int frame_count, sf_count_t& n) {
+            // Hand the current chunk back once it has been consumed
+            if (have_chunk && position == ring[current].frames && ring[current].frames == chunk_frames) {
+                std::lock_guard<std::mutex> lock(mutex);
+                --filled;
+                have_chunk = false;
+                current = (current + 1) % ring_size;
+                position = 0;
+                changed.notify_all();
+            }
+
+            if (!have_chunk) {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return filled > 0; });
+                have_chunk = true;
+            }
+
+            const chunk& c = ring[current];
+            const sf_count_t frames = std::min<sf_count_t>(frame_count, c.frames - position);
+            const sample_type* samples = c.samples.data() + position * channels;
+
+            position += frames;
+            n = frames * channels;
+            return samples;
+        }
+
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopped = true;
+                changed.notify_all();
             }
+            decoder.join();
+        }
+
+        SndfileHandle wav;
+        const int channels;
+        sf_count_t chunk_frames = 0;
+
+        chunk ring[ring_size];
+        std::size_t filled = 0;
+        bool stopped = false;
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::thread decoder;
+
+        // Consumer side, only touched by the reducing thread
+        std::size_t current = 0;
+        sf_count_t position = 0;
+        bool have_chunk = false;
+    };
+
+    std::unique_ptr<state> state_;
+};
+
+// Access to the samples of a mapped file as a sample type
+template <typename sample_type>
+struct mapped_samples {};
+
+template <>
+struct mapped_samples<short> {
+    static bool can_read(const MappedPcmFile& pcm) noexcept { return pcm.can_read_s16(); }
+    static const short* direct(const MappedPcmFile& pcm) noexcept { return pcm.samples_s16(); }
+
+    static void read(const MappedPcmFile& pcm, sf_count_t first_frame, sf_count_t frame_count, short* dest) noexcept {
+        pcm.read_s16(first_frame, frame_count, dest);
+    }
+};
+
+template <>
+struct mapped_samples<int> {
+    static bool can_read(const MappedPcmFile& pcm) noexcept { return pcm.can_read_s32(); }
+    static const int* direct(const MappedPcmFile& pcm) noexcept { return pcm.samples_s32(); }
+
+    static void read(const MappedPcmFile& pcm, sf_count_t first_frame, sf_count_t frame_count, int* dest) noexcept {
+        pcm.read_s32(first_frame, frame_count, dest);
+    }
+};
+
+template <>
+struct mapped_samples<float> {
+    static bool can_read(const MappedPcmFile& pcm) noexcept { return pcm.can_read_f32(); }
+    static const float* direct(const MappedPcmFile& pcm) noexcept { return pcm.samples_f32(); }
+
+    static void read(const MappedPcmFile& pcm, sf_count_t first_frame, sf_count_t frame_count, float* dest) noexcept {
+        pcm.read_f32(first_frame, frame_count, dest);
+    }
+};
+
+// Reads consecutive columns straight from a memory-mapped PCM file. Samples
+// already in sample_type are used in place, other encodings are converted
+// into a block of the reader.
+template <typename sample_type>
+class mapped_reader {
+public:
+    mapped_reader(const MappedPcmFile& pcm, sf_count_t first_frame)
+        : pcm_(&pcm), next_frame_(first_frame) {}
+
+    int channels() const { return pcm_->channels(); }
+
+    const sample_type* read(int frame_count, sf_count_t& n) {
+        const sf_count_t frames = std::clamp<sf_count_t>(pcm_->frames() - next_frame_, 0, frame_count);
+        const sample_type* samples = mapped_samples<sample_type>::direct(*pcm_);
+
+        if (samples) {
+            samples += next_frame_ * pcm_->channels();
+        } else {
+            sample_type* block = reserve_block(block_, static_cast<std::size_t>(frames * pcm_->channels()));
+            mapped_samples<sample_type>::read(*pcm_, next_frame_, frames, block);
+            samples = block;
+        }
+
+        next_frame_ += frames;
+        n = frames * pcm_->channels();
+        count_mapped_bytes(static_cast<std::uint64_t>(frames * pcm_->bytes_per_frame()));
+        return samples;
+    }
+
+private:
+    const MappedPcmFile* pcm_;
+    sf_count_t next_frame_;
+    std::vector<sample_type> block_;
+};
+
+// Reads frames at any position of a seekable input through libsndfile
+template <typename sample_type>
+class sndfile_window_source {
+public:
+    explicit sndfile_window_source(const SndfileHandle& wav) : wav_(wav) {}
+
+    int channels() const { return wav_.channels(); }
+
+    // Read up to frame_count frames from first_frame into dest. Returns the
+    // number of frames read.
+    sf_count_t read(sf_count_t first_frame, sf_count_t frame_count, sample_type* dest) {
+        if (wav_.seek(first_frame, SEEK_SET) != first_frame) {
+            return 0;
+        }
+        return wav_.readf(dest, frame_count);
+    }
+
+private:
+    SndfileHandle wav_;
+};
+
+// Reads frames at any position of a memory-mapped PCM file
+template <typename sample_type>
+class mapped_window_source {
+public:
+    explicit mapped_window_source(const MappedPcmFile& pcm) : pcm_(&pcm) {}
+
+    int channels() const { return pcm_->channels(); }
+
+    sf_count_t read(sf_count_t first_frame, sf_count_t frame_count, sample_type* dest) {
+        const sf_count_t frames = std::clamp<sf_count_t>(pcm_->frames() - first_frame, 0, frame_count);
+        const sample_type* samples = mapped_samples<sample_type>::direct(*pcm_);
+
+        if (samples) {
+            std::copy_n(samples + first_frame * pcm_->channels(), frames * pcm_->channels(), dest);
+        } else {
+            mapped_samples<sample_type>::read(*pcm_, first_frame, frames, dest);
         }
+        count_mapped_bytes(static_cast<std::uint64_t>(frames * pcm_->bytes_per_frame()));
+        return frames;
+    }
+
+private:
+    const MappedPcmFile* pcm_;
+};
+
+// Reads consecutive columns of a preview from a window source. Columns longer
+// than the preview budget of params are sampled: one window is read from the
+// middle of each of preview_windows equal parts of the column, the windows
+// following each other in a block of the reader. Shorter columns are read
+// whole.
+template <typename sample_type, typename source_type>
+class strided_reader {
+public:
+    strided_reader(source_type source, sf_count_t first_frame, const reduce_params& params)
+        : source_(std::move(source)),
+          next_frame_(first_frame),
+          window_frames_(params.preview_window_frames),
+          windows_(params.preview_windows) {}
+
+    int channels() const { return source_.channels(); }
+
+    const sample_type* read(int frame_count, sf_count_t& n) {
+        const sf_count_t first_frame = next_frame_;
+        next_frame_ += frame_count;
+
+        const sf_count_t block_frames = std::min<sf_count_t>(frame_count, window_frames_ * windows_);
+        sample_type* block = reserve_block(block_, static_cast<std::size_t>(block_frames * channels()));
+
+        if (frame_count <= window_frames_ * windows_) {
+            n = source_.read(first_frame, frame_count, block) * channels();
+            return block;
+        }
+
+        const sf_count_t part_frames = frame_count / windows_;
+        n = 0;
+        for (int w = 0; w < windows_; ++w) {
+            const sf_count_t window_first = first_frame + w * part_frames + (part_frames - window_frames_) / 2;
+            const sf_count_t frames = source_.read(window_first, window_frames_, block + n);
+            n += frames * channels();
+            if (frames < window_frames_) {
+                break;
+            }
+        }
+        return block;
+    }
+
+private:
+    source_type source_;
+    sf_count_t next_frame_;
+    sf_count_t window_frames_;
+    int windows_;
+    std::vector<sample_type> block_;
+};
+
+// Frames read of a column of column_frames frames, and the estimated error of
+// its peak if it was sampled in windows. The peaks of the windows are taken as
+// draws from a Gumbel distribution, whose scale follows from their spread; the
+// peak of all windows of the column then exceeds the one of the windows read
+// by the scale times the log of the ratio of their number. The estimate is
+// limited to the headroom left above the peak.
+template <typename sample_type>
+preview_column estimate_preview_column(
+    const sample_type* samples,
+    sf_count_t n,
+    sf_count_t column_frames,
+    const reduce_params& params,
+    int channels
+) {
+    preview_column column;
+    column.frames_read = n / channels;
+
+    const sf_count_t window_samples = params.preview_window_frames * channels;
+    if (column.frames_read >= column_frames || n != window_samples * params.preview_windows) {
+        return column;
+    }
+
+    constexpr double scale = static_cast<double>(sample_scale<sample_type>::value);
+    double peak = 0.0;
+    double sum = 0.0;
+    double sum_sq = 0.0;
+
+    for (int w = 0; w < params.preview_windows; ++w) {
+        sample_type min_val = 0;
+        sample_type max_val = 0;
+        minmax(samples + w * window_samples, static_cast<std::size_t>(window_samples), min_val, max_val);
+
+        const double window_peak = std::max(-static_cast<double>(min_val), static_cast<double>(max_val)) / scale;
+        peak = std::max(peak, window_peak);
+        sum += window_peak;
+        sum_sq += window_peak * window_peak;
+    }
+
+    const double windows = params.preview_windows;
+    const double variance = std::max(0.0, (sum_sq - sum * sum / windows) / (windows - 1.0));
+    const double gumbel_scale = std::sqrt(6.0 * variance) / M_PI;
+    const double growth = std::log(static_cast<double>(column_frames) / static_cast<double>(column.frames_read));
+
+    column.peak_error = static_cast<float>(std::min(gumbel_scale * growth, std::max(0.0, 1.0 - peak)));
+    return column;
+}
+
+// Find the envelope of the n samples of a column, from the extremes or the
+// percentiles of params, and its median and moments if needed
+template <typename sample_type>
+inline void reduce_samples(
+    const sample_type* samples,
+    std::size_t n,
+    const reduce_params& params,
+    bool need_median,
+    bool need_moments,
+    sample_histogram<sample_type>& histogram,
+    column_stats<sample_type>& stats,
+    sample_moments<sample_type>& moments
+) {
+    if (need_median || params.use_percentiles) {
+        histogram.add(samples, n);
+
+        if (need_median) {
+            stats.median = histogram.percentile(samples, n, 50.0f);
+        }
+
+        // The envelope always includes the zero line, like min and max
+        if (params.use_percentiles) {
+            stats.min_val = std::min<sample_type>(0, histogram.percentile(samples, n, params.percentile_low));
+            stats.max_val = std::max<sample_type>(0, histogram.percentile(samples, n, params.percentile_high));
+        }
+
+        histogram.clear(samples, n);
+    }
+
+    // Find min and max values, along with the sums if needed
+    if (need_moments) {
+        fold_moments(samples, n, moments);
+        if (!params.use_percentiles) {
+            stats.min_val = moments.min_val;
+            stats.max_val = moments.max_val;
+        }
+    } else if (!params.use_percentiles) {
+        minmax(samples, n, stats.min_val, stats.max_val);
+    }
+}
+
+// Reduce columns [x_begin, x_end) into columns, reading frames sequentially
+// from reader and mapping them with mapper. All statistics of a column are
+// taken from the block while it is in cache; with lanes, the block is split
+// into their signals there too. column_done is invoked after every column and
+// may return false to cancel. Returns false if cancelled.
+template <typename sample_type, typename reader_type, typename mapper_type>
+bool reduce_columns(
+    reader_type& reader,
+    std::size_t x_begin,
+    std::size_t x_end,
+    const reduce_params& params,
+    const mapper_type& mapper,
+    reduced_columns& columns,
+    const std::function<bool(std::size_t)>& column_done
+) {
+    using std::size_t;
+
+    // Histogram for the median and percentiles, kept per thread so that
+    // rendering many files does not reallocate it. Its size is fixed.
+    thread_local sample_histogram<sample_type> histogram;
+    const bool need_median = mapper_type::need_median || params.raw_median
+        || (params.statistics & stat_median) != 0;
+    const bool need_moments = params.need_moments();
+
+    // Lanes are mapped from their own signals, the mixed columns are only
+    // reduced for the statistics then
+    const bool has_lanes = !params.lanes.empty();
+    const bool reduce_mixed = !has_lanes || params.statistics != 0 || params.keep_raw;
+    std::unique_ptr<lane_splitter<sample_type>> splitter;
+    if (has_lanes) {
+        splitter = std::make_unique<lane_splitter<sample_type>>(params.lanes, reader.channels());
+    }
+
+    constexpr float scale = static_cast<float>(sample_scale<sample_type>::value);
+
+    phase_timer timer(render_phase::reduce);
+    std::uint64_t samples_read = 0;
+
+    for (size_t x = x_begin; x < x_end; ++x) {
+        // Read frames from audio file, the last column may end early
+        const sf_count_t column_first = static_cast<sf_count_t>(x) * params.frames_per_pixel;
+        const auto column_frames = static_cast<int>(std::clamp<sf_count_t>(
+            params.frame_count - column_first, 0, params.frames_per_pixel));
+
+        sf_count_t n = 0;
+        const sample_type* samples = nullptr;
+        {
+            phase_timer read_timer(render_phase::decode);
+            samples = reader.read(column_frames, n);
+        }
+        assert(n <= reader.channels() * params.preview_frames());
+        samples_read += static_cast<std::uint64_t>(n);
+
+        if (!columns.preview.empty()) {
+            columns.preview[x] = estimate_preview_column(samples, n, column_frames, params, reader.channels());
+        }
+
+        if (has_lanes) {
+            splitter->split(samples, static_cast<size_t>(n));
+
+            for (size_t lane = 0; lane < params.lanes.size(); ++lane) {
+                const size_t lane_n = splitter->size(lane);
+                column_stats<sample_type> stats;
+                sample_moments<sample_type> moments;
+                reduce_samples(
+                    splitter->samples(lane), lane_n, params, mapper_type::need_median, params.rms_layer,
+                    histogram, stats, moments);
+
+                columns.lane_extents[lane][x] = mapper(stats);
+                if (params.rms_layer) {
+                    const double count = std::max<double>(1.0, static_cast<double>(lane_n));
+                    columns.lane_rms_extents[lane][x] = mapper(rms_band<sample_type>(std::sqrt(moments.sum_sq / count)));
+                }
+            }
+        }
+
+        // All channels mixed, for the image without lanes and the statistics
+        if (reduce_mixed) {
+            column_stats<sample_type> stats;
+            sample_moments<sample_type> moments;
+            reduce_samples(samples, static_cast<size_t>(n), params, need_median, need_moments, histogram, stats, moments);
+
+            const double count = std::max<double>(1.0, static_cast<double>(n));
+            const double rms = std::sqrt(moments.sum_sq / count);
+
+            if (!has_lanes) {
+                columns.extents[x] = mapper(stats);
+                if (params.rms_layer) {
+                    columns.rms_extents[x] = mapper(rms_band<sample_type>(rms));
+                }
+            }
+
+            if (params.keep_raw) {
+                raw_column& raw = columns.raw[x];
+                raw.min_val = stats.min_val;
+                raw.max_val = stats.max_val;
+                raw.median = stats.median;
+                raw.sum_sq = moments.sum_sq;
+                raw.samples = static_cast<std::uint64_t>(n);
+            }
+
+            if (params.statistics != 0) {
+                column_statistics& out = columns.statistics[x];
+                out.samples = static_cast<std::uint64_t>(n);
+                if (params.statistics & stat_peak) {
+                    out.min_val = moments.min_val / scale;
+                    out.max_val = moments.max_val / scale;
+                }
+                if (params.statistics & stat_mean) {
+                    out.mean = static_cast<float>(moments.sum / count / scale);
+                }
+                if (params.statistics & stat_rms) {
+                    out.rms = static_cast<float>(rms / scale);
+                }
+                if (params.statistics & stat_median) {
+                    out.median = stats.median / scale;
+                }
+                if (params.statistics & stat_clipped) {
+                    out.clipped = moments.clipped;
+                }
+            }
+        }
+
+        if (column_done && !column_done(x)) {
+            count_reduced_frames(samples_read / reader.channels(), reader.channels());
+            return false;
+        }
+    }
+
+    count_reduced_frames(samples_read / reader.channels(), reader.channels());
+    return true;
+}
+
+// Reduce all columns using several workers, each with its own reader for a
+// contiguous column range, created by make_reader(first_frame, frame_count).
+// Progress is reported from the calling thread only. Returns false if
+// cancelled.
+template <typename sample_type, typename reader_type, typename mapper_type>
+bool reduce_columns_parallel(
+    const std::function<reader_type(sf_count_t, sf_count_t)>& make_reader,
+    unsigned threads,
+    std::size_t width,
+    const reduce_params& params,
+    const mapper_type& mapper,
+    reduced_columns& columns,
+    const progress_callback_t& progress_callback
+) {
+    using std::size_t;
+
+    // Create all readers up front, so that a failure can be reported before
+    // any work has been started
+    std::vector<reader_type> readers;
+    readers.reserve(threads);
+
+    const size_t columns_per_thread = (width + threads - 1) / threads;
+
+    // Rounding up may leave the last threads without columns
+    threads = static_cast<unsigned>((width + columns_per_thread - 1) / columns_per_thread);
+
+    for (unsigned t = 0; t < threads; ++t) {
+        const size_t x_begin = t * columns_per_thread;
+        const size_t x_end = std::min(width, x_begin + columns_per_thread);
+        const sf_count_t first_frame = static_cast<sf_count_t>(x_begin) * params.frames_per_pixel;
+        readers.push_back(make_reader(
+            params.first_frame + first_frame,
+            std::min<sf_count_t>(static_cast<sf_count_t>(x_end - x_begin) * params.frames_per_pixel,
+                                 params.frame_count - first_frame)));
+    }
+
+    std::atomic<size_t> columns_done{0};
+    std::atomic<bool> cancelled{false};
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable finished;
+    unsigned workers_running = 0;
+
+    // The first error of any thread cancels the others and is rethrown once
+    // all of them are joined
+    const auto fail = [&]() {
+        if (!error) {
+            error = std::current_exception();
+        }
+        cancelled = true;
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+
+    for (unsigned t = 0; t < threads; ++t) {
+        const size_t x_begin = std::min(width, t * columns_per_thread);
+        const size_t x_end = std::min(width, x_begin + columns_per_thread);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        try {
+            workers.emplace_back([&, t, x_begin, x_end]() {
+                try {
+                    reduce_columns<sample_type>(
+                        readers[t], x_begin, x_end, params, mapper, columns,
+                        [&](size_t) {
+                            columns_done.fetch_add(1, std::memory_order_relaxed);
+                            return !cancelled.load(std::memory_order_relaxed);
+                        }
+                    );
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    fail();
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                --workers_running;
+                finished.notify_one();
+            });
+            ++workers_running;
+        } catch (...) {
+            fail();
+            break;
+        }
+    }
+
+    // Report progress while the workers run
+    int last_percent = -1;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (workers_running > 0) {
+            finished.wait_for(lock, std::chrono::milliseconds(50));
+
+            const int percent = static_cast<int>(100 * columns_done.load() / width);
+            if (percent != last_percent && !cancelled) {
+                last_percent = percent;
+                try {
+                    if (progress_callback && !progress_callback(percent)) {
+                        cancelled = true;
+                    }
+                } catch (...) {
+                    fail();
+                }
+            }
+        }
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return !cancelled;
+}
+
+// Reduce all columns with readers of the given type, on the calling thread or
+// in parallel. Returns false if cancelled.
+template <typename sample_type, typename reader_type, typename mapper_type>
+bool reduce_all_columns(
+    reader_type& reader,
+    const std::function<reader_type(sf_count_t, sf_count_t)>& make_reader,
+    unsigned threads,
+    std::size_t width,
+    const reduce_params& params,
+    const mapper_type& mapper,
+    reduced_columns& columns,
+    const progress_callback_t& progress_callback
+) {
+    using std::size_t;
+
+    if (threads > 1) {
+        return reduce_columns_parallel<sample_type>(
+            make_reader, threads, width, params, mapper, columns, progress_callback);
+    }
+
+    const size_t progress_divisor = std::max<size_t>(1, width / 100);
+
+    return reduce_columns<sample_type>(
+        reader, 0, width, params, mapper, columns,
+        [&](size_t x) {
+            // Report progress
+            if (x % progress_divisor == 0) {
+                return !progress_callback || progress_callback(100 * x / width);
+            }
+            return true;
+        }
+    );
+}
+
+// Previews sample columns in windows of about this many frames, at least two
+// per column so that the error of the peaks can be estimated
+constexpr sf_count_t preview_window_frames = 1024;
+constexpr sf_count_t max_preview_windows = 64;
+
+// Frames of the input reduced for waveform: its range, which must not be
+// empty if one was given. Sets params.first_frame and params.frame_count.
+sf_count_t plan_range(sf_count_t input_frames, const waveform_params& waveform, reduce_params& params) {
+    const sf_count_t frames = waveform.range_frames(input_frames);
+    if (waveform.has_range() && frames == 0) {
+        throw std::invalid_argument("the range to render is empty");
+    }
+
+    params.first_frame = std::min(waveform.start_frame, input_frames);
+    params.frame_count = frames;
+    return frames;
+}
+
+// Choose the number of columns to reduce for the range of waveform in an
+// input of the given length, fill in params and limit threads to something
+// useful. Returns the number of columns.
+std::size_t plan_reduction(
+    sf_count_t input_frames,
+    const waveform_params& waveform,
+    reduce_params& params,
+    unsigned& threads
+) {
+    using std::size_t;
+
+    const sf_count_t frames = plan_range(input_frames, waveform, params);
+    const unsigned out_width = waveform.width;
+    params.use_percentiles = waveform.use_percentiles();
+    params.percentile_low = waveform.percentile_low;
+    params.percentile_high = waveform.percentile_high;
+    params.rms_layer = waveform.rms_layer;
+    params.statistics = waveform.statistics;
+
+    // Handle cases where there aren't enough samples: reduce one column per
+    // frame, the rasterizer stretches them to the image width
+    const bool not_enough_samples = frames < static_cast<sf_count_t>(out_width);
+
+    const size_t width = not_enough_samples
+        ? static_cast<size_t>(std::max<sf_count_t>(1, frames))
+        : out_width;
+    assert(width > 0);
+
+    params.frames_per_pixel = std::max(1, static_cast<int>(frames / width));
+
+    if (waveform.preview_frames > 0 && params.frames_per_pixel > waveform.preview_frames) {
+        params.preview_windows = static_cast<int>(
+            std::clamp<sf_count_t>(waveform.preview_frames / preview_window_frames, 2, max_preview_windows));
+        params.preview_window_frames = std::max<sf_count_t>(1, waveform.preview_frames / params.preview_windows);
+    }
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<size_t>(threads, width));
+
+    return width;
+}
+
+// Turn the reduced columns of lanes into the layers of data. The lanes are
+// stacked from the top, rows left over at the bottom stay empty.
+void finish_lanes(const reduced_columns& columns, waveform_data& data, const waveform_params& waveform) {
+    const std::size_t lane_count = columns.lane_extents.size();
+    const auto lane_height = static_cast<std::uint32_t>(waveform.height / lane_count);
+
+    const auto lane_spans = [&](const std::vector<column_extent>& extents, bool line_only, std::size_t lane) {
+        std::vector<column_span> spans = build_spans(extents, waveform.width, lane_height, line_only);
+        const auto offset = static_cast<std::uint32_t>(lane * lane_height);
+        for (column_span& span : spans) {
+            span.y_begin += offset;
+            span.y_end += offset;
+        }
+        return spans;
+    };
+
+    data.lanes.resize(lane_count - 1);
+    for (std::size_t lane = 0; lane < lane_count; ++lane) {
+        std::vector<column_span>& spans = lane == 0 ? data.spans : data.lanes[lane - 1].spans;
+        std::vector<column_span>& rms_spans = lane == 0 ? data.rms_spans : data.lanes[lane - 1].rms_spans;
+
+        spans = lane_spans(columns.lane_extents[lane], waveform.line_only, lane);
+        rms_spans.clear();
+        if (!columns.lane_rms_extents.empty()) {
+            rms_spans = lane_spans(columns.lane_rms_extents[lane], false, lane);
+        }
+    }
+}
+
+// Resolve the lanes of waveform into params for an input of the given number
+// of channels. Returns the height of a lane, the whole image without lanes.
+unsigned plan_lanes(const waveform_params& waveform, int channels, reduce_params& params) {
+    if (!waveform.has_lanes()) {
+        return waveform.height;
+    }
+    params.lanes = resolve_lanes(waveform, channels);
+    return waveform.height / static_cast<unsigned>(params.lanes.size());
+}
+
+// Report completion and turn the reduced columns into the layers of data.
+// Returns false if cancelled.
+bool finish_spans(
+    reduced_columns& columns,
+    waveform_data& data,
+    const waveform_params& waveform,
+    sf_count_t frames,
+    const progress_callback_t& progress_callback
+) {
+    // Final progress report
+    if (progress_callback && !progress_callback(100)) {
+        return false;
+    }
+
+    phase_timer timer(render_phase::reduce);
+    data.lanes.clear();
+
+    if (columns.lane_extents.empty()) {
+        data.spans = build_spans(columns.extents, waveform.width, waveform.height, waveform.line_only);
+
+        // The RMS band is always filled, also below a line
+        data.rms_spans.clear();
+        if (!columns.rms_extents.empty()) {
+            data.rms_spans = build_spans(columns.rms_extents, waveform.width, waveform.height, false);
+        }
+    } else {
+        finish_lanes(columns, data, waveform);
+    }
+
+    data.columns = std::move(columns.statistics);
+    data.frames = frames;
+    data.frames_per_column = columns.frames_per_column;
+
+    data.frames_read = frames;
+    data.peak_error = 0.0f;
+    data.max_peak_error = 0.0f;
+    if (!columns.preview.empty()) {
+        double error_sum = 0.0;
+        data.frames_read = 0;
+        for (const preview_column& column : columns.preview) {
+            data.frames_read += column.frames_read;
+            data.max_peak_error = std::max(data.max_peak_error, column.peak_error);
+            error_sum += column.peak_error;
+        }
+        data.peak_error = static_cast<float>(error_sum / static_cast<double>(columns.preview.size()));
+    }
+    return true;
+}
+
+// Parameters of a render into out_image
+waveform_params make_waveform_params(
+    const png::image<png::rgba_pixel>& out_image,
+    bool use_db_scale,
+    float db_min,
+    float db_max,
+    bool line_only
+) {
+    waveform_params waveform;
+    waveform.width = out_image.get_width();
+    waveform.height = out_image.get_height();
+    waveform.use_db_scale = use_db_scale;
+    waveform.db_min = db_min;
+    waveform.db_max = db_max;
+    waveform.line_only = line_only;
+    return waveform;
+}
+
+// Advance wav to first_frame. Inputs that cannot seek, like ffmpeg FIFOs, are
+// read up to it.
+void seek_input(SndfileHandle& wav, sf_count_t first_frame) {
+    if (first_frame == 0 || wav.seek(first_frame, SEEK_SET) == first_frame) {
+        return;
+    }
+
+    constexpr sf_count_t chunk_frames = 65536;
+    std::vector<short> discarded(static_cast<std::size_t>(chunk_frames * wav.channels()));
+
+    for (sf_count_t left = first_frame; left > 0;) {
+        const sf_count_t n = wav.readf(discarded.data(), std::min(left, chunk_frames));
+        if (n <= 0) {
+            break;
+        }
+        left -= n;
+    }
+}
+
+// Invoke f with a value of the type wav is reduced in: the type libsndfile
+// decodes its format to without loss. 8 and 16 bit formats are read as short,
+// wider integer formats as left-justified int, and floating point formats as
+// float, which libsndfile returns unscaled.
+template <typename function_type>
+bool with_native_sample_type(const SndfileHandle& wav, function_type&& f) {
+    switch (wav.format() & SF_FORMAT_SUBMASK) {
+    case SF_FORMAT_PCM_24:
+    case SF_FORMAT_PCM_32:
+    case SF_FORMAT_DWVW_24:
+    case SF_FORMAT_ALAC_20:
+    case SF_FORMAT_ALAC_24:
+    case SF_FORMAT_ALAC_32:
+        return f(int());
+    case SF_FORMAT_FLOAT:
+    case SF_FORMAT_DOUBLE:
+    case SF_FORMAT_VORBIS:
+        return f(float());
+    default:
+        return f(short());
+    }
+}
+
+// Reduce the columns of a preview of wav with mapper, sampling them in windows
+// read from mapped if given, or else through seeks. Workers read through
+// handles of their own, obtained through reopen.
+template <typename sample_type, typename mapper_type>
+bool reduce_preview(
+    const SndfileHandle& wav,
+    std::size_t width,
+    const reduce_params& params,
+    const mapper_type& mapper,
+    reduced_columns& columns,
+    const progress_callback_t& progress_callback,
+    unsigned threads,
+    const reopen_callback_t& reopen,
+    const MappedPcmFile* mapped
+) {
+    if (mapped) {
+        mapped->advise_sparse_reads();
+
+        using reader_type = strided_reader<sample_type, mapped_window_source<sample_type>>;
+        reader_type reader(mapped_window_source<sample_type>(*mapped), params.first_frame, params);
+
+        return reduce_all_columns<sample_type, reader_type>(
+            reader,
+            [mapped, &params](sf_count_t first_frame, sf_count_t) {
+                return reader_type(mapped_window_source<sample_type>(*mapped), first_frame, params);
+            },
+            threads, width, params, mapper, columns, progress_callback
+        );
+    }
+
+    using reader_type = strided_reader<sample_type, sndfile_window_source<sample_type>>;
+    reader_type reader(sndfile_window_source<sample_type>(wav), params.first_frame, params);
+
+    return reduce_all_columns<sample_type, reader_type>(
+        reader,
+        [&reopen, &params](sf_count_t first_frame, sf_count_t) {
+            SndfileHandle handle = reopen();
+            if (!handle || handle.error()) {
+                throw std::runtime_error("failed to open worker handle for parallel rendering");
+            }
+            return reader_type(sndfile_window_source<sample_type>(handle), first_frame, params);
+        },
+        reopen ? threads : 1, width, params, mapper, columns, progress_callback
+    );
+}
+
+// Reduce wav into columns with mapper, see compute_waveform_spans. Limits
+// threads to 1 if the input cannot be read by several workers.
+template <typename sample_type, typename mapper_type>
+bool reduce_input(
+    const SndfileHandle& wav,
+    std::size_t width,
+    const reduce_params& params,
+    const mapper_type& mapper,
+    reduced_columns& columns,
+    const progress_callback_t& progress_callback,
+    unsigned threads,
+    const reopen_callback_t& reopen,
+    const MappedPcmFile* mapped
+) {
+    // Workers need their own handles, which requires a seekable input
+    const bool use_mapping = mapped && mapped_samples<sample_type>::can_read(*mapped);
+    auto& wav_mut = const_cast<SndfileHandle&>(wav);
+    const bool seekable = wav_mut.seek(0, SEEK_CUR) >= 0;
+
+    if (params.preview_windows > 0) {
+        if (use_mapping || seekable) {
+            return reduce_preview<sample_type>(
+                wav, width, params, mapper, columns, progress_callback, threads, reopen,
+                use_mapping ? mapped : nullptr);
+        }
+
+        // Inputs that cannot seek are read whole
+        reduce_params whole = params;
+        whole.preview_windows = 0;
+        return reduce_input<sample_type>(
+            wav, width, whole, mapper, columns, progress_callback, threads, reopen, mapped);
+    }
+
+    if (!use_mapping && threads > 1 && (!reopen || !seekable)) {
+        threads = 1;
+    }
+
+    if (use_mapping) {
+        // Workers read their ranges straight from the mapping
+        mapped_reader<sample_type> reader(*mapped, params.first_frame);
+
+        return reduce_all_columns<sample_type, mapped_reader<sample_type>>(
+            reader,
+            [mapped](sf_count_t first_frame, sf_count_t) { return mapped_reader<sample_type>(*mapped, first_frame); },
+            threads, width, params, mapper, columns, progress_callback
+        );
+    }
+
+    if (threads > 1) {
+        sndfile_reader<sample_type> reader(wav);
+
+        return reduce_all_columns<sample_type, sndfile_reader<sample_type>>(
+            reader,
+            [&reopen](sf_count_t first_frame, sf_count_t) {
+                SndfileHandle handle = reopen();
+                if (!handle || handle.error() || handle.seek(first_frame, SEEK_SET) != first_frame) {
+                    throw std::runtime_error("failed to open worker handle for parallel rendering");
+                }
+                return sndfile_reader<sample_type>(handle);
+            },
+            threads, width, params, mapper, columns, progress_callback
+        );
+    }
+
+    // Single handle: decode ahead on a separate thread
+    seek_input(wav_mut, params.first_frame);
+    prefetching_reader<sample_type> reader(wav, params.frames_per_pixel);
+
+    return reduce_all_columns<sample_type, prefetching_reader<sample_type>>(
+        reader, nullptr, 1, width, params, mapper, columns, progress_callback
+    );
+}
+
+// Reads consecutive columns from a segment of an input, like sndfile_reader.
+// The length of inputs decoded in segments is only estimated, so the last
+// segment is opened to the end of the input, and given its expected length
+// in end_frames. Once the column_frames frames of its columns have been
+// read, it checks that the segment holds exactly end_frames frames, and sets
+// length_mismatch if it does not.
+template <typename sample_type>
+class segment_reader {
+public:
+    segment_reader(
+        const SndfileHandle& wav,
+        sf_count_t column_frames,
+        sf_count_t end_frames,
+        std::atomic<bool>& length_mismatch
+    )
+        : wav_(wav),
+          column_frames_(column_frames),
+          end_frames_(end_frames),
+          length_mismatch_(&length_mismatch) {}
+
+    int channels() const { return wav_.channels(); }
+
+    const sample_type* read(int frame_count, sf_count_t& n) {
+        sample_type* block = reserve_block(block_, static_cast<std::size_t>(frame_count) * wav_.channels());
+        const sf_count_t frames = wav_.readf(block, frame_count);
+        n = frames * wav_.channels();
+        frames_read_ += frames;
+
+        if (end_frames_ >= 0) {
+            if (frames < frame_count) {
+                *length_mismatch_ = true;
+            } else if (frames_read_ == column_frames_) {
+                check_end();
+            }
+        }
+        return block;
+    }
+
+private:
+    // Read the frames past the columns, and one more to find out whether the
+    // segment ends where expected
+    void check_end() {
+        constexpr sf_count_t tail_frames = 4096;
+        std::vector<sample_type> tail(static_cast<std::size_t>(tail_frames * wav_.channels()));
+
+        sf_count_t left = end_frames_ - frames_read_ + 1;
+        while (left > 0) {
+            const sf_count_t chunk = std::min(left, tail_frames);
+            const sf_count_t frames = wav_.readf(tail.data(), chunk);
+            frames_read_ += frames;
+            left -= frames;
+            if (frames < chunk) {
+                break;
+            }
+        }
+        if (frames_read_ != end_frames_) {
+            *length_mismatch_ = true;
+        }
+    }
+
+    SndfileHandle wav_;
+    sf_count_t column_frames_;
+    sf_count_t end_frames_;
+    std::atomic<bool>* length_mismatch_;
+    sf_count_t frames_read_ = 0;
+    std::vector<sample_type> block_;
+};
+
+// Reduce segments opened through open_segment into columns with mapper, see
+// compute_waveform_spans_segmented
+template <typename sample_type, typename mapper_type>
+bool reduce_segments(
+    const segment_callback_t& open_segment,
+    std::size_t width,
+    const reduce_params& params,
+    const mapper_type& mapper,
+    reduced_columns& columns,
+    const progress_callback_t& progress_callback,
+    unsigned threads,
+    bool open_ended
+) {
+    // Segments are decoded whole, there is nothing to seek in for previews
+    reduce_params whole = params;
+    whole.preview_windows = 0;
+
+    // Every worker reads its column range from its own segment, even with a
+    // single thread, as there is no handle onto the whole input. A range that
+    // reaches the estimated end of the input is read to its actual end.
+    const sf_count_t columns_end = params.first_frame + static_cast<sf_count_t>(width) * params.frames_per_pixel;
+    const sf_count_t range_end = params.first_frame + params.frame_count;
+    std::atomic<bool> length_mismatch{false};
+
+    const bool completed = reduce_columns_parallel<sample_type, segment_reader<sample_type>>(
+        [&](sf_count_t first_frame, sf_count_t frame_count) {
+            const bool last = open_ended && first_frame + frame_count == columns_end;
+            SndfileHandle handle = open_segment(first_frame, last ? -1 : frame_count);
+            if (!handle || handle.error()) {
+                throw std::runtime_error("failed to open input segment for parallel rendering");
+            }
+            check_lane_channels(params.lanes, handle.channels());
+            return segment_reader<sample_type>(
+                handle, frame_count, last ? range_end - first_frame : -1, length_mismatch);
+        },
+        threads, width, whole, mapper, columns, progress_callback
+    );
+
+    if (completed && length_mismatch) {
+        throw segment_length_error("the input is not as long as estimated");
+    }
+    return completed;
+}
+
+// Plan a reduction that all of waveforms can be derived from: the finest
+// one any of them needs. Returns its number of columns.
+std::size_t plan_shared_reduction(
+    sf_count_t frames,
+    const std::vector<waveform_params>& waveforms,
+    reduce_params& params,
+    unsigned& threads
+) {
+    if (waveforms.empty()) {
+        throw std::invalid_argument("no waveforms to render");
+    }
+
+    const waveform_params* finest = &waveforms.front();
+    for (const auto& waveform : waveforms) {
+        if (waveform.percentile_low != finest->percentile_low
+            || waveform.percentile_high != finest->percentile_high) {
+            throw std::invalid_argument("images rendered together must use the same percentiles");
+        }
+        if (waveform.start_frame != finest->start_frame || waveform.end_frame != finest->end_frame) {
+            throw std::invalid_argument("images rendered together must use the same range");
+        }
+        if (waveform.preview_frames > 0) {
+            throw std::invalid_argument("previews are rendered one image at a time");
+        }
+        if (waveform.has_lanes()) {
+            throw std::invalid_argument("lanes are rendered one image at a time");
+        }
+        if (waveform.width > finest->width) {
+            finest = &waveform;
+        }
+    }
+
+    const std::size_t width = plan_reduction(frames, *finest, params, threads);
+
+    params.rms_layer = false;
+    params.statistics = 0;
+    for (const auto& waveform : waveforms) {
+        if (waveform.statistics != 0) {
+            params.statistics = stat_all;
+        }
+        params.raw_median = params.raw_median || waveform.line_only;
+    }
+    params.keep_raw = true;
+
+    return width;
+}
+
+// Merge the statistics of neighbouring columns
+column_statistics merge_statistics(const column_statistics* first, const column_statistics* last) {
+    thread_local std::vector<float> medians;
+    medians.clear();
+
+    column_statistics merged = *first;
+    double sum = 0.0;
+    double sum_sq = 0.0;
+
+    for (const column_statistics* c = first; c != last; ++c) {
+        merged.min_val = std::min(merged.min_val, c->min_val);
+        merged.max_val = std::max(merged.max_val, c->max_val);
+        sum += static_cast<double>(c->mean) * c->samples;
+        sum_sq += static_cast<double>(c->rms) * c->rms * c->samples;
+        medians.push_back(c->median);
+    }
+
+    merged.clipped = 0;
+    merged.samples = 0;
+    for (const column_statistics* c = first; c != last; ++c) {
+        merged.clipped += c->clipped;
+        merged.samples += c->samples;
+    }
+
+    const double count = std::max<double>(1.0, static_cast<double>(merged.samples));
+    merged.mean = static_cast<float>(sum / count);
+    merged.rms = static_cast<float>(std::sqrt(sum_sq / count));
+
+    // Median of the medians, like renders from the peak cache
+    std::nth_element(medians.begin(), medians.begin() + medians.size() / 2, medians.end());
+    merged.median = medians[medians.size() / 2];
+
+    return merged;
+}
+
+// Derive the columns of waveform, frames_per_pixel frames each, from the raw
+// columns of a reduction with source_frames_per_pixel frames per column. Each
+// column merges the source columns starting within its frame range; with the
+// same number of frames per column the result equals a reduction of its own.
+template <typename sample_type>
+void derive_columns(
+    const reduced_columns& source,
+    int source_frames_per_pixel,
+    int frames_per_pixel,
+    const waveform_params& waveform,
+    reduced_columns& columns
+) {
+    using std::size_t;
+
+    const auto source_fpp = static_cast<sf_count_t>(source_frames_per_pixel);
+    const auto fpp = static_cast<sf_count_t>(frames_per_pixel);
+    const size_t source_width = source.raw.size();
+    const size_t width = columns.extents.size();
+
+    thread_local std::vector<double> medians;
+    phase_timer timer(render_phase::reduce);
+
+    with_column_mapper<sample_type>(
+        width, waveform.height, waveform.use_db_scale, waveform.db_min, waveform.db_max, waveform.line_only,
+        [&](const auto& mapper) {
+            for (size_t x = 0; x < width; ++x) {
+                size_t first = static_cast<size_t>((x * fpp + source_fpp - 1) / source_fpp);
+                size_t last = static_cast<size_t>(((x + 1) * fpp + source_fpp - 1) / source_fpp);
+                first = std::min(first, source_width - 1);
+                last = std::clamp(last, first + 1, source_width);
+
+                double min_val = 0.0;
+                double max_val = 0.0;
+                double sum_sq = 0.0;
+                std::uint64_t samples = 0;
+                medians.clear();
+
+                for (size_t i = first; i < last; ++i) {
+                    const raw_column& raw = source.raw[i];
+                    min_val = std::min(min_val, raw.min_val);
+                    max_val = std::max(max_val, raw.max_val);
+                    sum_sq += raw.sum_sq;
+                    samples += raw.samples;
+                    medians.push_back(raw.median);
+                }
+
+                std::nth_element(medians.begin(), medians.begin() + medians.size() / 2, medians.end());
+
+                column_stats<sample_type> stats;
+                stats.min_val = static_cast<sample_type>(min_val);
+                stats.max_val = static_cast<sample_type>(max_val);
+                stats.median = static_cast<sample_type>(medians[medians.size() / 2]);
+                columns.extents[x] = mapper(stats);
+
+                if (waveform.rms_layer) {
+                    const double rms = std::sqrt(sum_sq / std::max<double>(1.0, static_cast<double>(samples)));
+                    columns.rms_extents[x] = mapper(rms_band<sample_type>(rms));
+                }
+
+                if (waveform.statistics != 0) {
+                    columns.statistics[x] = merge_statistics(&source.statistics[first], &source.statistics[0] + last);
+                }
+            }
+            return true;
+        }
+    );
+}
+
+// Derive the images of waveforms from a shared reduction into data. Returns
+// false if cancelled.
+template <typename sample_type>
+bool finish_shared_reduction(
+    const reduced_columns& source,
+    int source_frames_per_pixel,
+    sf_count_t frames,
+    const std::vector<waveform_params>& waveforms,
+    std::vector<waveform_data>& data,
+    const progress_callback_t& progress_callback
+) {
+    data.resize(waveforms.size());
+
+    for (std::size_t i = 0; i < waveforms.size(); ++i) {
+        const waveform_params& waveform = waveforms[i];
+
+        reduce_params params;
+        unsigned threads = 1;
+        const std::size_t width = plan_reduction(frames, waveform, params, threads);
+
+        reduced_columns columns(width, params);
+        derive_columns<sample_type>(source, source_frames_per_pixel, params.frames_per_pixel, waveform, columns);
+
+        // Only the last image reports completion
+        const bool last = i + 1 == waveforms.size();
+        if (!finish_spans(columns, data[i], waveform, params.frame_count, last ? progress_callback : nullptr)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Levels of automatically planned tile pyramids go down to this many frames
+// per column, the resolution of the peak cache
+constexpr sf_count_t tile_min_column_frames = 256;
+
+// Deepest level of a tile pyramid, so that the column counts cannot overflow
+constexpr unsigned max_tile_levels = 24;
+
+sf_count_t ceil_div(sf_count_t a, sf_count_t b) noexcept {
+    return (a + b - 1) / b;
+}
+
+// Merge pairs of neighbouring raw columns into a level of half the
+// resolution. The median of a pair is approximated by the mean of both
+// medians, weighted by their number of samples.
+std::vector<raw_column> merge_column_pairs(const std::vector<raw_column>& level) {
+    std::vector<raw_column> merged((level.size() + 1) / 2);
+
+    for (std::size_t x = 0; x < merged.size(); ++x) {
+        const raw_column& a = level[2 * x];
+        raw_column& column = merged[x];
+        column = a;
+
+        if (2 * x + 1 < level.size()) {
+            const raw_column& b = level[2 * x + 1];
+            column.min_val = std::min(a.min_val, b.min_val);
+            column.max_val = std::max(a.max_val, b.max_val);
+            column.sum_sq += b.sum_sq;
+            column.samples += b.samples;
+            if (column.samples > 0) {
+                column.median = (a.median * a.samples + b.median * b.samples) / column.samples;
+            }
+        }
+    }
+
+    return merged;
+}
+
+// Layers of tile index of a pyramid level with the given columns. The columns
+// next to the tile are mapped along, so that lines continue across tiles.
+template <typename sample_type, typename mapper_type>
+waveform_data make_tile(
+    const std::vector<raw_column>& columns,
+    const tile_level& level,
+    std::size_t index,
+    sf_count_t frames,
+    const waveform_params& tile,
+    const mapper_type& mapper
+) {
+    using std::size_t;
+
+    const size_t first = index * tile.width;
+    const size_t count = std::min<size_t>(tile.width, columns.size() - first);
+    const size_t begin = first > 0 ? first - 1 : first;
+    const size_t end = std::min(columns.size(), first + count + 1);
+
+    std::vector<column_extent> extents(end - begin);
+    std::vector<column_extent> rms_extents(tile.rms_layer ? end - begin : 0);
+
+    for (size_t x = begin; x < end; ++x) {
+        const raw_column& raw = columns[x];
+
+        column_stats<sample_type> stats;
+        stats.min_val = static_cast<sample_type>(raw.min_val);
+        stats.max_val = static_cast<sample_type>(raw.max_val);
+        stats.median = static_cast<sample_type>(raw.median);
+        extents[x - begin] = mapper(stats);
+
+        if (tile.rms_layer) {
+            const double rms = std::sqrt(raw.sum_sq / std::max<double>(1.0, static_cast<double>(raw.samples)));
+            rms_extents[x - begin] = mapper(rms_band<sample_type>(rms));
+        }
+    }
+
+    // Columns past the end of the input stay empty
+    const auto tile_spans = [&](const std::vector<column_extent>& layer, bool line_only) {
+        const std::vector<column_span> spans = build_spans(layer, layer.size(), tile.height, line_only);
+        std::vector<column_span> result(tile.width);
+        std::copy_n(spans.begin() + (first - begin), count, result.begin());
+        return result;
+    };
+
+    waveform_data data;
+    data.spans = tile_spans(extents, tile.line_only);
+    if (tile.rms_layer) {
+        data.rms_spans = tile_spans(rms_extents, false);
+    }
+    data.frames_per_column = level.frames_per_column;
+    data.frames = std::min(static_cast<sf_count_t>(count) * level.frames_per_column,
+                           frames - static_cast<sf_count_t>(first) * level.frames_per_column);
+    data.frames_read = data.frames;
+    return data;
+}
+
+// Rasterize the tiles of all levels on threads workers, coarsest level first,
+// handing each to tile_callback. Progress covers 50 to 100%. Returns false if
+// cancelled.
+template <typename sample_type>
+bool rasterize_tiles(
+    const std::vector<tile_level>& pyramid,
+    const std::vector<std::vector<raw_column>>& level_columns,
+    sf_count_t frames,
+    const waveform_params& tile,
+    const tile_callback_t& tile_callback,
+    const progress_callback_t& progress_callback,
+    unsigned threads
+) {
+    using std::size_t;
+
+    // Tiles are numbered through all levels
+    std::vector<size_t> level_begin;
+    size_t tiles = 0;
+    for (const auto& level : pyramid) {
+        level_begin.push_back(tiles);
+        tiles += level.tiles;
+    }
+    threads = static_cast<unsigned>(std::clamp<size_t>(threads, 1, tiles));
+
+    std::atomic<size_t> next_tile{0};
+    std::atomic<size_t> tiles_done{0};
+    std::atomic<bool> cancelled{false};
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable finished;
+    unsigned workers_running = threads;
+
+    return with_column_mapper<sample_type>(
+        tile.width, tile.height, tile.use_db_scale, tile.db_min, tile.db_max, tile.line_only,
+        [&](const auto& mapper) {
+            const auto work = [&]() {
+                try {
+                    for (size_t t = next_tile++; t < tiles && !cancelled; t = next_tile++) {
+                        const auto level = static_cast<unsigned>(
+                            std::upper_bound(level_begin.begin(), level_begin.end(), t) - level_begin.begin() - 1);
+                        const size_t index = t - level_begin[level];
+
+                        waveform_data data;
+                        {
+                            phase_timer timer(render_phase::reduce);
+                            data = make_tile<sample_type>(
+                                level_columns[level], pyramid[level], index, frames, tile, mapper);
+                        }
+                        if (!tile_callback(level, index, data)) {
+                            cancelled = true;
+                        }
+                        ++tiles_done;
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    cancelled = true;
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                --workers_running;
+                finished.notify_one();
+            };
+
+            std::vector<std::thread> workers;
+            workers.reserve(threads);
+            for (unsigned t = 0; t < threads; ++t) {
+                workers.emplace_back(work);
+            }
+
+            // Report progress while the workers run
+            int last_percent = -1;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (workers_running > 0) {
+                    finished.wait_for(lock, std::chrono::milliseconds(50));
+
+                    const int percent = static_cast<int>(50 + 50 * tiles_done.load() / tiles);
+                    if (percent != last_percent && !cancelled) {
+                        last_percent = percent;
+                        if (progress_callback && !progress_callback(percent)) {
+                            cancelled = true;
+                        }
+                    }
+                }
+            }
+
+            for (auto& worker : workers) {
+                worker.join();
+            }
+
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            return !cancelled;
+        }
+    );
+}
+
+// Streamed input is reduced into at most this many buckets per column. They
+// start one frame long and double in length whenever they fill up.
+constexpr std::size_t stream_buckets_per_column = 16;
+
+// Frames read between looking at the clock for snapshots, at least one bucket
+constexpr sf_count_t stream_batch_frames = 16384;
+
+// Derive the layers of waveform from the buckets of a stream of frames frames,
+// bucket_frames frames each. Returns false if cancelled.
+template <typename sample_type>
+bool finish_stream(
+    const std::vector<raw_column>& buckets,
+    int bucket_frames,
+    sf_count_t frames,
+    const waveform_params& waveform,
+    waveform_data& data,
+    const progress_callback_t& progress_callback
+) {
+    reduce_params params;
+    unsigned threads = 1;
+    const std::size_t width = plan_reduction(frames, waveform, params, threads);
+
+    // An empty stream still has an (empty) column to draw
+    reduced_columns source(0, reduce_params());
+    source.raw = buckets;
+    if (source.raw.empty()) {
+        source.raw.emplace_back();
+    }
+
+    reduced_columns columns(width, params);
+    derive_columns<sample_type>(source, bucket_frames, params.frames_per_pixel, waveform, columns);
+
+    return finish_spans(columns, data, waveform, params.frame_count, progress_callback);
+}
+
+// Reduces a stream of frames into buckets, see
+// compute_waveform_spans_streaming
+template <typename sample_type>
+class stream_reducer {
+public:
+    stream_reducer(int channels, const waveform_params& waveform)
+        : waveform_(waveform),
+          channels_(static_cast<std::uint64_t>(channels)),
+          max_buckets_(stream_buckets_per_column * waveform.width),
+          batch_(max_buckets_, bucket_params()) {
+        if (waveform.use_percentiles() || waveform.statistics != 0 || waveform.has_range() || waveform.preview_frames > 0
+            || waveform.has_lanes()) {
+            throw std::invalid_argument(
+                "streamed input can only be rendered as a whole, without percentiles, statistics or lanes");
+        }
+        params_ = bucket_params();
+        buckets_.reserve(max_buckets_);
+    }
+
+    // Frames reduce() takes at once, which callers pushing frames collect
+    // before reducing them
+    sf_count_t batch_frames() const noexcept {
+        return static_cast<sf_count_t>(batch_columns()) * params_.frames_per_pixel;
+    }
+
+    // Reduce the next batch of frames from reader. A bucket that comes up
+    // short marks the end of the input. Returns false once it has been reached.
+    template <typename reader_type>
+    bool reduce(reader_type& reader) {
+        const std::size_t count = batch_columns();
+        reduce_columns<sample_type>(reader, 0, count, params_, raw_mapper<sample_type>(), batch_, nullptr);
+
+        bool end = false;
+        for (std::size_t x = 0; x < count && !end; ++x) {
+            const raw_column& bucket = batch_.raw[x];
+            if (bucket.samples > 0) {
+                buckets_.push_back(bucket);
+                frames_ += static_cast<sf_count_t>(bucket.samples / channels_);
+            }
+            end = bucket.samples < static_cast<std::uint64_t>(params_.frames_per_pixel) * channels_;
+        }
+
+        if (!end && buckets_.size() == max_buckets_) {
+            if (params_.frames_per_pixel > std::numeric_limits<int>::max() / 2) {
+                throw std::runtime_error("streamed input is too long");
+            }
+            buckets_ = merge_column_pairs(buckets_);
+            params_.frames_per_pixel *= 2;
+        }
+
+        return !end;
+    }
+
+    // Derive the layers of the waveform read so far. Returns false if
+    // cancelled.
+    bool finish(waveform_data& data, const progress_callback_t& progress_callback) const {
+        return finish_stream<sample_type>(buckets_, params_.frames_per_pixel, frames_, waveform_, data, progress_callback);
+    }
+
+private:
+    // Buckets are reduced like columns of an input without end
+    reduce_params bucket_params() const {
+        reduce_params params;
+        params.frame_count = std::numeric_limits<sf_count_t>::max();
+        params.keep_raw = true;
+        params.raw_median = waveform_.line_only;
+        return params;
+    }
+
+    std::size_t batch_columns() const noexcept {
+        return std::min<std::size_t>(
+            max_buckets_ - buckets_.size(),
+            static_cast<std::size_t>(std::max<sf_count_t>(1, stream_batch_frames / params_.frames_per_pixel)));
+    }
+
+    waveform_params waveform_;
+    std::uint64_t channels_;
+    std::size_t max_buckets_;
+    reduce_params params_;
+    reduced_columns batch_;
+    std::vector<raw_column> buckets_;
+    sf_count_t frames_ = 0;
+};
+
+// Reduce wav in a single pass, see compute_waveform_spans_streaming
+template <typename sample_type>
+bool reduce_stream(
+    const SndfileHandle& wav,
+    waveform_data& data,
+    const waveform_params& waveform,
+    const progress_callback_t& progress_callback,
+    double snapshot_interval,
+    const snapshot_callback_t& snapshot
+) {
+    using clock = std::chrono::steady_clock;
+
+    sndfile_reader<sample_type> reader(wav);
+    stream_reducer<sample_type> reducer(wav.channels(), waveform);
+
+    const auto interval = std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(snapshot_interval));
+    auto next_snapshot = clock::now() + interval;
+
+    while (reducer.reduce(reader)) {
+        if (snapshot && snapshot_interval > 0.0 && clock::now() >= next_snapshot) {
+            waveform_data current;
+            if (!reducer.finish(current, nullptr) || !snapshot(current)) {
+                return false;
+            }
+            next_snapshot = clock::now() + interval;
+        }
+    }
+
+    return reducer.finish(data, progress_callback);
+}
+
+// Hands out frames pushed by the caller in place, like sndfile_reader reads
+// them
+template <typename sample_type>
+class pushed_reader {
+public:
+    pushed_reader(const sample_type* samples, std::size_t count, int channels)
+        : samples_(samples), count_(count), channels_(channels) {}
+
+    int channels() const { return channels_; }
+
+    const sample_type* read(int frame_count, sf_count_t& n) {
+        const std::size_t count = std::min(count_ - next_, static_cast<std::size_t>(frame_count) * channels_);
+        const sample_type* samples = samples_ + next_;
+        next_ += count;
+        n = static_cast<sf_count_t>(count);
+        return samples;
+    }
+
+    std::size_t consumed() const noexcept { return next_; }
+
+private:
+    const sample_type* samples_;
+    std::size_t count_;
+    int channels_;
+    std::size_t next_ = 0;
+};
+
+} // anonymous namespace
+
+bool has_wide_samples(const SndfileHandle& wav) {
+    return with_native_sample_type(wav, [](auto sample) {
+        return !std::is_same<decltype(sample), short>::value;
+    });
+}
+
+std::vector<waveform_lane> resolve_lanes(const waveform_params& params, int channels) {
+    std::vector<waveform_lane> lanes = params.lanes;
+    if (params.split_channels) {
+        lanes.clear();
+        for (int channel = 0; channel < channels; ++channel) {
+            lanes.push_back({ lane_source::channel, channel });
+        }
+    }
+    if (lanes.empty()) {
+        lanes.emplace_back();
+    }
+
+    check_lane_channels(lanes, channels);
+    if (params.height < lanes.size()) {
+        throw std::invalid_argument(
+            "an image of " + std::to_string(params.height) + " rows cannot hold "
+            + std::to_string(lanes.size()) + " lanes");
+    }
+    return lanes;
+}
+
+bool compute_waveform_spans(
+    const SndfileHandle& wav,
+    waveform_data& data,
+    const waveform_params& waveform,
+    progress_callback_t progress_callback,
+    unsigned threads,
+    reopen_callback_t reopen,
+    const MappedPcmFile* mapped
+) {
+    using std::size_t;
+
+    reduce_params params;
+    const size_t width = plan_reduction(wav.frames(), waveform, params, threads);
+    const unsigned height = plan_lanes(waveform, wav.channels(), params);
+
+    reduced_columns columns(width, params);
+
+    const bool completed = with_native_sample_type(wav, [&](auto sample) {
+        using sample_type = decltype(sample);
+
+        return with_column_mapper<sample_type>(
+            width, height, waveform.use_db_scale, waveform.db_min, waveform.db_max, waveform.line_only,
+            [&](const auto& mapper) {
+                return reduce_input<sample_type>(
+                    wav, width, params, mapper, columns, progress_callback, threads, reopen, mapped);
+            }
+        );
+    });
+
+    return completed && finish_spans(columns, data, waveform, params.frame_count, progress_callback);
+}
+
+bool compute_waveform_spans(
+    const SndfileHandle& wav,
+    std::vector<waveform_data>& data,
+    const std::vector<waveform_params>& waveforms,
+    progress_callback_t progress_callback,
+    unsigned threads,
+    reopen_callback_t reopen,
+    const MappedPcmFile* mapped
+) {
+    reduce_params params;
+    const std::size_t width = plan_shared_reduction(wav.frames(), waveforms, params, threads);
+
+    reduced_columns columns(width, params);
+
+    return with_native_sample_type(wav, [&](auto sample) {
+        using sample_type = decltype(sample);
+
+        const bool completed = reduce_input<sample_type>(
+            wav, width, params, raw_mapper<sample_type>(), columns, progress_callback, threads, reopen, mapped);
+
+        return completed && finish_shared_reduction<sample_type>(
+            columns, params.frames_per_pixel, wav.frames(), waveforms, data, progress_callback);
+    });
+}
+
+bool compute_waveform_spans_segmented(
+    sf_count_t frames,
+    int channels,
+    const segment_callback_t& open_segment,
+    waveform_data& data,
+    const waveform_params& waveform,
+    progress_callback_t progress_callback,
+    unsigned threads
+) {
+    using std::size_t;
+
+    // Segments are converted to 16 bit PCM
+    using sample_type = short;
+
+    reduce_params params;
+    const size_t width = plan_reduction(frames, waveform, params, threads);
+    const unsigned height = plan_lanes(waveform, channels, params);
+
+    reduced_columns columns(width, params);
+
+    const bool completed = with_column_mapper<sample_type>(
+        width, height, waveform.use_db_scale, waveform.db_min, waveform.db_max, waveform.line_only,
+        [&](const auto& mapper) {
+            return reduce_segments<sample_type>(
+                open_segment, width, params, mapper, columns, progress_callback, threads,
+                params.first_frame + params.frame_count >= frames);
+        }
+    );
+
+    return completed && finish_spans(columns, data, waveform, params.frame_count, progress_callback);
+}
+
+bool compute_waveform_spans_segmented(
+    sf_count_t frames,
+    const segment_callback_t& open_segment,
+    std::vector<waveform_data>& data,
+    const std::vector<waveform_params>& waveforms,
+    progress_callback_t progress_callback,
+    unsigned threads
+) {
+    // Segments are converted to 16 bit PCM
+    using sample_type = short;
+
+    reduce_params params;
+    const std::size_t width = plan_shared_reduction(frames, waveforms, params, threads);
+
+    reduced_columns columns(width, params);
+
+    const bool completed = reduce_segments<sample_type>(
+        open_segment, width, params, raw_mapper<sample_type>(), columns, progress_callback, threads,
+        params.first_frame + params.frame_count >= frames);
+
+    return completed && finish_shared_reduction<sample_type>(
+        columns, params.frames_per_pixel, frames, waveforms, data, progress_callback);
+}
+
+std::vector<tile_level> plan_tile_pyramid(sf_count_t frames, unsigned tile_width, unsigned levels) {
+    if (tile_width == 0) {
+        throw std::invalid_argument("tiles must be at least one column wide");
+    }
+    if (levels > max_tile_levels) {
+        throw std::invalid_argument("a tile pyramid has at most " + std::to_string(max_tile_levels) + " levels");
+    }
+
+    frames = std::max<sf_count_t>(1, frames);
+    const auto width = static_cast<sf_count_t>(tile_width);
+
+    if (levels == 0) {
+        levels = 1;
+        while (levels < max_tile_levels && ceil_div(frames, width << (levels - 1)) > tile_min_column_frames) {
+            ++levels;
+        }
+    }
+
+    // Level 0 has the deepest level's columns merged levels - 1 times, which
+    // always fits into one tile
+    const sf_count_t deepest_frames_per_column = ceil_div(frames, width << (levels - 1));
+
+    std::vector<tile_level> pyramid(levels);
+    for (unsigned z = 0; z < levels; ++z) {
+        tile_level& level = pyramid[z];
+        level.frames_per_column = deepest_frames_per_column << (levels - 1 - z);
+        level.columns = static_cast<std::size_t>(ceil_div(frames, level.frames_per_column));
+        level.tiles = static_cast<std::size_t>(ceil_div(static_cast<sf_count_t>(level.columns), width));
+    }
+
+    return pyramid;
+}
+
+bool compute_tile_pyramid(
+    const SndfileHandle& wav,
+    const waveform_params& tile,
+    unsigned levels,
+    const tile_callback_t& tile_callback,
+    progress_callback_t progress_callback,
+    unsigned threads,
+    reopen_callback_t reopen,
+    const MappedPcmFile* mapped
+) {
+    if (tile.has_lanes()) {
+        throw std::invalid_argument("tiles cannot have lanes");
+    }
+
+    reduce_params params;
+    const sf_count_t frames = plan_range(wav.frames(), tile, params);
+    const std::vector<tile_level> pyramid = plan_tile_pyramid(frames, tile.width, levels);
+    const tile_level& deepest = pyramid.back();
+
+    // Only the deepest level is reduced from the audio
+    params.frames_per_pixel = static_cast<int>(deepest.frames_per_column);
+    params.use_percentiles = tile.use_percentiles();
+    params.percentile_low = tile.percentile_low;
+    params.percentile_high = tile.percentile_high;
+    params.keep_raw = true;
+    params.raw_median = tile.line_only;
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    const auto reduce_threads = static_cast<unsigned>(std::min<std::size_t>(threads, deepest.columns));
+
+    reduced_columns columns(deepest.columns, params);
+
+    // Decoding takes the first half of the progress, the tiles the second
+    const progress_callback_t decode_progress = [&progress_callback](int percent) {
+        return !progress_callback || progress_callback(percent / 2);
+    };
+
+    return with_native_sample_type(wav, [&](auto sample) {
+        using sample_type = decltype(sample);
+
+        if (!reduce_input<sample_type>(
+                wav, deepest.columns, params, raw_mapper<sample_type>(), columns, decode_progress,
+                reduce_threads, reopen, mapped)) {
+            return false;
+        }
+
+        // Every other level is merged from the one below it
+        std::vector<std::vector<raw_column>> level_columns(pyramid.size());
+        level_columns.back() = std::move(columns.raw);
+        {
+            phase_timer timer(render_phase::reduce);
+            for (std::size_t z = pyramid.size() - 1; z-- > 0;) {
+                level_columns[z] = merge_column_pairs(level_columns[z + 1]);
+            }
+        }
+
+        return rasterize_tiles<sample_type>(
+            pyramid, level_columns, frames, tile, tile_callback, progress_callback, threads);
+    });
+}
+
+bool compute_waveform_spans_streaming(
+    const SndfileHandle& wav,
+    waveform_data& data,
+    const waveform_params& waveform,
+    progress_callback_t progress_callback,
+    double snapshot_interval,
+    const snapshot_callback_t& snapshot
+) {
+    return with_native_sample_type(wav, [&](auto sample) {
+        return reduce_stream<decltype(sample)>(wav, data, waveform, progress_callback, snapshot_interval, snapshot);
+    });
+}
+
+struct WaveformStream::impl {
+    virtual ~impl() = default;
+    virtual void push(const void* samples, std::size_t frames) = 0;
+    virtual bool finish(waveform_data& data, const progress_callback_t& progress_callback) = 0;
+};
+
+namespace {
+
+template <typename sample_type>
+class waveform_stream_impl : public WaveformStream::impl {
+public:
+    waveform_stream_impl(int channels, const waveform_params& waveform)
+        : channels_(channels), reducer_(channels, waveform) {}
+
+    // Reduce whole batches only, so that the end of a push is not taken for
+    // the end of the input. The rest waits for the next push.
+    void push(const void* samples, std::size_t frames) override {
+        const auto* first = static_cast<const sample_type*>(samples);
+        pending_.insert(pending_.end(), first, first + frames * channels_);
+
+        std::size_t consumed = 0;
+        for (;;) {
+            const auto batch_samples = static_cast<std::size_t>(reducer_.batch_frames()) * channels_;
+            if (pending_.size() - consumed < batch_samples) {
+                break;
+            }
+            pushed_reader<sample_type> reader(pending_.data() + consumed, batch_samples, channels_);
+            reducer_.reduce(reader);
+            consumed += reader.consumed();
+        }
+        pending_.erase(pending_.begin(), pending_.begin() + consumed);
+    }
+
+    bool finish(waveform_data& data, const progress_callback_t& progress_callback) override {
+        pushed_reader<sample_type> reader(pending_.data(), pending_.size(), channels_);
+        while (reducer_.reduce(reader)) {
+        }
+        pending_.clear();
+        return reducer_.finish(data, progress_callback);
+    }
+
+private:
+    int channels_;
+    stream_reducer<sample_type> reducer_;
+    std::vector<sample_type> pending_;
+};
+
+} // anonymous namespace
+
+WaveformStream::WaveformStream(int channels, pcm_format format, const waveform_params& waveform)
+    : format_(format) {
+    if (channels <= 0) {
+        throw std::invalid_argument("a stream needs at least one channel");
+    }
+
+    switch (format) {
+    case pcm_format::s16:
+        impl_ = std::make_unique<waveform_stream_impl<short>>(channels, waveform);
+        break;
+    case pcm_format::s32:
+        impl_ = std::make_unique<waveform_stream_impl<int>>(channels, waveform);
+        break;
+    case pcm_format::f32:
+        impl_ = std::make_unique<waveform_stream_impl<float>>(channels, waveform);
+        break;
+    }
+}
+
+WaveformStream::~WaveformStream() = default;
+
+void WaveformStream::push(const short* samples, std::size_t frames) {
+    push(pcm_format::s16, samples, frames);
+}
+
+void WaveformStream::push(const int* samples, std::size_t frames) {
+    push(pcm_format::s32, samples, frames);
+}
+
+void WaveformStream::push(const float* samples, std::size_t frames) {
+    push(pcm_format::f32, samples, frames);
+}
+
+void WaveformStream::push(pcm_format format, const void* samples, std::size_t frames) {
+    if (format != format_) {
+        throw std::invalid_argument("samples pushed in a different format than the stream was created with");
+    }
+    if (!impl_) {
+        throw std::logic_error("samples pushed after the stream was finished");
+    }
+    impl_->push(samples, frames);
+}
+
+bool WaveformStream::finish(waveform_data& data, progress_callback_t progress_callback) {
+    if (!impl_) {
+        throw std::logic_error("stream finished twice");
+    }
+    const bool completed = impl_->finish(data, progress_callback);
+    impl_.reset();
+    return completed;
+}
+
+bool compute_waveform_spans_from_peaks(
+    const PeakCache& peaks,
+    waveform_data& data,
+    const waveform_params& waveform,
+    progress_callback_t progress_callback
+) {
+    using std::size_t;
+
+    const unsigned width = waveform.width;
+
+    reduce_params params;
+    const sf_count_t frames = plan_range(peaks.frames(), waveform, params);
+
+    if (!peaks.can_render(width, frames)) {
+        throw std::runtime_error("peak cache is too coarse for the requested width");
+    }
+
+    const sf_count_t frames_per_pixel = frames / static_cast<sf_count_t>(width);
+    params.frames_per_pixel = static_cast<int>(frames_per_pixel);
+    reduced_columns columns(width, params);
+    phase_timer timer(render_phase::reduce);
+
+    with_column_mapper<short>(
+        width, waveform.height, waveform.use_db_scale, waveform.db_min, waveform.db_max, waveform.line_only,
+        [&](const auto& mapper) {
+            std::vector<short> medians;
+            for (size_t x = 0; x < width; ++x) {
+                const peak_bucket bucket = peaks.query(
+                    params.first_frame + x * frames_per_pixel, frames_per_pixel, medians);
+
+                column_stats<short> stats;
+                stats.min_val = bucket.min_val;
+                stats.max_val = bucket.max_val;
+                stats.median = bucket.median;
+
+                columns.extents[x] = mapper(stats);
+            }
+            return true;
+        }
+    );
+
+    return finish_spans(columns, data, waveform, frames, progress_callback);
+}
+
+void compute_waveform(
+    const SndfileHandle& wav,
+    png::image<png::rgba_pixel>& out_image,
+    const png::rgba_pixel& bg_color,
+    const png::rgba_pixel& fg_color,
+    bool use_db_scale,
+    float db_min,
+    float db_max,
+    bool line_only,
+    progress_callback_t progress_callback,
+    unsigned threads,
+    reopen_callback_t reopen,
+    const MappedPcmFile* mapped
+) {
+    const auto h = out_image.get_height();
+
+    waveform_data data;
+    if (compute_waveform_spans(
+            wav, data, make_waveform_params(out_image, use_db_scale, db_min, db_max, line_only),
+            progress_callback, threads, reopen, mapped)) {
+        rasterize(data.spans, 0, h, bg_color, fg_color, out_image);
+    }
+}
+
+void compute_waveform_from_peaks(
+    const PeakCache& peaks,
+    png::image<png::rgba_pixel>& out_image,
+    const png::rgba_pixel& bg_color,
+    const png::rgba_pixel& fg_color,
+    bool use_db_scale,
+    float db_min,
+    float db_max,
+    bool line_only,
+    progress_callback_t progress_callback
+) {
+    const auto h = out_image.get_height();
+
+    waveform_data data;
+    if (compute_waveform_spans_from_peaks(
+            peaks, data, make_waveform_params(out_image, use_db_scale, db_min, db_max, line_only),
+            progress_callback)) {
+        rasterize(data.spans, 0, h, bg_color, fg_color, out_image);
     }
 }
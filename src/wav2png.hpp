@@ -2,10 +2,221 @@
 
 #include <sndfile.hh>
 #include <png++/png.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "rasterizer.hpp"
 
 using progress_callback_t = std::function<bool(int)>;
 
+// Opens an independent handle onto the input, so that worker threads can seek
+// to their own column range
+using reopen_callback_t = std::function<SndfileHandle()>;
+
+// Opens a handle that delivers frame_count frames of the input, starting at
+// first_frame, or all frames up to its end if frame_count is negative
+using segment_callback_t = std::function<SndfileHandle(sf_count_t first_frame, sf_count_t frame_count)>;
+
+// Raised when an input rendered in segments turns out to be longer or shorter
+// than estimated. It should be rendered in one pass instead.
+class segment_length_error : public std::runtime_error {
+public:
+    explicit segment_length_error(const std::string& message)
+        : std::runtime_error(message) {}
+};
+
+// Signal shown by a lane of a waveform image
+enum class lane_source {
+    mix,        // all channels, the envelope of every sample of a column
+    channel,    // a single channel
+    mid,        // (left + right) / 2 of the first two channels
+    side,       // (left - right) / 2 of the first two channels
+    downmix     // the mean of all channels of each frame
+};
+
+struct waveform_lane {
+    lane_source source = lane_source::mix;
+    int channel = 0;    // 0-based, of lane_source::channel
+};
+
+// Geometry and appearance of a waveform image
+struct waveform_params {
+    unsigned width = 1800;
+    unsigned height = 280;
+
+    bool use_db_scale = false;
+    float db_min = -48.0f;
+    float db_max = 0.0f;
+    bool line_only = false;
+
+    // Fill between these percentiles of each column instead of between its
+    // minimum and maximum. The envelope always includes the zero line.
+    float percentile_low = 0.0f;
+    float percentile_high = 100.0f;
+
+    // Also draw the RMS of each column, as a band around the zero line
+    bool rms_layer = false;
+
+    // Statistics to collect per column into waveform_data::columns, a mask of
+    // column_statistic values
+    unsigned statistics = 0;
+
+    // Frames [start_frame, end_frame) of the input are rendered, up to the end
+    // of the input if end_frame is negative
+    sf_count_t start_frame = 0;
+    sf_count_t end_frame = -1;
+
+    // Preview: read at most this many frames of each column, in evenly spaced
+    // windows, instead of all of them. Only single images from inputs that
+    // can seek are previewed, others are read whole. 0 reads every frame.
+    sf_count_t preview_frames = 0;
+
+    // Lanes stacked from top to bottom, each getting an equal share of the
+    // height, or one lane per channel of the input if split_channels is set.
+    // Without lanes, the image shows all channels mixed. Statistics are always
+    // taken of all channels mixed.
+    std::vector<waveform_lane> lanes;
+    bool split_channels = false;
+
+    bool use_percentiles() const noexcept {
+        return percentile_low > 0.0f || percentile_high < 100.0f;
+    }
+
+    bool has_range() const noexcept {
+        return start_frame > 0 || end_frame >= 0;
+    }
+
+    // Number of frames rendered of an input of input_frames frames
+    sf_count_t range_frames(sf_count_t input_frames) const noexcept {
+        const sf_count_t end = end_frame < 0 ? input_frames : std::min(end_frame, input_frames);
+        return std::max<sf_count_t>(0, end - start_frame);
+    }
+
+    bool has_lanes() const noexcept {
+        return !lanes.empty() || split_channels;
+    }
+
+    // True if the render needs more than the peak cache holds. Its medians
+    // are medians of bucket medians, too far from those of the columns for
+    // line-only images.
+    bool needs_audio() const noexcept {
+        return line_only || use_percentiles() || rms_layer || statistics != 0 || has_lanes();
+    }
+};
+
+// Statistics that can be collected per column, all computed in the same pass
+// over the samples that finds the envelope
+enum column_statistic : unsigned {
+    stat_peak = 1 << 0,     // minimum and maximum
+    stat_mean = 1 << 1,     // mean, i.e. DC offset
+    stat_rms = 1 << 2,
+    stat_median = 1 << 3,
+    stat_clipped = 1 << 4,  // number of samples at full scale
+    stat_all = (1 << 5) - 1
+};
+
+// Statistics of one reduced column, all channels mixed. Values are scaled to
+// [-1, 1]; fields not requested are left 0.
+struct column_statistics {
+    float min_val = 0.0f;
+    float max_val = 0.0f;
+    float mean = 0.0f;
+    float rms = 0.0f;
+    float median = 0.0f;
+    std::uint64_t clipped = 0;
+    std::uint64_t samples = 0;
+};
+
+// Layers of a lane of a waveform image, see waveform_data
+struct lane_layers {
+    std::vector<column_span> spans;
+    std::vector<column_span> rms_spans;
+};
+
+// Result of reducing a waveform: the layers of the image and the requested
+// statistics
+struct waveform_data {
+    // Foreground spans of the envelope (or the line in line-only mode), one
+    // per image column
+    std::vector<column_span> spans;
+
+    // RMS band, one span per image column if waveform_params::rms_layer is set
+    std::vector<column_span> rms_spans;
+
+    // Layers of the lanes below the first one, whose layers are spans and
+    // rms_spans. All spans are in rows of the whole image.
+    std::vector<lane_layers> lanes;
+
+    // Statistics of every reduced column. There may be fewer reduced columns
+    // than image columns for very short inputs.
+    std::vector<column_statistics> columns;
+
+    // Length of the input and of each reduced column, in frames
+    sf_count_t frames = 0;
+    sf_count_t frames_per_column = 0;
+
+    // Frames actually read, fewer than frames for previews, and the estimated
+    // shortfall of the column peaks against reading every frame, as a fraction
+    // of full scale: the mean over all columns and the largest
+    sf_count_t frames_read = 0;
+    float peak_error = 0.0f;
+    float max_peak_error = 0.0f;
+};
+
+class MappedPcmFile;
+
+// The lanes of params for an input of the given number of channels, a single
+// lane of all channels mixed if it has none. Throws std::invalid_argument if
+// a lane needs channels the input does not have, or the image is too short.
+std::vector<waveform_lane> resolve_lanes(const waveform_params& params, int channels);
+
+// True if wav has samples wider than 16 bits, which are reduced as int or
+// float rather than short
+bool has_wide_samples(const SndfileHandle& wav);
+
+// Reduce the waveform of wav into the layers of an image, see
+// compute_waveform. Returns false if cancelled.
+bool compute_waveform_spans(
+    const SndfileHandle& wav,
+    waveform_data& data,
+    const waveform_params& params,
+    progress_callback_t progress_callback,
+    unsigned threads = 1,
+    reopen_callback_t reopen = nullptr,
+    const MappedPcmFile* mapped = nullptr
+);
+
+// Reduce the waveform of wav into the layers of several images at once, e.g.
+// the sizes and styles of an asset pipeline. The input is decoded and reduced
+// once, at the resolution of the widest image; the columns of the others are
+// merged from that reduction. Images of the widest resolution are identical
+// to separate renders, the others may differ by a pixel at column boundaries.
+// All images must use the same percentiles and have no lanes. Returns false
+// if cancelled.
+bool compute_waveform_spans(
+    const SndfileHandle& wav,
+    std::vector<waveform_data>& data,
+    const std::vector<waveform_params>& waveforms,
+    progress_callback_t progress_callback,
+    unsigned threads = 1,
+    reopen_callback_t reopen = nullptr,
+    const MappedPcmFile* mapped = nullptr
+);
+
+// Render the waveform of wav into out_image. With threads > 1 (0 = one per CPU
+// core) the columns are split into ranges that are reduced in parallel, each
+// from its own handle obtained through reopen. Inputs that cannot be reopened
+// or seeked (e.g. ffmpeg FIFOs) are rendered on the calling thread. The output
+// does not depend on the number of threads.
+//
+// If mapped is given, samples are read from the mapping instead of through
+// wav where its encoding allows it.
 void compute_waveform(
     const SndfileHandle& wav,
     png::image<png::rgba_pixel>& out_image,
@@ -15,5 +226,166 @@ void compute_waveform(
     float db_min,
     float db_max,
     bool line_only,
+    progress_callback_t progress_callback,
+    unsigned threads = 1,
+    reopen_callback_t reopen = nullptr,
+    const MappedPcmFile* mapped = nullptr
+);
+
+// Like compute_waveform_spans, for inputs that cannot be read as a whole but
+// only in independently opened segments, e.g. time slices of a compressed
+// file decoded by separate ffmpeg processes. Each worker reads its column
+// range from a segment of its own. frames is the (estimated) length of the
+// input, channels the number of channels of its segments. If the range
+// reaches the end of the input, the last segment is read to its actual end,
+// and segment_length_error is thrown if that is not where frames estimated.
+bool compute_waveform_spans_segmented(
+    sf_count_t frames,
+    int channels,
+    const segment_callback_t& open_segment,
+    waveform_data& data,
+    const waveform_params& params,
+    progress_callback_t progress_callback,
+    unsigned threads = 1
+);
+
+// compute_waveform_spans_segmented for several images at once, see the
+// overload of compute_waveform_spans for several images. Lanes are only
+// rendered into single images.
+bool compute_waveform_spans_segmented(
+    sf_count_t frames,
+    const segment_callback_t& open_segment,
+    std::vector<waveform_data>& data,
+    const std::vector<waveform_params>& waveforms,
+    progress_callback_t progress_callback,
+    unsigned threads = 1
+);
+
+// One zoom level of a tile pyramid
+struct tile_level {
+    sf_count_t frames_per_column = 0;
+    std::size_t columns = 0;
+    std::size_t tiles = 0;
+};
+
+// Called for every tile of a pyramid, possibly from several threads at once.
+// data holds the layers of a tile image of the requested width; columns past
+// the end of the input are empty. data.frames is the number of frames the
+// tile covers. Returning false cancels the render.
+using tile_callback_t = std::function<bool(unsigned level, std::size_t index, const waveform_data& data)>;
+
+// Zoom levels of a tile pyramid over frames frames with tiles of tile_width
+// columns. Level 0 shows everything in a single tile, every further level has
+// twice as many columns of half as many frames. With levels = 0 the deepest
+// level is the first one with no more than 256 frames per column.
+std::vector<tile_level> plan_tile_pyramid(sf_count_t frames, unsigned tile_width, unsigned levels = 0);
+
+// Render the tiles of a pyramid over the range of wav given in params, whose
+// width and height are those of a tile. The input is decoded once, at the
+// resolution of the deepest level; every other level is merged from the level
+// below it. Tiles are rasterized and handed to tile_callback on threads
+// workers (0 = one per CPU core), which also decode the input where it can be
+// read in parallel, see compute_waveform. Tiles have no lanes. Returns false
+// if cancelled.
+bool compute_tile_pyramid(
+    const SndfileHandle& wav,
+    const waveform_params& params,
+    unsigned levels,
+    const tile_callback_t& tile_callback,
+    progress_callback_t progress_callback,
+    unsigned threads = 1,
+    reopen_callback_t reopen = nullptr,
+    const MappedPcmFile* mapped = nullptr
+);
+
+// Called with the waveform of the input read so far while streaming. Returning
+// false cancels the render.
+using snapshot_callback_t = std::function<bool(const waveform_data& data)>;
+
+// Reduce the waveform of wav in a single pass without relying on its length,
+// for inputs whose length is unknown or wrong, like pipes, live capture or
+// ffmpeg FIFOs. Frames are reduced into at most sixteen buckets per column,
+// which start one frame long and are merged in pairs whenever they fill up,
+// so memory use does not depend on the length of the input. The columns are
+// derived from the buckets once the input ends. A bucket straddling two
+// columns counts towards one of them, so the envelopes near column
+// boundaries may differ from compute_waveform_spans, and medians are
+// approximated. Percentiles, statistics, ranges, previews and lanes are not
+// supported.
+//
+// With a snapshot_interval greater than 0, snapshot is called with the
+// waveform read so far about every snapshot_interval seconds. Progress is only
+// reported on completion. Returns false if cancelled.
+bool compute_waveform_spans_streaming(
+    const SndfileHandle& wav,
+    waveform_data& data,
+    const waveform_params& params,
+    progress_callback_t progress_callback,
+    double snapshot_interval = 0.0,
+    const snapshot_callback_t& snapshot = nullptr
+);
+
+// Sample formats of interleaved frames pushed into a WaveformStream
+enum class pcm_format {
+    s16,    // 16 bit integer
+    s32,    // left-justified 32 bit integer, e.g. 24 bit samples shifted up
+    f32     // float in [-1, 1]
+};
+
+// Reduces interleaved frames that the caller pushes in blocks of any size,
+// like compute_waveform_spans_streaming reduces them from a file, for callers
+// that produce or decode the audio themselves. Memory use does not depend on
+// the length of the input: frames are only held until a batch of buckets is
+// complete.
+class WaveformStream {
+public:
+    WaveformStream(int channels, pcm_format format, const waveform_params& params);
+    ~WaveformStream();
+
+    WaveformStream(const WaveformStream&) = delete;
+    WaveformStream& operator=(const WaveformStream&) = delete;
+
+    // Push frames frames of channels samples each. The pointer type must match
+    // the format of the stream.
+    void push(const short* samples, std::size_t frames);
+    void push(const int* samples, std::size_t frames);
+    void push(const float* samples, std::size_t frames);
+
+    // End the input and derive the layers of the waveform. Returns false if
+    // cancelled. Nothing can be pushed afterwards.
+    bool finish(waveform_data& data, progress_callback_t progress_callback = nullptr);
+
+    struct impl;
+
+private:
+    void push(pcm_format format, const void* samples, std::size_t frames);
+
+    pcm_format format_;
+    std::unique_ptr<impl> impl_;
+};
+
+class PeakCache;
+
+// Reduce the waveform from a peak cache into the foreground spans of an image.
+// Percentiles, the RMS layer and statistics are not available from the cache.
+// Returns false if cancelled.
+bool compute_waveform_spans_from_peaks(
+    const PeakCache& peaks,
+    waveform_data& data,
+    const waveform_params& params,
+    progress_callback_t progress_callback
+);
+
+// Render the waveform from a peak cache instead of the audio. The cache must
+// have at least one bucket per column, see PeakCache::can_render.
+void compute_waveform_from_peaks(
+    const PeakCache& peaks,
+    png::image<png::rgba_pixel>& out_image,
+    const png::rgba_pixel& bg_color,
+    const png::rgba_pixel& fg_color,
+    bool use_db_scale,
+    float db_min,
+    float db_max,
+    bool line_only,
     progress_callback_t progress_callback
 );